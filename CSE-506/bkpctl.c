@@ -5,6 +5,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 
 #define LIST_FLAG 0x1
 #define DELETE_FLAG 0x2
@@ -16,15 +20,44 @@ void invalid_option(char *prog_name)
 	printf("Usage: %s -[ld:v:r:] FILE\n", prog_name);
 }
 
+/*
+ * Parses the backup number given to -v or -r. Backup numbers start
+ * at 1 and have no upper limit of their own, but have to fit in the
+ * version field of query_arg_t. Returns -EOVERFLOW for one that does
+ * not, and -1 for anything else that is not a backup number.
+ */
+int parse_bkpno(const char *str, int *version)
+{
+	char *end;
+	unsigned long long val;
+
+	if (!isdigit((unsigned char)*str))
+		return -1;
+	errno = 0;
+	val = strtoull(str, &end, 10);
+	if (errno == ERANGE || (!*end && val > INT_MAX))
+		return -EOVERFLOW;
+	if (errno || *end || val == 0)
+		return -1;
+	*version = (int)val;
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
-	int err, opt, i, oldest;
+	int err, opt;
 	int fd;
 	FILE *fp;
 	query_arg_t *q;
-	char *file_name, *uarg;
+	char *file_name, *uarg, *line;
 	int flag = 0;
 	char answer;
+	unsigned long long bkpno;
+	long sec, nsec;
+	long long size;
+	unsigned long long csum;
+	time_t mtime;
+	char date[32];
 
 	while ((opt = getopt(argc, argv, ":ld:v:r:")) != -1) {
 		switch (opt) {
@@ -78,11 +111,37 @@ int main(int argc, char **argv)
 		exit(0);
 	}
 	if (flag & LIST_FLAG) {
-		err = ioctl(fd, QUERY_LIST_VER, q);
-		oldest = q->latest_bkp - q->num_bkps + 1;
-		printf("Existing backup files are:\n");
-		for (i = oldest; i <= q->latest_bkp; i++)
-			printf("%s.bkp%03d\n", file_name, i);
+		q->offset = 0;
+		printf("Existing versions are:\n");
+		do {
+			memset(q->buf, '\0', 4096);
+			err = ioctl(fd, QUERY_LIST_VER, q);
+			if (err && errno == EOVERFLOW) {
+				printf("Backup numbers too large to list\n");
+				break;
+			}
+			if (err) {
+				printf("err in ioctl %d\n", err);
+				break;
+			}
+			if (strlen(q->buf) == 0)
+				break;
+			/* Each line is "number size mtime checksum" */
+			for (line = strtok(q->buf, "\n"); line;
+			     line = strtok(NULL, "\n")) {
+				if (sscanf(line, "%llu %lld %ld.%ld %llx",
+					   &bkpno, &size, &sec, &nsec,
+					   &csum) != 5)
+					continue;
+				mtime = sec;
+				strftime(date, sizeof(date),
+					 "%Y-%m-%d %H:%M:%S",
+					 localtime(&mtime));
+				/* The backup file need not carry this number */
+				printf("%llu\t%10lld\t%s\t%016llx\n",
+				       bkpno, size, date, csum);
+			}
+		} while (q->offset < q->num_bkps);
 
 	} else if (flag & DELETE_FLAG) {
 		q->delete_ver = 0;
@@ -102,12 +161,13 @@ int main(int argc, char **argv)
 			q->version = VIEW_NEW;
 		} else if (strcmp(uarg, "oldest") == 0) {
 			q->version = VIEW_OLD;
-		} else {
-			q->version = (int)strtol(uarg, NULL, 10);
-			if (q->version < 0 || q->version > 1000) {
+		} else if ((err = parse_bkpno(uarg, &q->version)) ||
+			   q->version == VIEW_NEW || q->version == VIEW_OLD) {
+			if (err == -EOVERFLOW)
+				printf("Backup number %s is too large\n", uarg);
+			else
 				invalid_option(argv[0]);
-				goto out;
-			}
+			goto out;
 		}
 		do {
 			memset(q->buf, '\0', 4096);
@@ -133,12 +193,14 @@ int main(int argc, char **argv)
 			q->version = RESTORE_NEW;
 		} else if (strcmp(uarg, "oldest") == 0) {
 			q->version = RESTORE_OLD;
-		} else {
-			q->version = (int)strtol(uarg, NULL, 10);
-			if (q->version < 0 || q->version > 1000) {
+		} else if ((err = parse_bkpno(uarg, &q->version)) ||
+			   q->version == RESTORE_NEW ||
+			   q->version == RESTORE_OLD) {
+			if (err == -EOVERFLOW)
+				printf("Backup number %s is too large\n", uarg);
+			else
 				invalid_option(argv[0]);
-				goto out;
-			}
+			goto out;
 		}
 		err = ioctl(fd, QUERY_RESTORE_VER, q);
 		if (err)
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Benchmarking backup throughput (MB/s) for 4K, 1M, 100M and 1G files
+# Run it once against the old module and once against the new one to
+# compare the copy engines.
+maxbkp=2
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs -o maxver=$maxbkp /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs with maxver=$maxbkp
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+for kb in 4 1024 102400 1048576
+do
+	dd if=/dev/urandom of=/test/rt/src_$$ bs=4k count=$((kb / 4)) 2>/dev/null
+	sync
+
+	# Same write straight to the lower directory, to subtract it out
+	start=$(date +%s%N)
+	cp /test/rt/src_$$ /test/rt/lower/raw_$$
+	sync
+	mid=$(date +%s%N)
+	cp /test/rt/src_$$ /test/rt/mnt/file_$$
+	sync
+	end=$(date +%s%N)
+
+	bkp=$(( (end - mid) - (mid - start) ))
+	if [ $bkp -le 0 ]; then
+		bkp=1
+	fi
+	echo "$kb KB: backup took $((bkp / 1000)) us, $((kb * 1024 * 1000 / bkp)) MB/s"
+	rm -f /test/rt/src_$$ /test/rt/lower/raw_$$ /test/rt/mnt/file_$$
+done
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Benchmarking sendfile() throughput (MB/s) from bkpfs against the lower
+# directory, for 1M, 100M and 1G files already in the page cache.
+if ! command -v python3 > /dev/null; then
+    echo "python3 is needed to call sendfile()"
+    exit 1
+fi
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+# Sends the file in $1 to /dev/null and prints the time it took in ns
+send() {
+    python3 - "$1" <<'END'
+import os, sys, time
+fd = os.open(sys.argv[1], os.O_RDONLY)
+out = os.open("/dev/null", os.O_WRONLY)
+size = os.fstat(fd).st_size
+start = time.monotonic_ns()
+off = 0
+while off < size:
+    n = os.sendfile(out, fd, off, size - off)
+    if n <= 0:
+        break
+    off += n
+print(time.monotonic_ns() - start)
+END
+}
+
+for kb in 1024 102400 1048576
+do
+	dd if=/dev/urandom of=/test/rt/lower/file_$$ bs=4k count=$((kb / 4)) 2>/dev/null
+	cat /test/rt/lower/file_$$ > /dev/null
+
+	raw=`send /test/rt/lower/file_$$`
+	bkp=`send /test/rt/mnt/file_$$`
+	[ $raw -le 0 ] && raw=1
+	[ $bkp -le 0 ] && bkp=1
+	echo "$kb KB: lower $((kb * 1024 * 1000 / raw)) MB/s, bkpfs $((kb * 1024 * 1000 / bkp)) MB/s"
+	rm -f /test/rt/lower/file_$$
+done
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Testing asynchronous backup creation
+maxbkp=3
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs -o maxver=$maxbkp,async=16 /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs with maxver=$maxbkp and async=16
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+echo "writing to test file..."
+echo "hello world 1" > /test/rt/mnt/file_$$.txt
+echo "hello world 2" > /test/rt/mnt/file_$$.txt
+
+echo "waiting for queued backups..."
+sync
+test -f /test/rt/lower/file_$$.txt.bkp002
+if [ $? -eq 0 ]; then
+    echo Success! file_$$.txt.bkp002 was created
+else
+    echo Fail! file_$$.txt.bkp002 was not created
+fi
+if cmp /test/rt/mnt/file_$$.txt /test/rt/lower/file_$$.txt.bkp002; then
+	echo "Success! backup created with same contents"
+else
+	echo "Fail! backup created with incorrect contents"
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Testing that rewriting a file with the same contents makes no new backup
+maxbkp=3
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs -o maxver=$maxbkp,dedup=1 /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs with maxver=$maxbkp,dedup=1
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+echo "writing the same contents twice..."
+echo "hello world" > /test/rt/mnt/file_$$.txt
+echo "hello world" > /test/rt/mnt/file_$$.txt
+test -f /test/rt/lower/file_$$.txt.bkp002
+if [ $? -ne 0 ]; then
+    echo Success! no duplicate backup was created
+else
+    echo Fail! file_$$.txt.bkp002 is a duplicate of file_$$.txt.bkp001
+fi
+
+echo "writing new contents..."
+echo "hello world 2" > /test/rt/mnt/file_$$.txt
+test -f /test/rt/lower/file_$$.txt.bkp002
+if [ $? -eq 0 ]; then
+    echo Success! file_$$.txt.bkp002 was created
+else
+    echo Fail! file_$$.txt.bkp002 was not created
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
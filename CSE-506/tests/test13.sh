@@ -0,0 +1,58 @@
+#!/bin/sh
+# Testing that a burst of closes makes a single version
+maxbkp=5
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs -o maxver=$maxbkp,debounce=500 /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs with maxver=$maxbkp and debounce=500
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+echo "writing to test file 10 times in a row..."
+i=1
+while [ $i -le 10 ]; do
+	echo "hello world $i" > /test/rt/mnt/file_$$.txt
+	i=$((i + 1))
+done
+
+echo "waiting for the debounce window..."
+sleep 5
+test -f /test/rt/lower/file_$$.txt.bkp001
+if [ $? -eq 0 ]; then
+    echo Success! file_$$.txt.bkp001 was created
+else
+    echo Fail! file_$$.txt.bkp001 was not created
+fi
+test -f /test/rt/lower/file_$$.txt.bkp002
+if [ $? -ne 0 ]; then
+    echo Success! the burst made a single version
+else
+    echo Fail! the burst made more than one version
+fi
+if cmp /test/rt/mnt/file_$$.txt /test/rt/lower/file_$$.txt.bkp001; then
+	echo "Success! backup has the contents of the last close"
+else
+	echo "Fail! backup created with incorrect contents"
+fi
+grep -q "fstype bkpfs coalesced=9" /proc/self/mountstats
+if [ $? -eq 0 ]; then
+    echo Success! 9 closes were coalesced
+else
+    echo Fail! coalesced count is wrong
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
@@ -0,0 +1,55 @@
+#!/bin/sh
+# Testing conversion of old metadata files and the version listing
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+
+echo "setting up a file with metadata in the old format..."
+echo "hello world 1" > /test/rt/lower/file_$$.txt
+echo "hello world 1" > /test/rt/lower/file_$$.txt.bkp001
+printf "001001" > /test/rt/lower/file_$$.txt.bkpm
+
+mount -t bkpfs /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+echo "Calling user program to list versions..."
+../bkpctl -l /test/rt/mnt/file_$$.txt | tee /tmp/bkpctl_$$.out
+grep -q "file_$$.txt.bkp001" /tmp/bkpctl_$$.out
+if [ $? -eq 0 ]; then
+    echo Success! old backup is listed
+else
+    echo Fail! old backup is not listed
+fi
+if [ "$(head -c 4 /test/rt/lower/file_$$.txt.bkpm)" = "BKPM" ]; then
+    echo Success! metadata file was converted
+else
+    echo Fail! metadata file was not converted
+fi
+
+echo "writing to test file..."
+echo "hello world 2" > /test/rt/mnt/file_$$.txt
+../bkpctl -l /test/rt/mnt/file_$$.txt | tee /tmp/bkpctl_$$.out
+grep -q "file_$$.txt.bkp002" /tmp/bkpctl_$$.out
+if [ $? -eq 0 ]; then
+    echo Success! new backup is listed
+else
+    echo Fail! new backup is not listed
+fi
+
+# Cleanup
+rm -f /tmp/bkpctl_$$.out
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
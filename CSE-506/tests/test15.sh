@@ -0,0 +1,54 @@
+#!/bin/sh
+# Testing backup metadata kept in an xattr of the lower file
+maxbkp=3
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs -o maxver=$maxbkp,metaxattr=1 /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs with maxver=$maxbkp and metaxattr=1
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+echo "writing to test file..."
+echo "hello world 1" > /test/rt/mnt/file_$$.txt
+echo "hello world 2" > /test/rt/mnt/file_$$.txt
+test -f /test/rt/lower/file_$$.txt.bkp002
+if [ $? -eq 0 ]; then
+    echo Success! file_$$.txt.bkp002 was created
+else
+    echo Fail! file_$$.txt.bkp002 was not created
+fi
+test -f /test/rt/lower/file_$$.txt.bkpm
+if [ $? -ne 0 ]; then
+    echo Success! no metadata file was created
+else
+    echo Fail! file_$$.txt.bkpm was created
+fi
+getfattr -n trusted.bkpfs.meta /test/rt/lower/file_$$.txt > /dev/null 2>&1
+if [ $? -eq 0 ]; then
+    echo Success! metadata is in the xattr of the lower file
+else
+    echo Fail! metadata xattr is missing
+fi
+getfattr -n trusted.bkpfs.meta /test/rt/mnt/file_$$.txt > /dev/null 2>&1
+if [ $? -ne 0 ]; then
+    echo Success! metadata xattr is hidden at the mount point
+else
+    echo Fail! metadata xattr is visible at the mount point
+fi
+../bkpctl -l /test/rt/mnt/file_$$.txt
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Testing that reading a file does not create backup metadata
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+echo "hello world" > /test/rt/lower/file_$$.txt
+mount -t bkpfs /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+echo "reading test file..."
+cat /test/rt/mnt/file_$$.txt
+../bkpctl -l /test/rt/mnt/file_$$.txt
+test -f /test/rt/lower/file_$$.txt.bkpm
+if [ $? -ne 0 ]; then
+    echo Success! reading created no metadata file
+else
+    echo Fail! file_$$.txt.bkpm was created by a read
+fi
+
+echo "writing to test file..."
+echo "hello world 2" > /test/rt/mnt/file_$$.txt
+test -f /test/rt/lower/file_$$.txt.bkpm
+if [ $? -eq 0 ]; then
+    echo Success! metadata file was created with the first backup
+else
+    echo Fail! file_$$.txt.bkpm was not created
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
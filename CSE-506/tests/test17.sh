@@ -0,0 +1,59 @@
+#!/bin/sh
+# Testing backups kept in the hidden backup store
+maxbkp=3
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs -o maxver=$maxbkp,store=1 /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs with maxver=$maxbkp and store=1
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+echo "writing to test file..."
+echo "hello world 1" > /test/rt/mnt/file_$$.txt
+echo "hello world 2" > /test/rt/mnt/file_$$.txt
+count=`ls -a /test/rt/lower | grep -c file_$$`
+if [ $count -eq 1 ]; then
+    echo Success! no backups next to file_$$.txt
+else
+    echo Fail! found $count lower entries for file_$$.txt
+fi
+ino=`stat -c %i /test/rt/lower/file_$$.txt`
+count=`find /test/rt/lower/.bkpfs_store -path "*/$ino-*/v.bkp00*" | wc -l`
+if [ $count -eq 2 ]; then
+    echo Success! 2 backups are in the store
+else
+    echo Fail! found $count backups in the store
+fi
+ls /test/rt/mnt/.bkpfs_store > /dev/null 2>&1
+if [ $? -ne 0 ]; then
+    echo Success! the store is hidden at the mount point
+else
+    echo Fail! the store is visible at the mount point
+fi
+mv /test/rt/mnt/file_$$.txt /test/rt/mnt/moved_$$.txt
+../bkpctl -l /test/rt/mnt/moved_$$.txt
+../bkpctl -r oldest /test/rt/mnt/moved_$$.txt
+cmp -s /test/rt/lower/moved_$$.txt.bkpt - <<END
+hello world 1
+END
+if [ $? -eq 0 ]; then
+    echo Success! backups followed the file across the rename
+else
+    echo Fail! oldest backup was not restored after the rename
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
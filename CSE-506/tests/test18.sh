@@ -0,0 +1,43 @@
+#!/bin/sh
+# Testing delta versions that only store what was written
+maxbkp=5
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs -o maxver=$maxbkp,delta=4 /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs with maxver=$maxbkp and delta=4
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+echo "writing to test file..."
+dd if=/dev/urandom of=/test/rt/mnt/file_$$.txt bs=64k count=16 2> /dev/null
+echo "patched" | dd of=/test/rt/mnt/file_$$.txt bs=1 seek=4096 conv=notrunc 2> /dev/null
+full=`stat -c %s /test/rt/lower/file_$$.txt.bkp001`
+size=`stat -c %s /test/rt/lower/file_$$.txt.bkp002`
+if [ $size -lt 4096 ]; then
+    echo Success! second version takes $size bytes out of $full
+else
+    echo Fail! second version takes $size bytes out of $full
+fi
+../bkpctl -r newest /test/rt/mnt/file_$$.txt
+cmp -s /test/rt/lower/file_$$.txt /test/rt/lower/file_$$.txt.bkpt
+if [ $? -eq 0 ]; then
+    echo Success! restored delta version matches the file
+else
+    echo Fail! restored delta version differs from the file
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Testing chunked versions sharing chunks in the chunk store
+maxbkp=3
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs -o maxver=$maxbkp,chunk=1 /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs with maxver=$maxbkp and chunk=1
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+echo "writing to test file..."
+dd if=/dev/urandom of=/tmp/data_$$ bs=64k count=16 2> /dev/null
+cp /tmp/data_$$ /test/rt/mnt/file_$$.txt
+one=`du -sk /test/rt/lower/.bkpfs_store/chunks | cut -f1`
+# Insert a few bytes at the front, which shifts all of the contents
+(echo "inserted"; cat /tmp/data_$$) > /test/rt/mnt/file_$$.txt
+two=`du -sk /test/rt/lower/.bkpfs_store/chunks | cut -f1`
+if [ $two -lt $((one + one / 2)) ]; then
+    echo Success! chunk store grew from ${one}k to ${two}k
+else
+    echo Fail! chunk store grew from ${one}k to ${two}k
+fi
+../bkpctl -r oldest /test/rt/mnt/file_$$.txt
+cmp -s /tmp/data_$$ /test/rt/lower/file_$$.txt.bkpt
+if [ $? -eq 0 ]; then
+    echo Success! oldest version was put back together from its chunks
+else
+    echo Fail! oldest version differs from what was written
+fi
+../bkpctl -d all /test/rt/mnt/file_$$.txt
+count=`find /test/rt/lower/.bkpfs_store/chunks -type f | wc -l`
+if [ $count -eq 0 ]; then
+    echo Success! chunks were removed with the versions
+else
+    echo Fail! $count chunks are left after deleting all versions
+fi
+
+# Cleanup
+rm -f /tmp/data_$$
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
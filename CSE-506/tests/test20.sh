@@ -0,0 +1,50 @@
+#!/bin/sh
+# Testing compressed versions
+maxbkp=10
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs -o maxver=$maxbkp,compress=lz4 /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs with maxver=$maxbkp and compress=lz4
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+echo "writing to test file..."
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    seq 1 50000 | sed "s/^/version $i line /" > /test/rt/mnt/file_$$.txt
+done
+size=`stat -c %s /test/rt/lower/file_$$.txt`
+total=`cat /test/rt/lower/file_$$.txt.bkp* | wc -c`
+if [ $total -lt $((size * 5)) ]; then
+    echo Success! 10 versions take $total bytes for a $size byte file
+else
+    echo Fail! 10 versions take $total bytes for a $size byte file
+fi
+../bkpctl -r newest /test/rt/mnt/file_$$.txt
+cmp -s /test/rt/lower/file_$$.txt /test/rt/lower/file_$$.txt.bkpt
+if [ $? -eq 0 ]; then
+    echo Success! restored compressed version matches the file
+else
+    echo Fail! restored compressed version differs from the file
+fi
+../bkpctl -v oldest /test/rt/mnt/file_$$.txt | grep -q "version 1 line 1$"
+if [ $? -eq 0 ]; then
+    echo Success! oldest compressed version can be viewed
+else
+    echo Fail! oldest compressed version could not be viewed
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Testing that holes of a sparse file stay holes in its backup
+maxbkp=2
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs -o maxver=$maxbkp /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs with maxver=$maxbkp
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+echo "writing to test file..."
+# 1 GB file with 64k of data in the middle and a hole at each end
+dd if=/dev/urandom of=/test/rt/mnt/file_$$.img bs=64k count=1 seek=8192 2> /dev/null
+truncate -s 1G /test/rt/mnt/file_$$.img
+echo "hello" | dd of=/test/rt/mnt/file_$$.img bs=1 seek=0 conv=notrunc 2> /dev/null
+bkp=`ls /test/rt/lower/file_$$.img.bkp[0-9]* | sort | tail -1`
+size=`stat -c %s $bkp`
+used=`du -k $bkp | cut -f1`
+if [ $size -eq 1073741824 ] && [ $used -lt 1024 ]; then
+    echo Success! backup of $size bytes uses ${used}k
+else
+    echo Fail! backup of $size bytes uses ${used}k
+fi
+cmp -s /test/rt/lower/file_$$.img $bkp
+if [ $? -eq 0 ]; then
+    echo Success! sparse backup matches the file
+else
+    echo Fail! sparse backup differs from the file
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Testing that ring mode reuses the backup files of evicted versions
+maxbkp=3
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs -o maxver=$maxbkp,ring=1 /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs with maxver=$maxbkp and ring=1
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+echo "writing to test file..."
+echo "hello world 1" > /test/rt/mnt/file_$$.txt
+echo "hello world 2" > /test/rt/mnt/file_$$.txt
+echo "hello world 3" > /test/rt/mnt/file_$$.txt
+ino=`stat -c %i /test/rt/lower/file_$$.txt.bkp001`
+echo "hello world 4" > /test/rt/mnt/file_$$.txt
+if [ -e /test/rt/lower/file_$$.txt.bkp004 ]; then
+    echo Fail! a new backup file was created
+elif [ `stat -c %i /test/rt/lower/file_$$.txt.bkp001` -eq $ino ]; then
+    echo Success! the oldest backup file was reused
+else
+    echo Fail! the oldest backup file was replaced
+fi
+../bkpctl -r newest /test/rt/mnt/file_$$.txt
+cmp -s /test/rt/lower/file_$$.txt.bkpt - <<END
+hello world 4
+END
+if [ $? -eq 0 ]; then
+    echo Success! newest version was restored from the reused file
+else
+    echo Fail! newest version was not restored
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
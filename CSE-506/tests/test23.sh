@@ -0,0 +1,44 @@
+#!/bin/sh
+# Testing that the reaper unlinks backups of removed versions
+maxbkp=10
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs -o maxver=$maxbkp,reap=100 /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs with maxver=$maxbkp and reap=100
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+echo "writing to test file..."
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    echo "hello world $i" > /test/rt/mnt/file_$$.txt
+done
+../bkpctl -d all /test/rt/mnt/file_$$.txt
+count=`../bkpctl -l /test/rt/mnt/file_$$.txt | grep -c "\.bkp[0-9]"`
+if [ $count -eq 0 ]; then
+    echo Success! no versions are listed after deleting all
+else
+    echo Fail! $count versions are listed after deleting all
+fi
+sync
+count=`ls /test/rt/lower | grep -c "file_$$.txt.bkp[0-9]"`
+if [ $count -eq 0 ]; then
+    echo Success! the reaper removed all backups
+else
+    echo Fail! $count backups are left after sync
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
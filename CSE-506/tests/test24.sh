@@ -0,0 +1,52 @@
+#!/bin/sh
+# Testing that only the last writer to close makes a version
+maxbkp=5
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs -o maxver=$maxbkp /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs with maxver=$maxbkp
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+echo "writing to test file..."
+touch /test/rt/mnt/file_$$.txt
+exec 3>> /test/rt/mnt/file_$$.txt
+echo "first writer" >&3
+for i in 1 2 3; do
+    echo "writer $i" >> /test/rt/mnt/file_$$.txt
+done
+count=`ls /test/rt/lower | grep -c "file_$$.txt.bkp[0-9]"`
+if [ $count -eq 0 ]; then
+    echo Success! no versions while a writer is still open
+else
+    echo Fail! $count versions while a writer is still open
+fi
+exec 3>&-
+count=`ls /test/rt/lower | grep -c "file_$$.txt.bkp[0-9]"`
+if [ $count -eq 1 ]; then
+    echo Success! the last writer made one version
+else
+    echo Fail! found $count versions after the last writer closed
+fi
+cmp -s /test/rt/lower/file_$$.txt /test/rt/lower/file_$$.txt.bkp001
+if [ $? -eq 0 ]; then
+    echo Success! the version has the writes of all writers
+else
+    echo Fail! the version misses some of the writes
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Testing that the oldest versions are removed once they take more than maxsize
+maxsize=10K
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs -o maxsize=$maxsize /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs with maxsize=$maxsize
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+echo "writing to test file..."
+for i in 1 2 3 4; do
+    head -c 4096 /dev/urandom > /test/rt/mnt/file_$$.txt
+done
+if [ -e /test/rt/lower/file_$$.txt.bkp002 ]; then
+    echo Fail! versions over the size budget were kept
+elif [ -e /test/rt/lower/file_$$.txt.bkp003 ] && \
+     [ -e /test/rt/lower/file_$$.txt.bkp004 ]; then
+    echo Success! only the versions within the size budget were kept
+else
+    echo Fail! versions within the size budget were removed
+fi
+
+setfattr -n user.bkpfs.maxsize -v 0 /test/rt/mnt/file_$$.txt
+for i in 5 6; do
+    head -c 4096 /dev/urandom > /test/rt/mnt/file_$$.txt
+done
+if [ -e /test/rt/lower/file_$$.txt.bkp003 ]; then
+    echo Success! the xattr of the file lifted the size budget
+else
+    echo Fail! the xattr of the file was ignored
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
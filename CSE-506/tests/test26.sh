@@ -0,0 +1,53 @@
+#!/bin/sh
+# Testing that retain keeps one version per day among older versions
+retain=0/1h:1d/30d
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs -o maxver=20,retain=$retain /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs with retain=$retain
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+# Backdates the contents written through fd 3 before closing it
+day=`date -u -d '3 days ago' +%Y-%m-%d`
+write_at() {
+    exec 3> /test/rt/mnt/file_$$.txt
+    echo "$1" >&3
+    touch -d "$day $2 UTC" /test/rt/mnt/file_$$.txt
+    exec 3>&-
+}
+
+echo "writing to test file..."
+write_at "hello world 1" 01:00
+write_at "hello world 2" 02:00
+echo "hello world 3" > /test/rt/mnt/file_$$.txt
+if [ -e /test/rt/lower/file_$$.txt.bkp002 ]; then
+    echo Fail! two versions of the same day were kept
+elif [ -e /test/rt/lower/file_$$.txt.bkp001 ]; then
+    echo Success! the first version of the day was kept
+else
+    echo Fail! the first version of the day was removed
+fi
+echo "hello world 4" > /test/rt/mnt/file_$$.txt
+if [ -e /test/rt/lower/file_$$.txt.bkp003 ] && \
+   [ -e /test/rt/lower/file_$$.txt.bkp004 ]; then
+    echo Success! all versions of the last hour were kept
+else
+    echo Fail! recent versions were removed
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Testing that cached paths and symlinks resolve through the mount
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mkdir -p /test/rt/lower/a/b/c
+echo "hello world" > /test/rt/lower/a/b/c/file_$$.txt
+ln -s a/b/c/file_$$.txt /test/rt/lower/link_$$
+ln -s `head -c 200 /dev/zero | tr '\0' x` /test/rt/lower/long_$$
+mount -t bkpfs /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+# The second round finds everything in the dcache
+for i in 1 2; do
+    stat /test/rt/mnt/a/b/c/file_$$.txt > /dev/null
+done
+if [ "`cat /test/rt/mnt/link_$$`" = "hello world" ]; then
+    echo Success! symlink was followed
+else
+    echo Fail! symlink was not followed
+fi
+if [ "`readlink /test/rt/mnt/long_$$`" = "`readlink /test/rt/lower/long_$$`" ]; then
+    echo Success! long symlink was read
+else
+    echo Fail! long symlink was not read
+fi
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Testing that cached misses go stale once the name shows up below
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+# Probe a missing name like a compiler looking for a header
+for i in 1 2 3; do
+    if [ -e /test/rt/mnt/file_$$.h ]; then
+        echo Fail! missing file was found
+    fi
+done
+echo "hello world" > /test/rt/lower/file_$$.h
+if [ "`cat /test/rt/mnt/file_$$.h 2>/dev/null`" = "hello world" ]; then
+    echo Success! file created below was found after misses
+else
+    echo Fail! cached miss hid the file created below
+fi
+rm /test/rt/mnt/file_$$.h
+echo "hello again" > /test/rt/mnt/file_$$.h
+if [ "`cat /test/rt/lower/file_$$.h`" = "hello again" ]; then
+    echo Success! file was recreated over a cached miss
+else
+    echo Fail! file was not recreated
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Testing that a second mount does not change the options of the first
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+mkdir /test/rt/mnt2
+mkdir /test/rt/lower2
+insmod ../../fs/bkpfs/bkpfs.ko
+mount -t bkpfs -o maxver=2 /test/rt/lower /test/rt/mnt
+mount -t bkpfs -o maxver=5 /test/rt/lower2 /test/rt/mnt2
+
+for i in 1 2 3 4; do
+    echo "hello world $i" > /test/rt/mnt/file_$$.txt
+    echo "hello world $i" > /test/rt/mnt2/file_$$.txt
+done
+
+if [ -e /test/rt/lower/file_$$.txt.bkp003 ] &&
+   [ -e /test/rt/lower/file_$$.txt.bkp004 ] &&
+   [ ! -e /test/rt/lower/file_$$.txt.bkp002 ]; then
+    echo "Success! first mount kept maxver=2"
+else
+    echo "Fail! first mount took the options of the second"
+fi
+if [ -e /test/rt/lower2/file_$$.txt.bkp001 ] &&
+   [ -e /test/rt/lower2/file_$$.txt.bkp004 ]; then
+    echo "Success! second mount uses maxver=5"
+else
+    echo "Fail! second mount lost versions"
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower2
+umount -t bkpfs /test/rt/lower
+rm -rf /test/rt/
+rmmod bkpfs
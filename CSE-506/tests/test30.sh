@@ -0,0 +1,37 @@
+#!/bin/sh
+# Testing that the versions of a file go away with its last link
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+mount -t bkpfs -o store=1 /test/rt/lower /test/rt/mnt
+
+echo "hello world 1" > /test/rt/mnt/file_$$.txt
+echo "hello world 2" > /test/rt/mnt/file_$$.txt
+echo "hello world 1" > /test/rt/mnt/link_$$.txt
+echo "hello world 2" > /test/rt/mnt/link_$$.txt
+ln /test/rt/mnt/link_$$.txt /test/rt/mnt/other_$$.txt
+
+if [ `find /test/rt/lower/.bkpfs_store -mindepth 2 -type d | wc -l` -eq 2 ]; then
+    echo "Success! both files have a store directory"
+else
+    echo "Fail! store directories are missing"
+fi
+
+rm /test/rt/mnt/file_$$.txt
+rm /test/rt/mnt/link_$$.txt
+if [ `find /test/rt/lower/.bkpfs_store -mindepth 2 -type d | wc -l` -eq 1 ]; then
+    echo "Success! removed file left nothing in the store"
+else
+    echo "Fail! store directory of the removed file is still there"
+fi
+if [ `find /test/rt/lower/.bkpfs_store -mindepth 3 -name 'v.bkp0*' | wc -l` -eq 2 ]; then
+    echo "Success! file with another link kept its versions"
+else
+    echo "Fail! versions of a linked file were removed"
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower
+rm -rf /test/rt/
+rmmod bkpfs
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Testing that bad compress options fail the mount
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+
+if mount -t bkpfs -o compress=gzip2 /test/rt/lower /test/rt/mnt; then
+    echo "Fail! mounted with an unknown algorithm"
+    umount -t bkpfs /test/rt/lower
+else
+    echo "Success! unknown algorithm rejected"
+fi
+if mount -t bkpfs -o chunk=1,compress /test/rt/lower /test/rt/mnt; then
+    echo "Fail! mounted with chunk and compress"
+    umount -t bkpfs /test/rt/lower
+else
+    echo "Success! chunk with compress rejected"
+fi
+
+# Cleanup
+rm -rf /test/rt/
+rmmod bkpfs
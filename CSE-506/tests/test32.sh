@@ -0,0 +1,26 @@
+#!/bin/sh
+# Testing that mntmaxsize removes the oldest versions of any file first
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+mount -t bkpfs -o mntmaxsize=20K /test/rt/lower /test/rt/mnt
+
+for i in 1 2 3; do
+    head -c 4096 /dev/urandom > /test/rt/mnt/a_$$.txt
+done
+for i in 1 2 3; do
+    head -c 4096 /dev/urandom > /test/rt/mnt/b_$$.txt
+done
+
+if [ ! -e /test/rt/lower/a_$$.txt.bkp001 ] &&
+   [ -e /test/rt/lower/b_$$.txt.bkp001 ]; then
+    echo "Success! the oldest version of the mount was removed"
+else
+    echo "Fail! the budget did not take the oldest version"
+fi
+
+# Cleanup
+umount -t bkpfs /test/rt/lower
+rm -rf /test/rt/
+rmmod bkpfs
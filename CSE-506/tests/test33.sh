@@ -0,0 +1,50 @@
+#!/bin/sh
+# Testing that -o dedup=1 only compares the rewritten range of a large file
+maxbkp=3
+mkdir /test/rt
+mkdir /test/rt/mnt
+mkdir /test/rt/lower
+insmod ../../fs/bkpfs/bkpfs.ko
+if [ $? -eq 0 ]; then
+    echo "Inserted module bkpfs"
+else
+    echo "Failed to insert module bkpfs"
+    exit 1
+fi
+mount -t bkpfs -o maxver=$maxbkp,dedup=1 /test/rt/lower /test/rt/mnt
+if [ $? -eq 0 ]; then
+    echo Mounted bkpfs with maxver=$maxbkp,dedup=1
+else
+    echo "Failed to mount bkpfs"
+    exit 1
+fi
+
+echo "writing a 1M file..."
+dd if=/dev/urandom of=/tmp/data_$$ bs=64k count=16 2> /dev/null
+cp /tmp/data_$$ /test/rt/mnt/file_$$.txt
+
+echo "putting the same bytes back in the middle of it..."
+dd if=/tmp/data_$$ of=/test/rt/mnt/file_$$.txt bs=4k skip=100 seek=100 \
+	count=1 conv=notrunc 2> /dev/null
+test -f /test/rt/lower/file_$$.txt.bkp002
+if [ $? -ne 0 ]; then
+    echo Success! no duplicate backup was created
+else
+    echo Fail! file_$$.txt.bkp002 is a duplicate of file_$$.txt.bkp001
+fi
+
+echo "changing a few bytes in the middle of it..."
+printf 'this was changed' | dd of=/test/rt/mnt/file_$$.txt bs=1 seek=409600 \
+	conv=notrunc 2> /dev/null
+test -f /test/rt/lower/file_$$.txt.bkp002
+if [ $? -eq 0 ]; then
+    echo Success! file_$$.txt.bkp002 was created
+else
+    echo Fail! file_$$.txt.bkp002 was not created
+fi
+
+# Cleanup
+rm -f /tmp/data_$$
+umount -t bkpfs /test/rt/lower /test/rt/mnt
+rm -rf /test/rt/
+rmmod bkpfs
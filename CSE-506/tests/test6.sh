@@ -1,5 +1,5 @@
 #!/bin/sh
-# testing reset back to bkp001 with 1000 backup creation
+# testing backup numbers going past 999 with 1000 backup creation
 maxbkp=3
 #set -x
 mkdir /test/rt
@@ -1027,25 +1027,32 @@ echo "running user program to view backups..."
 ../bkpctl -l /test/rt/mnt/file_$$.txt
 
 echo "testing to see if the backups are correct..."
-test -f /test/rt/lower/file_$$.txt.bkp002
+test -f /test/rt/lower/file_$$.txt.bkp998
 if [ $? -eq 0 ]; then
-    echo Success! file_$$.txt.bkp002 exists.
+    echo Success! file_$$.txt.bkp998 exists.
 else
-    echo Fail! file_$$.txt.bkp002 was not created.
+    echo Fail! file_$$.txt.bkp998 was not created.
 fi
 
-test -f /test/rt/lower/file_$$.txt.bkp003
+test -f /test/rt/lower/file_$$.txt.bkp999
 if [ $? -eq 0 ]; then
-    echo Success! file_$$.txt.bkp003 exists.
+    echo Success! file_$$.txt.bkp999 exists.
 else
-    echo Fail! file_$$.txt.bkp003 was not created.
+    echo Fail! file_$$.txt.bkp999 was not created.
 fi
 
-test -f /test/rt/lower/file_$$.txt.bkp004
+test -f /test/rt/lower/file_$$.txt.bkp1000
 if [ $? -eq 0 ]; then
-    echo Success! file_$$.txt.bkp004 exists.
+    echo Success! file_$$.txt.bkp1000 exists.
 else
-    echo Fail! file_$$.txt.bkp004 was not created.
+    echo Fail! file_$$.txt.bkp1000 was not created.
+fi
+
+test -f /test/rt/lower/file_$$.txt.bkp001
+if [ $? -ne 0 ]; then
+    echo Success! backups were not renumbered.
+else
+    echo Fail! file_$$.txt.bkp001 exists.
 fi
 # Cleanup
 umount -t bkpfs /test/rt/lower /test/rt/mnt
@@ -27,11 +27,50 @@
 #include <linux/sched.h>
 #include <linux/xattr.h>
 #include <linux/exportfs.h>
+#include <linux/falloc.h>
+#include <linux/blkdev.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/cred.h>
+#include <linux/xxhash.h>
+#include <linux/crypto.h>
+#include <linux/ctype.h>
+#include <linux/pagemap.h>
 #include <linux/bkpfs.h>
 
 /* the file system name */
 #define BKPFS_NAME "bkpfs"
 
+/* xattr of a lower file that holds its backup metadata with -o metaxattr */
+#define BKPFS_META_XATTR XATTR_TRUSTED_PREFIX "bkpfs.meta"
+/* xattr of a lower file that overrides -o maxsize for its versions */
+#define BKPFS_MAXSIZE_XATTR XATTR_USER_PREFIX "bkpfs.maxsize"
+/* xattr of the lower root that keeps the usage of -o mntmaxsize */
+#define BKPFS_USAGE_XATTR XATTR_TRUSTED_PREFIX "bkpfs.usage"
+
+/* hidden directory at the lower root that holds versions with -o store */
+#define BKPFS_STORE_NAME ".bkpfs_store"
+/* base name of the backup files of a file inside its store directory */
+#define BKPFS_STORE_BASE "v"
+/* directory of the store that holds the chunks of -o chunk versions */
+#define BKPFS_CHUNK_DIR "chunks"
+
+/* chunks are cut at content defined boundaries between these sizes */
+#define BKPFS_CHUNK_MIN (2 << 10)
+#define BKPFS_CHUNK_MAX (64 << 10)
+/* chunks are named after the sha256 of their contents */
+#define BKPFS_CHUNK_HASH 32
+/* offset of the contents in a chunk file, after its header */
+#define BKPFS_CHUNK_DATA 16
+
+/* a set of chunk names, see bkpfs_chunk_set_add() */
+struct bkpfs_chunk_set {
+	struct hlist_head *buckets;
+	unsigned int bits;
+};
+
+struct bkpfs_vreader;
+
 /* bkpfs root inode number */
 #define BKPFS_ROOT_INO     1
 
@@ -63,31 +102,233 @@ extern struct inode *bkpfs_iget(struct super_block *sb,
 				 struct inode *lower_inode);
 extern int bkpfs_interpose(struct dentry *dentry, struct super_block *sb,
 			    struct path *lower_path);
+extern int bkpfs_backup_file(struct inode *inode, struct file *lower_file);
+extern void bkpfs_remove_backups(struct inode *inode, struct file *lower_file);
+extern int bkpfs_queue_backup(struct inode *inode, struct file *lower_file);
+extern void bkpfs_drain_backups(struct super_block *sb);
+extern void bkpfs_debounce_backup(struct inode *inode,
+				  struct file *lower_file);
+extern int bkpfs_init_sb_work(struct super_block *sb);
+extern void bkpfs_destroy_sb_work(struct super_block *sb);
+extern int bkpfs_reap_later(struct super_block *sb, struct path *dir,
+			    const char *name, int isdir);
+extern int bkpfs_load_usage(struct super_block *sb,
+			    struct dentry *lower_root);
+extern void bkpfs_save_usage(struct super_block *sb);
+extern void bkpfs_usage_changed(struct super_block *sb);
+extern void bkpfs_put_usage(struct super_block *sb);
+extern void bkpfs_track_usage(struct inode *inode, long num_bkps);
+extern void bkpfs_untrack_usage(struct inode *inode);
+extern int bkpfs_init_store(struct super_block *sb, struct path *lower_root);
+extern void bkpfs_put_store(struct super_block *sb);
+extern int bkpfs_get_store_dir(struct super_block *sb,
+			       struct inode *lower_inode, int create,
+			       struct path *dir);
+extern int bkpfs_remove_store_dir(struct super_block *sb,
+				  struct inode *lower_inode);
+extern int bkpfs_is_store_name(struct super_block *sb,
+			       const struct qstr *name);
+extern const struct cred *bkpfs_store_creds(struct super_block *sb);
+extern void bkpfs_revert_store_creds(const struct cred *old_cred);
+extern int bkpfs_store_mkdir(struct path *dir, const char *name,
+			     struct path *path);
+extern void bkpfs_init_gear(void);
+extern int bkpfs_init_chunks(struct super_block *sb);
+extern void bkpfs_put_chunks(struct super_block *sb);
+extern size_t bkpfs_chunk_cut(const u8 *buf, size_t len);
+extern int bkpfs_chunk_hash(struct super_block *sb, const void *data,
+			    size_t len, u8 *hash);
+extern int bkpfs_get_chunk(struct super_block *sb, const u8 *hash,
+			   const void *data, size_t len);
+extern int bkpfs_put_chunk(struct super_block *sb, const u8 *hash);
+extern struct file *bkpfs_open_chunk(struct super_block *sb, const u8 *hash);
+extern int bkpfs_chunk_set_init(struct bkpfs_chunk_set *set, size_t hint);
+extern void bkpfs_chunk_set_free(struct bkpfs_chunk_set *set);
+extern bool bkpfs_chunk_set_has(struct bkpfs_chunk_set *set, const u8 *hash);
+extern int bkpfs_chunk_set_add(struct bkpfs_chunk_set *set, const u8 *hash);
+extern int bkpfs_put_chunk_set(struct super_block *sb,
+			       struct bkpfs_chunk_set *set);
+
+/* where the contents of a version are stored */
+#define BKPM_LOC_FILE 0		/* <name>.bkpNNN next to the file */
+#define BKPM_LOC_STORE 1	/* v.bkpNNN in the file's store directory */
+
+/* bkpfs_version flags */
+#define BKPV_CSUM 0x1		/* csum is valid */
+#define BKPV_DELTA 0x2		/* backup only holds changes to base */
+#define BKPV_CHUNKED 0x4	/* backup lists chunks of the chunk store */
+#define BKPV_COMPRESSED 0x8	/* backup holds compressed blocks */
+
+/* compression algorithms of -o compress */
+#define BKP_COMPRESS_LZ4 1
+#define BKP_COMPRESS_ZSTD 2
+#define BKP_COMPRESS_MAX BKP_COMPRESS_ZSTD
+
+/* tfms kept per algorithm, so that backups compress side by side */
+#define BKP_COMP_POOL 4
+
+/* a tfm of the pool with the lock that keeps one call at a time on it */
+struct bkpfs_comp {
+	struct mutex lock;
+	struct crypto_comp *tfm;	/* NULL until first used */
+};
+
+/* crypto API name of a BKP_COMPRESS_* algorithm */
+static inline const char *bkpfs_comp_name(u32 alg)
+{
+	switch (alg) {
+	case BKP_COMPRESS_LZ4:
+		return "lz4";
+	case BKP_COMPRESS_ZSTD:
+		return "zstd";
+	}
+	return NULL;
+}
+
+extern int bkpfs_init_comp(struct super_block *sb);
+extern void bkpfs_put_comp(struct super_block *sb);
+extern struct bkpfs_comp *bkpfs_lock_comp(struct super_block *sb, u32 alg);
+extern void bkpfs_unlock_comp(struct bkpfs_comp *comp);
+
+/* one version of a file, an entry of its .bkpm table */
+struct bkpfs_version {
+	u64 bkpno;		/* never reused, see __bkpfs_del_latest() */
+	loff_t size;
+	struct timespec64 mtime;
+	struct timespec64 ctime;	/* when the version was made */
+	u64 csum;		/* xxh64 of the contents */
+	u32 loc;		/* BKPM_LOC_* */
+	u32 flags;		/* BKPV_* */
+	u64 base;		/* version a BKPV_DELTA applies to */
+	u64 fileno;		/* number in the name of the backup file */
+	u64 stored;		/* bytes the backup takes, see -o maxsize */
+};
+
+/* version state of a file, as kept in its .bkpm metadata file */
+struct bkpinfo {
+	long num_bkps;
+	u64 latest_bkp;		/* number of the newest backup made */
+	struct bkpfs_version *vers;	/* num_bkps entries, oldest first */
+};
+
+/* a byte range of a file written since its newest version */
+struct bkpfs_extent {
+	struct list_head list;
+	loff_t start;
+	loff_t end;		/* exclusive */
+};
 
 /* file private data */
 struct bkpfs_file_info {
 	struct file *lower_file;
 	const struct vm_operations_struct *lower_vm_ops;
 	int is_write;
+	int is_writer;		/* counted in bkpfs_inode_info.writers */
+	struct bkpfs_vreader *view_vr;	/* version last viewed, if any */
+	u64 view_bkpno;			/* and its number */
+	u32 view_flags;			/* and flags, see BKPV_DELTA */
 };
 
 /* bkpfs inode data in memory */
 struct bkpfs_inode_info {
 	struct inode *lower_inode;
+	/* deferred backup of this file, see __bkpfs_defer_backup() */
+	spinlock_t bkp_lock;
+	struct delayed_work bkp_dwork;
+	struct file *bkp_file;		/* lower file to back up */
+	const struct cred *bkp_cred;
+	unsigned long bkp_first;	/* jiffies of first close in burst */
+	unsigned int bkp_closes;	/* closes in the current burst */
+	struct list_head bkp_list;	/* on bkpfs_sb_info.bkp_debounced */
+	/* cached copy of the .bkpm file, written through on update */
+	struct mutex meta_mutex;	/* serializes version changes */
+	struct bkpinfo meta;
+	const struct dentry *meta_owner; /* lower dentry meta belongs to */
+	int meta_valid;
+	int meta_in_file;		/* too big for -o metaxattr */
+	struct list_head usage_list;	/* on bkpfs_sb_info.usage_inodes */
+	/* ranges written since version dirty_base, see dirty.c */
+	spinlock_t dirty_lock;
+	struct list_head dirty;		/* disjoint bkpfs_extents */
+	unsigned int dirty_nr;
+	u64 dirty_base;			/* 0 if the ranges are unknown */
+	/* only the last writer to close makes a version */
+	atomic_t writers;		/* open files with FMODE_WRITE */
+	atomic_t bkp_wanted;		/* an earlier writer wrote */
 	struct inode vfs_inode;
 };
 
 /* bkpfs dentry data in memory */
 struct bkpfs_dentry_info {
-	spinlock_t lock;	/* protects lower_path */
+	seqlock_t lock;		/* serializes writers of lower_path */
 	struct path lower_path;
+	struct rcu_head rcu;	/* see free_dentry_private_data() */
+};
+
+/* one tier of -o retain, see __bkpfs_thin_versions() */
+struct bkp_tier {
+	time64_t age;		/* holds the versions up to this old */
+	time64_t step;		/* one is kept per step, 0 keeps all */
+};
+
+/* most tiers -o retain takes */
+#define BKP_RETAIN_MAX 8
+
+/* mount options, see bkpfs_mount() */
+struct bkpfs_mount_opts {
+	long maxver;
+	long async;
+	long debounce;
+	long metaxattr;
+	long store;
+	long delta;
+	long dedup;
+	long chunk;
+	long compress;
+	long ring;
+	long reap;
+	long maxsize;
+	long mntmaxsize;
+	struct bkp_tier retain[BKP_RETAIN_MAX];
+	long nretain;
 };
 
 /* bkpfs super-block data in memory */
 struct bkpfs_sb_info {
 	struct super_block *lower_sb;
+	struct bkpfs_mount_opts opts;	/* fixed while mounted */
+	struct workqueue_struct *bkp_wq;	/* async backups */
+	atomic_t bkp_pending;		/* files with a backup queued */
+	wait_queue_head_t bkp_wait;	/* throttles ->release */
+	spinlock_t bkp_list_lock;	/* protects bkp_debounced */
+	struct list_head bkp_debounced;	/* inodes with a backup due */
+	atomic64_t bkp_coalesced;	/* closes folded into another backup */
+	struct path bkp_store;		/* lower BKPFS_STORE_NAME dir */
+	const struct cred *store_cred;	/* mounter, owns bkp_store */
+	struct path chunk_dir;		/* BKPFS_CHUNK_DIR in bkp_store */
+	struct crypto_shash *chunk_tfm;	/* names chunks, NULL without */
+	struct mutex chunk_mutex;	/* protects chunk reference counts */
+	/* by alg - 1, see bkpfs_lock_comp() */
+	struct bkpfs_comp comp_pool[BKP_COMPRESS_MAX][BKP_COMP_POOL];
+	spinlock_t reap_lock;		/* protects reap_list */
+	struct list_head reap_list;	/* backup files left to unlink */
+	struct delayed_work reap_dwork;	/* unlinks them, see -o reap */
+	atomic64_t bkp_bytes;		/* taken by all versions */
+	struct dentry *usage_root;	/* keeps bkp_bytes, mntmaxsize */
+	struct delayed_work usage_dwork; /* saves bkp_bytes after a change */
+	const struct cred *usage_cred;	/* mounter, for eviction */
+	spinlock_t usage_lock;		/* protects usage_inodes */
+	struct list_head usage_inodes;	/* files with versions */
 };
 
+extern void bkpfs_init_inode_work(struct bkpfs_inode_info *info);
+extern void bkpfs_init_inode_dirty(struct bkpfs_inode_info *info);
+extern void bkpfs_mark_dirty(struct inode *inode, loff_t start, loff_t end);
+extern void bkpfs_forget_dirty(struct inode *inode);
+extern u64 bkpfs_take_dirty(struct inode *inode, struct list_head *ranges);
+extern void bkpfs_set_dirty_base(struct inode *inode, u64 bkpno);
+extern void bkpfs_free_dirty(struct list_head *ranges);
+
 /*
  * inode to private data
  *
@@ -100,12 +341,49 @@ static inline struct bkpfs_inode_info *BKPFS_I(const struct inode *inode)
 	return container_of(inode, struct bkpfs_inode_info, vfs_inode);
 }
 
+/*
+ * Forget the cached backup metadata of an inode, e.g. because the
+ * name it was read under went away.
+ */
+static inline void bkpfs_invalidate_meta(struct inode *inode)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+
+	mutex_lock(&info->meta_mutex);
+	info->meta_valid = 0;
+	kfree(info->meta.vers);
+	info->meta.vers = NULL;
+	mutex_unlock(&info->meta_mutex);
+	bkpfs_forget_dirty(inode);
+}
+
 /* dentry to private data */
 #define BKPFS_D(dent) ((struct bkpfs_dentry_info *)(dent)->d_fsdata)
 
 /* superblock to private data */
 #define BKPFS_SB(super) ((struct bkpfs_sb_info *)(super)->s_fs_info)
 
+/* superblock to its mount options */
+#define BKPFS_OPTS(super) (&BKPFS_SB(super)->opts)
+
+/* versions of new backups go to the store instead of next to the file */
+static inline int bkpfs_has_store(struct super_block *sb)
+{
+	return BKPFS_SB(sb)->store_cred != NULL;
+}
+
+/* full versions of new backups are split into chunks */
+static inline int bkpfs_has_chunks(struct super_block *sb)
+{
+	return BKPFS_SB(sb)->chunk_tfm != NULL;
+}
+
+/* the ranges written since the newest version are remembered */
+static inline int bkpfs_tracks_dirty(struct super_block *sb)
+{
+	return BKPFS_OPTS(sb)->delta || BKPFS_OPTS(sb)->dedup;
+}
+
 /* file to private Data */
 #define BKPFS_F(file) ((struct bkpfs_file_info *)((file)->private_data))
 
@@ -150,16 +428,39 @@ static inline void pathcpy(struct path *dst, const struct path *src)
 	dst->dentry = src->dentry;
 	dst->mnt = src->mnt;
 }
+/*
+ * The lower path is only set up by lookup and let go of by d_release,
+ * so readers go without the lock and just retry if they raced with one.
+ */
+static inline void __bkpfs_read_lower_path(const struct dentry *dent,
+					   struct path *lower_path)
+{
+	struct bkpfs_dentry_info *info = BKPFS_D(dent);
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&info->lock);
+		pathcpy(lower_path, &info->lower_path);
+	} while (read_seqretry(&info->lock, seq));
+}
 /* Returns struct path.  Caller must path_put it. */
 static inline void bkpfs_get_lower_path(const struct dentry *dent,
 					 struct path *lower_path)
 {
-	spin_lock(&BKPFS_D(dent)->lock);
-	pathcpy(lower_path, &BKPFS_D(dent)->lower_path);
+	__bkpfs_read_lower_path(dent, lower_path);
 	path_get(lower_path);
-	spin_unlock(&BKPFS_D(dent)->lock);
 	return;
 }
+/*
+ * Returns struct path without taking references on it. A dentry pins
+ * its lower path for as long as it is in use, so this is enough for
+ * callers that are done with the path before they let go of dent.
+ */
+static inline void bkpfs_peek_lower_path(const struct dentry *dent,
+					  struct path *lower_path)
+{
+	__bkpfs_read_lower_path(dent, lower_path);
+}
 static inline void bkpfs_put_lower_path(const struct dentry *dent,
 					 struct path *lower_path)
 {
@@ -169,27 +470,27 @@ static inline void bkpfs_put_lower_path(const struct dentry *dent,
 static inline void bkpfs_set_lower_path(const struct dentry *dent,
 					 struct path *lower_path)
 {
-	spin_lock(&BKPFS_D(dent)->lock);
+	write_seqlock(&BKPFS_D(dent)->lock);
 	pathcpy(&BKPFS_D(dent)->lower_path, lower_path);
-	spin_unlock(&BKPFS_D(dent)->lock);
+	write_sequnlock(&BKPFS_D(dent)->lock);
 	return;
 }
 static inline void bkpfs_reset_lower_path(const struct dentry *dent)
 {
-	spin_lock(&BKPFS_D(dent)->lock);
-	BKPFS_D(dent)->lower_path.dentry = NULL;
+	write_seqlock(&BKPFS_D(dent)->lock);
+	WRITE_ONCE(BKPFS_D(dent)->lower_path.dentry, NULL);
 	BKPFS_D(dent)->lower_path.mnt = NULL;
-	spin_unlock(&BKPFS_D(dent)->lock);
+	write_sequnlock(&BKPFS_D(dent)->lock);
 	return;
 }
 static inline void bkpfs_put_reset_lower_path(const struct dentry *dent)
 {
 	struct path lower_path;
-	spin_lock(&BKPFS_D(dent)->lock);
+	write_seqlock(&BKPFS_D(dent)->lock);
 	pathcpy(&lower_path, &BKPFS_D(dent)->lower_path);
-	BKPFS_D(dent)->lower_path.dentry = NULL;
+	WRITE_ONCE(BKPFS_D(dent)->lower_path.dentry, NULL);
 	BKPFS_D(dent)->lower_path.mnt = NULL;
-	spin_unlock(&BKPFS_D(dent)->lock);
+	write_sequnlock(&BKPFS_D(dent)->lock);
 	path_put(&lower_path);
 	return;
 }
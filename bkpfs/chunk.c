@@ -0,0 +1,500 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <crypto/hash.h>
+#include <crypto/sha.h>
+#include "bkpfs.h"
+#include "main.h"
+
+/*
+ * With -o chunk=1 a full version is not copied as a whole. It is cut
+ * into chunks where a gear rolling hash of the last bytes hits a mask,
+ * so an insertion only changes the chunks around it, and each chunk
+ * is kept once in the store:
+ *
+ *	<lower root>/.bkpfs_store/chunks/<hh>/<sha256 of the chunk>
+ *
+ * A chunk file starts with a struct bkpc_header that counts the
+ * files whose versions refer to it; the last one to go removes it.
+ * A file holds one reference however many of its versions list the
+ * chunk, so a new version only touches the chunks none of the other
+ * versions of its file has, see struct bkpfs_chunk_set. The counts
+ * are only changed under chunk_mutex of the mount.
+ */
+#define BKPC_MAGIC 0x43504b42	/* "BKPC" */
+#define BKPC_VERSION 1
+
+/* a cut on average every 8k, when the top 13 bits of the hash are 0 */
+#define BKP_CHUNK_MASK (((1ULL << 13) - 1) << 51)
+
+struct bkpc_header {
+	__le32 magic;
+	__le16 version;
+	__le16 reserved;
+	__le32 refs;
+	__le32 len;
+};
+
+/* random values the rolling hash adds up, the same on every load */
+static u64 bkpfs_gear[256];
+
+void bkpfs_init_gear(void)
+{
+	int i;
+	u64 x = 0x62706b6673ULL, z;
+
+	/* splitmix64, so the boundaries never depend on the kernel */
+	for (i = 0; i < ARRAY_SIZE(bkpfs_gear); i++) {
+		x += 0x9e3779b97f4a7c15ULL;
+		z = x;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		bkpfs_gear[i] = z ^ (z >> 31);
+	}
+}
+
+/*
+ * Returns the length of the chunk that starts at buf, which holds
+ * the next len bytes of the file. A chunk is never longer than
+ * BKPFS_CHUNK_MAX, and shorter than BKPFS_CHUNK_MIN only at the end.
+ */
+size_t bkpfs_chunk_cut(const u8 *buf, size_t len)
+{
+	size_t i;
+	u64 hash = 0;
+
+	if (len <= BKPFS_CHUNK_MIN)
+		return len;
+	len = min_t(size_t, len, BKPFS_CHUNK_MAX);
+	for (i = BKPFS_CHUNK_MIN; i < len; i++) {
+		hash = (hash << 1) + bkpfs_gear[buf[i]];
+		if (!(hash & BKP_CHUNK_MASK))
+			return i + 1;
+	}
+	return len;
+}
+
+/* Sets up the chunk store of a mount using the backup store */
+int bkpfs_init_chunks(struct super_block *sb)
+{
+	int err;
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct crypto_shash *tfm;
+	const struct cred *old_cred;
+
+	tfm = crypto_alloc_shash("sha256", 0, 0);
+	if (IS_ERR(tfm))
+		return PTR_ERR(tfm);
+
+	old_cred = bkpfs_store_creds(sb);
+	err = bkpfs_store_mkdir(&sbi->bkp_store, BKPFS_CHUNK_DIR,
+				&sbi->chunk_dir);
+	bkpfs_revert_store_creds(old_cred);
+	if (err) {
+		crypto_free_shash(tfm);
+		return err;
+	}
+	sbi->chunk_tfm = tfm;
+	return 0;
+}
+
+void bkpfs_put_chunks(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (!sbi->chunk_tfm)
+		return;
+	path_put(&sbi->chunk_dir);
+	crypto_free_shash(sbi->chunk_tfm);
+	sbi->chunk_tfm = NULL;
+}
+
+/* Computes the name of a chunk, BKPFS_CHUNK_HASH bytes at hash */
+int bkpfs_chunk_hash(struct super_block *sb, const void *data, size_t len,
+		     u8 *hash)
+{
+	SHASH_DESC_ON_STACK(desc, BKPFS_SB(sb)->chunk_tfm);
+
+	desc->tfm = BKPFS_SB(sb)->chunk_tfm;
+	desc->flags = 0;
+	return crypto_shash_digest(desc, data, len, hash);
+}
+
+/*
+ * Formats the path of a chunk below the store as
+ * "chunks/hh/<hash>", see BKP_CHUNK_BUCKET and BKP_CHUNK_FILE.
+ */
+#define BKP_CHUNK_BUCKET (sizeof(BKPFS_CHUNK_DIR))
+#define BKP_CHUNK_FILE (BKP_CHUNK_BUCKET + 3)
+#define BKP_CHUNK_NAME_LEN (BKP_CHUNK_FILE + 2 * BKPFS_CHUNK_HASH + 1)
+
+static void __bkpfs_chunk_name(const u8 *hash, char *name)
+{
+	char *p;
+
+	p = name + sprintf(name, "%s/", BKPFS_CHUNK_DIR);
+	p = bin2hex(p, hash, 1);
+	*p++ = '/';
+	p = bin2hex(p, hash, BKPFS_CHUNK_HASH);
+	*p = '\0';
+}
+
+/*
+ * Looks up the chunk named hash, creating its bucket directory if
+ * create is set. Returns a negative dentry for a chunk that is not
+ * in the store yet; the bucket is returned locked in dir either way.
+ */
+static struct dentry *__bkpfs_lookup_chunk(struct super_block *sb,
+					   const u8 *hash, int create,
+					   struct path *dir)
+{
+	int err;
+	char name[BKP_CHUNK_NAME_LEN];
+	struct dentry *dentry;
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	/* Chunks are only reachable while the store is mounted */
+	if (!bkpfs_has_store(sb))
+		return ERR_PTR(-ENOENT);
+
+	__bkpfs_chunk_name(hash, name);
+	name[BKP_CHUNK_FILE - 1] = '\0';
+	if (create)
+		err = bkpfs_store_mkdir(&sbi->chunk_dir,
+					name + BKP_CHUNK_BUCKET, dir);
+	else
+		err = vfs_path_lookup(sbi->bkp_store.dentry,
+				      sbi->bkp_store.mnt, name, 0, dir);
+	if (err)
+		return ERR_PTR(err);
+
+	inode_lock_nested(d_inode(dir->dentry), I_MUTEX_PARENT);
+	dentry = lookup_one_len(name + BKP_CHUNK_FILE, dir->dentry,
+				2 * BKPFS_CHUNK_HASH);
+	if (IS_ERR(dentry)) {
+		inode_unlock(d_inode(dir->dentry));
+		path_put(dir);
+	}
+	return dentry;
+}
+
+static void __bkpfs_unlock_chunk(struct dentry *dentry, struct path *dir)
+{
+	dput(dentry);
+	inode_unlock(d_inode(dir->dentry));
+	path_put(dir);
+}
+
+/*
+ * Reads the header of the chunk file, checking that it is one.
+ * Returns -ENODATA if the header is missing or short, which is what
+ * a chunk left behind by a crash before its header was written looks
+ * like, and -EIO if it is not a chunk header.
+ */
+static int __bkpfs_read_chunk_hdr(struct file *file, struct bkpc_header *hdr)
+{
+	ssize_t len;
+	loff_t pos = 0;
+
+	len = kernel_read(file, hdr, sizeof(*hdr), &pos);
+	if (len < 0)
+		return len;
+	if (len != sizeof(*hdr) || !hdr->magic)
+		return -ENODATA;
+	if (le32_to_cpu(hdr->magic) != BKPC_MAGIC)
+		return -EIO;
+	if (le16_to_cpu(hdr->version) > BKPC_VERSION)
+		return -EOPNOTSUPP;
+	return 0;
+}
+
+/*
+ * Writes the header of the chunk file and syncs it, so the count of
+ * references is on disk before the version using the chunk is
+ */
+static int __bkpfs_write_chunk_hdr(struct file *file, struct bkpc_header *hdr)
+{
+	ssize_t len;
+	loff_t pos = 0;
+
+	len = kernel_write(file, hdr, sizeof(*hdr), &pos);
+	if (len != sizeof(*hdr))
+		return len < 0 ? len : -EIO;
+	return vfs_fsync(file, 1);
+}
+
+/* Writes a new chunk file for the len bytes at data */
+static int __bkpfs_create_chunk(struct path *dir, struct dentry *dentry,
+				const void *data, size_t len)
+{
+	int err;
+	ssize_t written;
+	loff_t pos = BKPFS_CHUNK_DATA;
+	struct path path;
+	struct file *file;
+	struct bkpc_header hdr = {
+		.magic = cpu_to_le32(BKPC_MAGIC),
+		.version = cpu_to_le16(BKPC_VERSION),
+		.refs = cpu_to_le32(1),
+		.len = cpu_to_le32(len),
+	};
+
+	err = vfs_create(d_inode(dir->dentry), dentry, 0600, 0);
+	if (err)
+		return err;
+	path.mnt = dir->mnt;
+	path.dentry = dentry;
+	file = dentry_open(&path, O_WRONLY, current_cred());
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		goto out_unlink;
+	}
+	written = kernel_write(file, data, len, &pos);
+	if (written != len)
+		err = written < 0 ? written : -EIO;
+	/* The header goes last, a chunk without one is not used */
+	if (!err)
+		err = __bkpfs_write_chunk_hdr(file, &hdr);
+	fput(file);
+	if (!err)
+		return 0;
+out_unlink:
+	vfs_unlink(d_inode(dir->dentry), dentry, NULL);
+	return err;
+}
+
+/*
+ * Adds a reference to the chunk named hash with the len bytes at
+ * data as contents, storing the chunk if it is not in the store yet.
+ * Returns 1 if it was stored by this call. Must be called with the
+ * store credentials.
+ */
+int bkpfs_get_chunk(struct super_block *sb, const u8 *hash,
+		    const void *data, size_t len)
+{
+	int err;
+	struct path dir, path;
+	struct dentry *dentry;
+	struct file *file;
+	struct bkpc_header hdr;
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	mutex_lock(&sbi->chunk_mutex);
+	do {
+		dentry = __bkpfs_lookup_chunk(sb, hash, 1, &dir);
+		if (IS_ERR(dentry)) {
+			err = PTR_ERR(dentry);
+			break;
+		}
+		if (d_really_is_negative(dentry)) {
+			err = __bkpfs_create_chunk(&dir, dentry, data, len);
+			if (!err)
+				err = 1;
+			__bkpfs_unlock_chunk(dentry, &dir);
+			break;
+		}
+
+		path.mnt = dir.mnt;
+		path.dentry = dentry;
+		file = dentry_open(&path, O_RDWR, current_cred());
+		if (IS_ERR(file)) {
+			err = PTR_ERR(file);
+			__bkpfs_unlock_chunk(dentry, &dir);
+			break;
+		}
+		err = __bkpfs_read_chunk_hdr(file, &hdr);
+		if (!err && le32_to_cpu(hdr.len) != len)
+			err = -EIO;
+		if (!err && le32_to_cpu(hdr.refs) == U32_MAX)
+			err = -EMLINK;
+		if (!err) {
+			le32_add_cpu(&hdr.refs, 1);
+			err = __bkpfs_write_chunk_hdr(file, &hdr);
+		}
+		fput(file);
+		/* Left behind half written, no version can refer to it */
+		if (err == -ENODATA) {
+			err = vfs_unlink(d_inode(dir.dentry), dentry, NULL);
+			if (!err)
+				err = -EAGAIN;
+		}
+		__bkpfs_unlock_chunk(dentry, &dir);
+	} while (err == -EAGAIN);
+	mutex_unlock(&sbi->chunk_mutex);
+	return err;
+}
+
+/*
+ * Drops a reference to the chunk named hash, removing it from the
+ * store with the last one. A chunk that is gone is not an error.
+ * Must be called with the store credentials.
+ */
+int bkpfs_put_chunk(struct super_block *sb, const u8 *hash)
+{
+	int err;
+	struct path dir, path;
+	struct dentry *dentry;
+	struct file *file;
+	struct bkpc_header hdr;
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	mutex_lock(&sbi->chunk_mutex);
+	dentry = __bkpfs_lookup_chunk(sb, hash, 0, &dir);
+	if (IS_ERR(dentry)) {
+		err = PTR_ERR(dentry);
+		if (err == -ENOENT)
+			err = 0;
+		goto out;
+	}
+	err = 0;
+	if (d_really_is_negative(dentry))
+		goto out_unlock;
+
+	path.mnt = dir.mnt;
+	path.dentry = dentry;
+	file = dentry_open(&path, O_RDWR, current_cred());
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		goto out_unlock;
+	}
+	err = __bkpfs_read_chunk_hdr(file, &hdr);
+	if (!err && le32_to_cpu(hdr.refs) > 1) {
+		le32_add_cpu(&hdr.refs, -1);
+		err = __bkpfs_write_chunk_hdr(file, &hdr);
+		fput(file);
+		goto out_unlock;
+	}
+	fput(file);
+	if (!err)
+		err = vfs_unlink(d_inode(dir.dentry), dentry, NULL);
+out_unlock:
+	__bkpfs_unlock_chunk(dentry, &dir);
+out:
+	mutex_unlock(&sbi->chunk_mutex);
+	return err;
+}
+
+/*
+ * Opens the chunk named hash for reading, its contents start at
+ * BKPFS_CHUNK_DATA. Versions are also read back on behalf of the
+ * user restoring them, so this switches to the store credentials.
+ */
+struct file *bkpfs_open_chunk(struct super_block *sb, const u8 *hash)
+{
+	int err;
+	char name[BKP_CHUNK_NAME_LEN];
+	struct path path;
+	struct file *file;
+	const struct cred *old_cred;
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (!bkpfs_has_store(sb))
+		return ERR_PTR(-ENOENT);
+
+	__bkpfs_chunk_name(hash, name);
+	old_cred = bkpfs_store_creds(sb);
+	err = vfs_path_lookup(sbi->bkp_store.dentry, sbi->bkp_store.mnt,
+			      name, 0, &path);
+	if (err) {
+		file = ERR_PTR(err);
+		goto out;
+	}
+	file = dentry_open(&path, O_RDONLY, current_cred());
+	path_put(&path);
+out:
+	bkpfs_revert_store_creds(old_cred);
+	return file;
+}
+
+/* A chunk name in a struct bkpfs_chunk_set */
+struct bkpfs_chunk_ent {
+	struct hlist_node node;
+	u8 hash[BKPFS_CHUNK_HASH];
+};
+
+/* Sets up an empty set sized for about hint chunks */
+int bkpfs_chunk_set_init(struct bkpfs_chunk_set *set, size_t hint)
+{
+	set->bits = clamp_t(unsigned int, ilog2(hint | 1) + 1, 4, 20);
+	set->buckets = kvcalloc(1U << set->bits, sizeof(*set->buckets),
+				GFP_KERNEL);
+	return set->buckets ? 0 : -ENOMEM;
+}
+
+void bkpfs_chunk_set_free(struct bkpfs_chunk_set *set)
+{
+	struct bkpfs_chunk_ent *ent;
+	struct hlist_node *next;
+	u32 i;
+
+	if (!set->buckets)
+		return;
+	for (i = 0; i < (1U << set->bits); i++)
+		hlist_for_each_entry_safe(ent, next, &set->buckets[i], node)
+			kfree(ent);
+	kvfree(set->buckets);
+	set->buckets = NULL;
+}
+
+/* The names are sha256 hashes, so any of their bits picks a bucket */
+static struct hlist_head *__bkpfs_chunk_bucket(struct bkpfs_chunk_set *set,
+					       const u8 *hash)
+{
+	u32 key;
+
+	memcpy(&key, hash, sizeof(key));
+	return &set->buckets[key & ((1U << set->bits) - 1)];
+}
+
+bool bkpfs_chunk_set_has(struct bkpfs_chunk_set *set, const u8 *hash)
+{
+	struct bkpfs_chunk_ent *ent;
+
+	hlist_for_each_entry(ent, __bkpfs_chunk_bucket(set, hash), node)
+		if (!memcmp(ent->hash, hash, BKPFS_CHUNK_HASH))
+			return true;
+	return false;
+}
+
+/*
+ * Adds the chunk named hash to set. Returns 1 if it was added, or 0
+ * if the set already had it.
+ */
+int bkpfs_chunk_set_add(struct bkpfs_chunk_set *set, const u8 *hash)
+{
+	struct bkpfs_chunk_ent *ent;
+
+	if (bkpfs_chunk_set_has(set, hash))
+		return 0;
+	ent = kmalloc(sizeof(*ent), GFP_KERNEL);
+	if (!ent)
+		return -ENOMEM;
+	memcpy(ent->hash, hash, BKPFS_CHUNK_HASH);
+	hlist_add_head(&ent->node, __bkpfs_chunk_bucket(set, hash));
+	return 1;
+}
+
+/* Drops a reference to every chunk in set, see bkpfs_put_chunk() */
+int bkpfs_put_chunk_set(struct super_block *sb, struct bkpfs_chunk_set *set)
+{
+	struct bkpfs_chunk_ent *ent;
+	int err, ret = 0;
+	u32 i;
+
+	for (i = 0; i < (1U << set->bits); i++) {
+		hlist_for_each_entry(ent, &set->buckets[i], node) {
+			err = bkpfs_put_chunk(sb, ent->hash);
+			if (err && !ret)
+				ret = err;
+		}
+	}
+	return ret;
+}
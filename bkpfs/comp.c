@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+
+/*
+ * Compressed versions are made and read with a small pool of tfms per
+ * algorithm, BKP_COMP_POOL of them for the whole mount. The first one
+ * of -o compress is set up at mount, the others only once they are
+ * needed. A tfm keeps the state of the call using it, so each one is
+ * used by one call at a time under its own lock, see
+ * bkpfs_lock_comp().
+ */
+
+/* Sets up the compression of a new mount */
+int bkpfs_init_comp(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_comp *comp;
+	int i, j;
+
+	for (i = 0; i < BKP_COMPRESS_MAX; i++)
+		for (j = 0; j < BKP_COMP_POOL; j++)
+			mutex_init(&sbi->comp_pool[i][j].lock);
+	if (!sbi->opts.compress)
+		return 0;
+	comp = bkpfs_lock_comp(sb, sbi->opts.compress);
+	if (IS_ERR(comp))
+		return PTR_ERR(comp);
+	bkpfs_unlock_comp(comp);
+	return 0;
+}
+
+void bkpfs_put_comp(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_comp *comp;
+	int i, j;
+
+	for (i = 0; i < BKP_COMPRESS_MAX; i++) {
+		for (j = 0; j < BKP_COMP_POOL; j++) {
+			comp = &sbi->comp_pool[i][j];
+			if (comp->tfm)
+				crypto_free_comp(comp->tfm);
+			comp->tfm = NULL;
+		}
+	}
+}
+
+/*
+ * Returns a tfm of the BKP_COMPRESS_* algorithm alg from the pool
+ * with its lock held, to be dropped with bkpfs_unlock_comp() once
+ * the tfm has been used. A free one is taken if there is any,
+ * starting from the one of the current CPU, otherwise the call
+ * waits for that one. On an error no lock is held.
+ */
+struct bkpfs_comp *bkpfs_lock_comp(struct super_block *sb, u32 alg)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_comp *pool, *comp;
+	struct crypto_comp *tfm;
+	const char *name = bkpfs_comp_name(alg);
+	int i, home;
+
+	if (!name)
+		return ERR_PTR(-EOPNOTSUPP);
+	pool = sbi->comp_pool[alg - 1];
+	home = raw_smp_processor_id() % BKP_COMP_POOL;
+	for (i = 0; i < BKP_COMP_POOL; i++) {
+		comp = &pool[(home + i) % BKP_COMP_POOL];
+		if (mutex_trylock(&comp->lock))
+			goto found;
+	}
+	comp = &pool[home];
+	mutex_lock(&comp->lock);
+found:
+	if (!comp->tfm) {
+		tfm = crypto_alloc_comp(name, 0, 0);
+		if (IS_ERR(tfm)) {
+			mutex_unlock(&comp->lock);
+			return ERR_CAST(tfm);
+		}
+		comp->tfm = tfm;
+	}
+	return comp;
+}
+
+void bkpfs_unlock_comp(struct bkpfs_comp *comp)
+{
+	mutex_unlock(&comp->lock);
+}
@@ -11,6 +11,41 @@
 
 #include "bkpfs.h"
 
+/*
+ * A cached miss is stale once the name shows up on the lower file
+ * system, or once that stops caching the miss itself.
+ */
+static int __bkpfs_stale_negative(struct dentry *dentry,
+				  struct dentry *lower_dentry)
+{
+	if (d_really_is_positive(dentry))
+		return 0;
+	return d_unhashed(lower_dentry) || d_really_is_positive(lower_dentry);
+}
+
+/*
+ * In RCU walk mode no references may be taken, so the lower dentry is
+ * only looked at. The private data and the lower dentry are both freed
+ * after a grace period, but either may already have been let go of, in
+ * which case the walk is retried with references.
+ */
+static int bkpfs_d_revalidate_rcu(struct dentry *dentry, unsigned int flags)
+{
+	struct bkpfs_dentry_info *info = READ_ONCE(dentry->d_fsdata);
+	struct dentry *lower_dentry;
+
+	if (!info)
+		return -ECHILD;
+	lower_dentry = READ_ONCE(info->lower_path.dentry);
+	if (!lower_dentry)
+		return -ECHILD;
+	if (__bkpfs_stale_negative(dentry, lower_dentry))
+		return 0;
+	if (!(READ_ONCE(lower_dentry->d_flags) & DCACHE_OP_REVALIDATE))
+		return 1;
+	return lower_dentry->d_op->d_revalidate(lower_dentry, flags);
+}
+
 /*
  * returns: -ERRNO if error (returned to user)
  *          0: tell VFS to invalidate dentry
@@ -22,23 +57,36 @@ static int bkpfs_d_revalidate(struct dentry *dentry, unsigned int flags)
 	struct dentry *lower_dentry;
 	int err = 1;
 
-	printk("bkpfs_d_revalidate entered \n");
 	if (flags & LOOKUP_RCU)
-		return -ECHILD;
+		return bkpfs_d_revalidate_rcu(dentry, flags);
 
-	bkpfs_get_lower_path(dentry, &lower_path);
+	bkpfs_peek_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
-	if (!(lower_dentry->d_flags & DCACHE_OP_REVALIDATE))
-		goto out;
-	err = lower_dentry->d_op->d_revalidate(lower_dentry, flags);
-out:
-	bkpfs_put_lower_path(dentry, &lower_path);
+	if (__bkpfs_stale_negative(dentry, lower_dentry))
+		return 0;
+	if (lower_dentry->d_flags & DCACHE_OP_REVALIDATE)
+		err = lower_dentry->d_op->d_revalidate(lower_dentry, flags);
 	return err;
 }
 
+/*
+ * Called with the last reference to a dentry. A miss is only kept in
+ * the dcache for as long as the lower file system keeps its own, so
+ * the lower one it pins never outlives its usefulness.
+ */
+static int bkpfs_d_delete(const struct dentry *dentry)
+{
+	struct bkpfs_dentry_info *info = dentry->d_fsdata;
+	struct dentry *lower_dentry;
+
+	if (!info || d_really_is_positive(dentry))
+		return 0;
+	lower_dentry = READ_ONCE(info->lower_path.dentry);
+	return !lower_dentry || d_unhashed(lower_dentry);
+}
+
 static void bkpfs_d_release(struct dentry *dentry)
 {
-	printk("bkpfs_d_release entered \n");
 	/* release and reset the lower paths */
 	bkpfs_put_reset_lower_path(dentry);
 	free_dentry_private_data(dentry);
@@ -47,5 +95,6 @@ static void bkpfs_d_release(struct dentry *dentry)
 
 const struct dentry_operations bkpfs_dops = {
 	.d_revalidate	= bkpfs_d_revalidate,
+	.d_delete	= bkpfs_d_delete,
 	.d_release	= bkpfs_d_release,
 };
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+#include "main.h"
+
+/*
+ * With -o delta=N each inode remembers which byte ranges were written
+ * since its newest version (dirty_base), so that the next version only
+ * has to store those, and with -o dedup=1 only those have to be
+ * compared with it. The ranges are kept as a sorted list of disjoint
+ * extents. Whenever they cannot be trusted, e.g. because an allocation
+ * failed or there were too many of them, dirty_base is cleared and the
+ * next version is a full copy again.
+ */
+#define BKP_DIRTY_MAX 256
+
+/* dirty_base while a backup is being made from the current ranges */
+#define BKP_DIRTY_PENDING U64_MAX
+
+void bkpfs_init_inode_dirty(struct bkpfs_inode_info *info)
+{
+	spin_lock_init(&info->dirty_lock);
+	INIT_LIST_HEAD(&info->dirty);
+	info->dirty_nr = 0;
+	info->dirty_base = 0;
+}
+
+/* Frees a list of extents taken with bkpfs_take_dirty() */
+void bkpfs_free_dirty(struct list_head *ranges)
+{
+	struct bkpfs_extent *ext, *next;
+
+	list_for_each_entry_safe(ext, next, ranges, list) {
+		list_del(&ext->list);
+		kfree(ext);
+	}
+}
+
+static void __bkpfs_forget_dirty(struct bkpfs_inode_info *ii,
+				 struct list_head *ranges)
+{
+	list_splice_init(&ii->dirty, ranges);
+	ii->dirty_nr = 0;
+	ii->dirty_base = 0;
+}
+
+/* Records that [start, end) of inode's file was written */
+void bkpfs_mark_dirty(struct inode *inode, loff_t start, loff_t end)
+{
+	struct bkpfs_inode_info *ii = BKPFS_I(inode);
+	struct bkpfs_extent *new, *ext, *next;
+	struct list_head *pos;
+	LIST_HEAD(stale);
+
+	if (!bkpfs_tracks_dirty(inode->i_sb) || start >= end)
+		return;
+
+	new = kmalloc(sizeof(*new), GFP_NOFS);
+
+	spin_lock(&ii->dirty_lock);
+	if (!ii->dirty_base)
+		goto out;
+	if (!new) {
+		__bkpfs_forget_dirty(ii, &stale);
+		goto out;
+	}
+
+	/* Absorb every extent that overlaps or touches the new one */
+	pos = &ii->dirty;
+	list_for_each_entry_safe(ext, next, &ii->dirty, list) {
+		if (ext->end < start)
+			continue;
+		if (ext->start > end) {
+			pos = &ext->list;
+			break;
+		}
+		start = min(start, ext->start);
+		end = max(end, ext->end);
+		list_move(&ext->list, &stale);
+		ii->dirty_nr--;
+	}
+	if (ii->dirty_nr >= BKP_DIRTY_MAX) {
+		__bkpfs_forget_dirty(ii, &stale);
+		goto out;
+	}
+	new->start = start;
+	new->end = end;
+	list_add_tail(&new->list, pos);
+	ii->dirty_nr++;
+	new = NULL;
+out:
+	spin_unlock(&ii->dirty_lock);
+	kfree(new);
+	bkpfs_free_dirty(&stale);
+}
+
+/* Stops tracking inode until its next version is made */
+void bkpfs_forget_dirty(struct inode *inode)
+{
+	struct bkpfs_inode_info *ii = BKPFS_I(inode);
+	LIST_HEAD(stale);
+
+	spin_lock(&ii->dirty_lock);
+	__bkpfs_forget_dirty(ii, &stale);
+	spin_unlock(&ii->dirty_lock);
+	bkpfs_free_dirty(&stale);
+}
+
+/*
+ * Moves the ranges written since the newest version to ranges and
+ * returns the number of that version, or 0 if the ranges are not
+ * known. Writes from now on are recorded for the version being
+ * made, see bkpfs_set_dirty_base().
+ */
+u64 bkpfs_take_dirty(struct inode *inode, struct list_head *ranges)
+{
+	struct bkpfs_inode_info *ii = BKPFS_I(inode);
+	u64 base;
+
+	if (!bkpfs_tracks_dirty(inode->i_sb))
+		return 0;
+
+	spin_lock(&ii->dirty_lock);
+	base = ii->dirty_base;
+	if (base == BKP_DIRTY_PENDING)
+		base = 0;
+	list_splice_init(&ii->dirty, ranges);
+	ii->dirty_nr = 0;
+	ii->dirty_base = BKP_DIRTY_PENDING;
+	spin_unlock(&ii->dirty_lock);
+	return base;
+}
+
+/*
+ * Makes bkpno the version that the ranges recorded since
+ * bkpfs_take_dirty() are relative to. Nothing is changed if the
+ * ranges were forgotten in the meantime.
+ */
+void bkpfs_set_dirty_base(struct inode *inode, u64 bkpno)
+{
+	struct bkpfs_inode_info *ii = BKPFS_I(inode);
+	LIST_HEAD(stale);
+
+	spin_lock(&ii->dirty_lock);
+	if (ii->dirty_base == BKP_DIRTY_PENDING) {
+		if (bkpno)
+			ii->dirty_base = bkpno;
+		else
+			__bkpfs_forget_dirty(ii, &stale);
+	}
+	spin_unlock(&ii->dirty_lock);
+	bkpfs_free_dirty(&stale);
+}
@@ -12,28 +12,23 @@
 #include "bkpfs.h"
 #include "main.h"
 
-#define METAFILE_SIZE 6
-#define MAX_BACKUPS 999
+#define METAFILE_SIZE 6 /* old ASCII .bkpm record */
 #define BKP_LIMIT 10
-#define MAX_BKP_NAME_EXT 8
-#define EXT_SIZE 4
+#define BKP_MIN_DIGITS 3	/* bkpNNN, longer once past 999 */
+#define BKP_COPY_CHUNK (8 << 20)
+#define BKP_CMP_CHUNK (64 << 10)
 
-#define BKPM_CREATE 0x1
 #define BKPM_READ 0x2
 #define BKPM_UPDATE 0x4
-#define BKPM_UPDATE_DEL_LATEST 0x8
-#define BKPM_UPDATE_DEL_OLDEST 0x10
-#define BKPM_UPDATE_DEL_ALL 0x20
+
+#define BKPM_MAGIC 0x4d504b42	/* "BKPM" */
+#define BKPM_VERSION 1
+#define BKPM_MAX_SIZE (8 << 20)
 
 #define BKP_EXT ".bkp"
 #define BKPT_EXT ".bkpt"
 #define BKP_META_EXT ".bkpm"
 
-struct bkpinfo {
-	long num_bkps;
-	long latest_bkp;
-};
-
 /* Used for filldir implementation */
 struct bkpfs_getdents_callback {
 	struct dir_context ctx;
@@ -43,100 +38,103 @@ struct bkpfs_getdents_callback {
 	int entries_written;
 };
 
-/* Takes in a file descriptor and creates a meta file
- * which stores the number of backups and the
- * latest backup's number in a six bit format
- * three bits for each piece of information.
+/* A generic implementation of copying data from one file to
+ * another given their file descriptors. The copy goes through
+ * the in-kernel copy_file_range/splice paths in large chunks so
+ * that the lower file system sees one sequential bulk copy.
+ * Only the data extents of infile are copied; its holes stay
+ * holes in outfile, which is extended to the same size.
  */
-static int __bkpfs_create_meta(struct file *metafile)
+int __bkpfs_read_write(struct file *infile, struct file *outfile)
 {
-	int len, err = 0;
-	char *buf;
-	mm_segment_t old_fs;
-	loff_t pos = 0;
+	int err = 0;
+	loff_t pos = 0, end, file_size;
+	ssize_t len;
+	size_t chunk;
+	struct blk_plug plug;
 
-	buf = kmalloc(METAFILE_SIZE, GFP_KERNEL);
-	if (!buf) {
-		err = -ENOMEM;
+	file_size = i_size_read(file_inode(infile));
+	if (!file_size)
 		goto out;
-	}
-	old_fs = get_fs();
-	set_fs(get_ds());
 
-	memset(buf, '\0', METAFILE_SIZE);
-	strncpy(buf, "000000", METAFILE_SIZE);
-	len = vfs_write(metafile, (char __user *)buf, METAFILE_SIZE, &pos);
-	if (len < 0) {
-		err = len;
-		goto out_fs;
-	}
-	if (len >= 0 && len != METAFILE_SIZE) {
-		err = -EIO;
-		goto out_fs;
+	blk_start_plug(&plug);
+	while (pos < file_size) {
+		// Find the next data extent, the lower fs may not know holes
+		pos = vfs_llseek(infile, pos, SEEK_DATA);
+		if (pos == -ENXIO)
+			break;
+		if (pos < 0) {
+			err = pos;
+			break;
+		}
+		end = vfs_llseek(infile, pos, SEEK_HOLE);
+		if (end < 0) {
+			err = end;
+			break;
+		}
+		end = min(end, file_size);
+
+		// Reserve the space up front, the extent is laid out in one go
+		err = vfs_fallocate(outfile, FALLOC_FL_KEEP_SIZE, pos,
+				    end - pos);
+		if (err && err != -EOPNOTSUPP)
+			break;
+		err = 0;
+
+		while (pos < end) {
+			if (fatal_signal_pending(current)) {
+				err = -EINTR;
+				goto out_plug;
+			}
+			chunk = min_t(loff_t, end - pos, BKP_COPY_CHUNK);
+			len = vfs_copy_file_range(infile, pos, outfile, pos,
+						  chunk, 0);
+			if (len < 0) {
+				err = len;
+				goto out_plug;
+			}
+			// File was truncated under us
+			if (len == 0)
+				goto out_plug;
+			pos += len;
+		}
 	}
-out_fs:
-	set_fs(old_fs);
+out_plug:
+	blk_finish_plug(&plug);
+	// A hole at the end has no data to extend the copy
+	if (!err && i_size_read(file_inode(outfile)) < file_size)
+		err = vfs_truncate(&outfile->f_path, file_size);
 out:
-	kfree(buf);
 	return err;
 }
 
-/* A generic implementation of copying data from one file to
- * another given their file descriptors
+/*
+ * Shares the extents of infile with outfile instead of copying
+ * the data. This only works when the lower file system supports
+ * cloning (e.g. XFS with reflink, btrfs), otherwise -EOPNOTSUPP
+ * is returned so that the caller can fall back to a copy.
  */
-int __bkpfs_read_write(struct file *infile, struct file *outfile)
+static int __bkpfs_clone_file(struct file *infile, struct file *outfile)
 {
-	char *buf;
-	int i = 0, err = 0, num_pages, rem;
-	loff_t i_pos = 0, o_pos = 0, file_size;
-	ssize_t len = 0;
-	mm_segment_t old_fs;
-
-	// Allocate buffer memory
-	buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
-	if (!buf) {
-		err = -ENOMEM;
-		goto out_buf;
-	}
-
-	old_fs = get_fs();
-	set_fs(get_ds());
-	file_size = infile->f_path.dentry->d_inode->i_size;
-	// Read and write
-	num_pages = file_size / PAGE_SIZE;
-	while (i < num_pages) {
-		len = vfs_read(infile, (char __user *)buf, PAGE_SIZE, &i_pos);
-		if (len < 0) {
-			err = len;
-			goto out;
-		}
+	if (!infile->f_op->clone_file_range)
+		return -EOPNOTSUPP;
+	// A length of zero clones everything up to EOF
+	return vfs_clone_file_range(infile, 0, outfile, 0, 0);
+}
 
-		len = vfs_write(outfile, (char __user *)buf, PAGE_SIZE, &o_pos);
-		if (len < 0) {
-			err = len;
-			goto out;
-		}
-		i++;
-	}
-	rem = file_size % PAGE_SIZE;
-	if (rem) {
-		len = vfs_read(infile, (char __user *)buf, rem, &i_pos);
-		if (len < 0) {
-			err = len;
-			goto out;
-		}
+/*
+ * Creates a copy of infile in outfile. Extents are cloned when
+ * the lower file system allows it, so that making a version
+ * only costs metadata; otherwise the data is copied.
+ */
+int __bkpfs_copy_file(struct file *infile, struct file *outfile)
+{
+	int err;
 
-		len = vfs_write(outfile, (char __user *)buf, rem, &o_pos);
-		if (len < 0) {
-			err = len;
-			goto out;
-		}
-	}
-out:
-	set_fs(old_fs);
-out_buf:
-	kfree(buf);
-	return err;
+	err = __bkpfs_clone_file(infile, outfile);
+	if (!err)
+		return 0;
+	return __bkpfs_read_write(infile, outfile);
 }
 
 /* A helper function that checks if a given string ends
@@ -172,16 +170,22 @@ int __str_starts_with(const char *str, const char *prefix)
 }
 
 /* Checks if the given filename is a backup file name
- * used by bkpfs
+ * used by bkpfs, i.e. it ends in .bkp and a backup number
+ * of at least BKP_MIN_DIGITS digits
  */
 int __is_backup_file(const char *str)
 {
-	int lenstr;
+	const char *num;
+	int lenext = strlen(BKP_EXT);
 
 	if (!str)
 		return 0;
-	lenstr = strlen(str);
-	return strncmp(BKP_EXT, str + lenstr - (MAX_BKP_NAME_EXT - 1), 4) == 0;
+	num = str + strlen(str);
+	while (num > str && isdigit(num[-1]))
+		num--;
+	if (strlen(num) < BKP_MIN_DIGITS || num - str < lenext)
+		return 0;
+	return strncmp(BKP_EXT, num - lenext, lenext) == 0;
 }
 
 /* Checks if the given file name is a valid file name to be
@@ -207,216 +211,424 @@ int __is_valid_filename(const char *file_name)
 	return 1;
 }
 
-/* Adds the backup extension to a given filename and
- * stores it in output.
+/*
+ * Layout of a .bkpm file. A fixed header is followed by one entry
+ * per version, oldest first, and all fields are little endian.
+ * Readers step over the header and the entries by the sizes stored
+ * in the header, so new fields can be appended to either without
+ * breaking existing metadata files.
+ */
+struct bkpm_header {
+	__le32 magic;
+	__le16 version;
+	__le16 hdr_size;
+	__le16 entry_size;
+	__le16 reserved;
+	__le32 num_bkps;
+	__le64 latest_bkp;
+};
+
+struct bkpm_entry {
+	__le64 bkpno;
+	__le64 size;
+	__le64 mtime_sec;
+	__le32 mtime_nsec;
+	__le32 loc;
+	__le64 csum;
+	__le32 flags;
+	__le32 reserved;
+	__le64 base;
+	__le64 fileno;
+	__le64 stored;
+	__le64 ctime_sec;
+	__le32 ctime_nsec;
+	__le32 reserved2;
+};
+
+/* entries written before fileno was added end with base */
+#define BKPM_ENTRY_MIN offsetof(struct bkpm_entry, fileno)
+
+/* Frees the version table of info */
+static void __bkpfs_free_info(struct bkpinfo *info)
+{
+	kfree(info->vers);
+	info->vers = NULL;
+}
+
+/* Copies src to dst, including its version table */
+static int __bkpfs_copy_info(struct bkpinfo *dst, const struct bkpinfo *src)
+{
+	*dst = *src;
+	dst->vers = NULL;
+	if (!src->num_bkps)
+		return 0;
+	dst->vers = kmemdup(src->vers, src->num_bkps * sizeof(*src->vers),
+			    GFP_KERNEL);
+	if (!dst->vers)
+		return -ENOMEM;
+	return 0;
+}
+
+/* Appends ver to the table as the newest version */
+static int __bkpfs_add_version(struct bkpinfo *info,
+			       const struct bkpfs_version *ver)
+{
+	struct bkpfs_version *vers;
+
+	vers = krealloc(info->vers, (info->num_bkps + 1) * sizeof(*vers),
+			GFP_KERNEL);
+	if (!vers)
+		return -ENOMEM;
+	vers[info->num_bkps++] = *ver;
+	info->vers = vers;
+	info->latest_bkp = ver->bkpno;
+	return 0;
+}
+
+/* Drops the version at index idx from the table */
+static void __bkpfs_del_version(struct bkpinfo *info, long idx)
+{
+	if (idx >= info->num_bkps)
+		return;
+	info->num_bkps -= 1;
+	memmove(info->vers + idx, info->vers + idx + 1,
+		(info->num_bkps - idx) * sizeof(*info->vers));
+}
+
+/*
+ * Drops the newest version from the table. Backup numbers
+ * only ever grow, so its number is not handed out again.
+ */
+static void __bkpfs_del_latest(struct bkpinfo *info)
+{
+	if (!info->num_bkps)
+		return;
+	info->num_bkps -= 1;
+}
+
+/* Looks up a version by its backup number */
+static struct bkpfs_version *__bkpfs_find_version(struct bkpinfo *info,
+						  u64 bkpno)
+{
+	long i;
+
+	for (i = 0; i < info->num_bkps; i++)
+		if (info->vers[i].bkpno == bkpno)
+			return &info->vers[i];
+	return NULL;
+}
+
+/*
+ * Serializes info into a newly allocated buffer in the .bkpm
+ * format. The caller must kvfree the buffer.
+ */
+static int __bkpfs_encode_meta(struct bkpinfo *info, char **bufp,
+			       size_t *lenp)
+{
+	struct bkpm_header *hdr;
+	struct bkpm_entry *ent;
+	struct bkpfs_version *ver;
+	size_t len;
+	long i;
+
+	len = sizeof(*hdr) + info->num_bkps * sizeof(*ent);
+	hdr = kvzalloc(len, GFP_KERNEL);
+	if (!hdr)
+		return -ENOMEM;
+
+	hdr->magic = cpu_to_le32(BKPM_MAGIC);
+	hdr->version = cpu_to_le16(BKPM_VERSION);
+	hdr->hdr_size = cpu_to_le16(sizeof(*hdr));
+	hdr->entry_size = cpu_to_le16(sizeof(*ent));
+	hdr->num_bkps = cpu_to_le32(info->num_bkps);
+	hdr->latest_bkp = cpu_to_le64(info->latest_bkp);
+
+	ent = (struct bkpm_entry *)(hdr + 1);
+	for (i = 0; i < info->num_bkps; i++, ent++) {
+		ver = &info->vers[i];
+		ent->bkpno = cpu_to_le64(ver->bkpno);
+		ent->size = cpu_to_le64(ver->size);
+		ent->mtime_sec = cpu_to_le64(ver->mtime.tv_sec);
+		ent->mtime_nsec = cpu_to_le32(ver->mtime.tv_nsec);
+		ent->loc = cpu_to_le32(ver->loc);
+		ent->csum = cpu_to_le64(ver->csum);
+		ent->flags = cpu_to_le32(ver->flags);
+		ent->base = cpu_to_le64(ver->base);
+		ent->fileno = cpu_to_le64(ver->fileno);
+		ent->stored = cpu_to_le64(ver->stored);
+		ent->ctime_sec = cpu_to_le64(ver->ctime.tv_sec);
+		ent->ctime_nsec = cpu_to_le32(ver->ctime.tv_nsec);
+		ent->reserved2 = 0;
+	}
+	*bufp = (char *)hdr;
+	*lenp = len;
+	return 0;
+}
+
+/*
+ * Parses the contents of a .bkpm file into info. Metadata files
+ * from before the binary format only hold the six digit "NNNMMM"
+ * record. For those only the counters are filled in and 1 is
+ * returned, so that the caller can convert the file.
  */
-int __init_file_name(const char *base, const char *extension, char *output)
+static int __bkpfs_decode_meta(const char *buf, size_t len,
+			       struct bkpinfo *info)
 {
-	int len_base, len_ext;
+	const struct bkpm_header *hdr = (const struct bkpm_header *)buf;
+	const struct bkpm_entry *ent;
+	struct bkpfs_version *ver;
+	char legacy[METAFILE_SIZE + 1];
+	size_t hdr_size, entry_size;
+	long i;
+	int err;
 
-	if (!base || !extension)
+	memset(info, 0, sizeof(*info));
+	if (len == METAFILE_SIZE) {
+		memcpy(legacy, buf, METAFILE_SIZE);
+		legacy[METAFILE_SIZE] = '\0';
+		err = kstrtou64(legacy + 3, 10, &info->latest_bkp);
+		if (err)
+			return err;
+		legacy[3] = '\0';
+		err = kstrtol(legacy, 10, &info->num_bkps);
+		if (err)
+			return err;
 		return 1;
+	}
 
-	len_base = strlen(base);
-	len_ext = strlen(extension);
+	if (len < sizeof(*hdr) || le32_to_cpu(hdr->magic) != BKPM_MAGIC)
+		return -EINVAL;
+	if (le16_to_cpu(hdr->version) > BKPM_VERSION)
+		return -EOPNOTSUPP;
+	hdr_size = le16_to_cpu(hdr->hdr_size);
+	entry_size = le16_to_cpu(hdr->entry_size);
+	if (hdr_size < sizeof(*hdr) || entry_size < BKPM_ENTRY_MIN)
+		return -EINVAL;
+	info->num_bkps = le32_to_cpu(hdr->num_bkps);
+	info->latest_bkp = le64_to_cpu(hdr->latest_bkp);
+	if (hdr_size + info->num_bkps * entry_size > len) {
+		info->num_bkps = 0;
+		return -EINVAL;
+	}
+	if (!info->num_bkps)
+		return 0;
 
-	memset(output, '\0', len_base + MAX_BKP_NAME_EXT);
-	strncpy(output, base, len_base);
-	strncat(output, extension, len_ext);
+	info->vers = kcalloc(info->num_bkps, sizeof(*info->vers), GFP_KERNEL);
+	if (!info->vers) {
+		info->num_bkps = 0;
+		return -ENOMEM;
+	}
+	for (i = 0; i < info->num_bkps; i++) {
+		ent = (const struct bkpm_entry *)(buf + hdr_size +
+						  i * entry_size);
+		ver = &info->vers[i];
+		ver->bkpno = le64_to_cpu(ent->bkpno);
+		ver->size = le64_to_cpu(ent->size);
+		ver->mtime.tv_sec = le64_to_cpu(ent->mtime_sec);
+		ver->mtime.tv_nsec = le32_to_cpu(ent->mtime_nsec);
+		ver->loc = le32_to_cpu(ent->loc);
+		ver->csum = le64_to_cpu(ent->csum);
+		ver->flags = le32_to_cpu(ent->flags);
+		ver->base = le64_to_cpu(ent->base);
+		ver->fileno = ver->bkpno;
+		if (entry_size >= offsetofend(struct bkpm_entry, fileno) &&
+		    ent->fileno)
+			ver->fileno = le64_to_cpu(ent->fileno);
+		// Older entries did not count, a full copy is the best guess
+		ver->stored = ver->size;
+		if (entry_size >= offsetofend(struct bkpm_entry, stored))
+			ver->stored = le64_to_cpu(ent->stored);
+		// Nor did they say when they were made, the mtime is close
+		ver->ctime = ver->mtime;
+		if (entry_size >= offsetofend(struct bkpm_entry, ctime_nsec)) {
+			ver->ctime.tv_sec = le64_to_cpu(ent->ctime_sec);
+			ver->ctime.tv_nsec = le32_to_cpu(ent->ctime_nsec);
+		}
+	}
 	return 0;
 }
 
-/* Reads the metadata file and stores the output in info*/
+/*
+ * Reads the metadata file in one go and parses it into info.
+ * Returns 1 for a metadata file in the old format, see
+ * __bkpfs_decode_meta().
+ */
 int __bkpfs_read_meta(struct file *metafile, struct bkpinfo *info)
 {
-	int len, err = 0;
+	int err;
 	char *buf;
-	mm_segment_t old_fs;
-	loff_t pos = 0;
+	ssize_t len;
+	loff_t pos = 0, size;
 
-	buf = kmalloc(METAFILE_SIZE + 1, GFP_KERNEL);
-	if (!buf) {
-		err = -ENOMEM;
-		goto out;
-	}
-	old_fs = get_fs();
-	set_fs(get_ds());
+	size = i_size_read(file_inode(metafile));
+	if (size < METAFILE_SIZE)
+		return -EIO;
+	if (size > BKPM_MAX_SIZE)
+		return -EFBIG;
 
-	memset(buf, '\0', METAFILE_SIZE + 1);
-	len = vfs_read(metafile, (char __user *)buf, METAFILE_SIZE, &pos);
-	if (len < 0) {
+	buf = kvmalloc(size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	len = kernel_read(metafile, buf, size, &pos);
+	if (len < 0)
 		err = len;
-		goto out_fs;
-	}
-	if (len >= 0 && len != METAFILE_SIZE) {
+	else if (len != size)
 		err = -EIO;
-		goto out_fs;
-	}
-	err = kstrtol(buf + 3, 10, &info->latest_bkp);
-	if (err)
-		goto out_fs;
-	buf[3] = '\0';
-	err = kstrtol(buf, 10, &info->num_bkps);
-
-out_fs:
-	set_fs(old_fs);
-out:
-	kfree(buf);
+	else
+		err = __bkpfs_decode_meta(buf, len, info);
+	kvfree(buf);
 	return err;
 }
 
-/* Updates the metadata file with attributes present in info*/
+/* Replaces the contents of the metadata file with info */
 int __bkpfs_update_meta(struct file *metafile, struct bkpinfo *info)
 {
-	int len, err = 0;
-	char *buf, *latest_bkp;
-	mm_segment_t old_fs;
+	int err;
+	char *buf;
+	size_t len;
+	ssize_t written;
 	loff_t pos = 0;
 
-	buf = kmalloc(METAFILE_SIZE, GFP_KERNEL);
-	if (!buf) {
-		err = -ENOMEM;
-		goto out;
-	}
-	latest_bkp = kmalloc(4, GFP_KERNEL);
-	if (!latest_bkp) {
-		err = -ENOMEM;
-		goto out;
-	}
-	old_fs = get_fs();
-	set_fs(get_ds());
+	err = __bkpfs_encode_meta(info, &buf, &len);
+	if (err)
+		return err;
+	written = kernel_write(metafile, buf, len, &pos);
+	if (written < 0)
+		err = written;
+	else if (written != len)
+		err = -EIO;
+	// The table got shorter, drop the stale entries
+	else if (i_size_read(file_inode(metafile)) > len)
+		err = vfs_truncate(&metafile->f_path, len);
+	kvfree(buf);
+	return err;
+}
+
+/*
+ * Gets the lower directory that holds a lower file.
+ * Caller must path_put it.
+ */
+static void __bkpfs_get_lower_parent(struct file *lower_file,
+				     struct path *lower_parent_path)
+{
+	lower_parent_path->mnt = mntget(lower_file->f_path.mnt);
+	lower_parent_path->dentry = dget_parent(lower_file->f_path.dentry);
+}
 
-	memset(buf, '\0', METAFILE_SIZE);
-	// Update buf with attributes
-	snprintf(buf, 4, "%03d", (int)info->num_bkps);
-	snprintf(latest_bkp, 4, "%03d", (int)info->latest_bkp);
-	strncat(buf, latest_bkp, 4);
+/* Where new backups of the file behind inode are kept */
+static u32 __bkpfs_bkp_loc(struct inode *inode)
+{
+	return bkpfs_has_store(inode->i_sb) ? BKPM_LOC_STORE : BKPM_LOC_FILE;
+}
 
-	len = vfs_write(metafile, (char __user *)buf, METAFILE_SIZE, &pos);
-	if (len < 0) {
-		err = len;
-		goto out_fs;
-	}
+/*
+ * Gets the lower directory that holds the backups of a file kept
+ * at loc, see BKPM_LOC_*. The store directory of the file is only
+ * created if create is set. Caller must path_put it.
+ */
+static int __bkpfs_get_bkp_dir(struct inode *inode, struct file *lower_file,
+			       u32 loc, int create, struct path *dir)
+{
+	if (loc == BKPM_LOC_STORE)
+		return bkpfs_get_store_dir(inode->i_sb, file_inode(lower_file),
+					   create, dir);
+	__bkpfs_get_lower_parent(lower_file, dir);
+	return 0;
+}
 
-out_fs:
-	set_fs(old_fs);
-out:
-	kfree(latest_bkp);
-	kfree(buf);
-	return err;
+/*
+ * Builds the name of a backup file of lower_file kept at loc from
+ * the extension and, for backups of a version, its number.
+ * Caller must kfree it.
+ */
+static char *__bkpfs_bkp_name(struct file *lower_file, u32 loc,
+			      const char *ext, u64 bkpno)
+{
+	const char *base;
+
+	if (loc == BKPM_LOC_STORE)
+		base = BKPFS_STORE_BASE;
+	else
+		base = (const char *)lower_file->f_path.dentry->d_name.name;
+	if (bkpno)
+		return kasprintf(GFP_KERNEL, "%s%s%0*llu", base, ext,
+				 BKP_MIN_DIGITS, (unsigned long long)bkpno);
+	return kasprintf(GFP_KERNEL, "%s%s", base, ext);
 }
 
 /* Helper method to create a dentry for a backup file
- * The input file pointer is the original file and not the
- * backup
+ * named bkp_name in the lower directory dir. If the backup
+ * file already exists it is returned as is.
  */
-struct dentry *__create_bkp_dentry(struct file *file,
+struct dentry *__create_bkp_dentry(struct path *dir,
 				   char *bkp_name, struct path *bkp_path)
 {
 	int err = 0;
-	struct file *lower_file;
-	struct qstr this;
 	struct dentry *lower_bkp_dentry, *lower_dir_dentry;
-	struct path lower_path, lower_parent_path;
-	struct vfsmount *lower_dir_mnt;
-
-	lower_file = bkpfs_lower_file(file);
-	// Populate negative dentry for bkp file
-	lower_path = lower_file->f_path;
-	lower_dir_dentry = lower_file->f_path.dentry->d_parent;
-	bkpfs_get_lower_path(file->f_path.dentry->d_parent, &lower_parent_path);
-
-	// Create a backup dentry and file open
-	lower_dir_dentry = lower_file->f_path.dentry->d_parent;
-	lower_dir_mnt = lower_parent_path.mnt;
-
-	err = vfs_path_lookup(lower_dir_dentry, lower_dir_mnt,
-			      bkp_name, 0, bkp_path);
-	if (!err)
-		return bkp_path->dentry;
-	if (err && err != -ENOENT)
-		goto out;
 
-	this.name = bkp_name;
-	this.len = strlen(bkp_name);
-	this.hash = full_name_hash(lower_dir_dentry, this.name, this.len);
-	lower_bkp_dentry = d_lookup(lower_dir_dentry, &this);
-	if (lower_bkp_dentry)
-		goto bkp_dcreate;
+	lower_dir_dentry = dir->dentry;
 
-	lower_bkp_dentry = d_alloc(lower_dir_dentry, &this);
-	if (!lower_bkp_dentry) {
-		err = -ENOMEM;
+	inode_lock_nested(d_inode(lower_dir_dentry), I_MUTEX_PARENT);
+	lower_bkp_dentry = lookup_one_len(bkp_name, lower_dir_dentry,
+					  strlen(bkp_name));
+	if (IS_ERR(lower_bkp_dentry)) {
+		err = PTR_ERR(lower_bkp_dentry);
 		goto out;
 	}
-	d_add(lower_bkp_dentry, NULL);
 
-bkp_dcreate:
 	// Create backup file
-	bkp_path->mnt = lower_path.mnt;
-	bkp_path->dentry = lower_bkp_dentry;
-
-	err = vfs_create(d_inode(lower_dir_dentry),
-			 lower_bkp_dentry, 0700, 0);
-	if (err) {
-		err = -EIO;
-		goto out;
+	if (d_really_is_negative(lower_bkp_dentry)) {
+		err = vfs_create(d_inode(lower_dir_dentry),
+				 lower_bkp_dentry, 0700, 0);
+		if (err) {
+			dput(lower_bkp_dentry);
+			err = -EIO;
+			goto out;
+		}
 	}
+	bkp_path->mnt = mntget(dir->mnt);
+	bkp_path->dentry = lower_bkp_dentry;
 out:
+	inode_unlock(d_inode(lower_dir_dentry));
 	if (err)
 		return ERR_PTR(err);
 	return lower_bkp_dentry;
 }
 
-/* Looks up a backup file of a given file based on
- * the  backup number and returns the file pointer.
- * The input file pointer is of the original file
- * and not the backup
+/*
+ * Looks up the backup file of version ver of a file and
+ * returns the file pointer. The input file pointer is
+ * the lower file of the original and not the backup
  */
-struct file *__bkpfs_fetch_bkp(struct file *file, int bkpno)
+static struct file *__bkpfs_fetch_bkp(struct inode *inode,
+				      struct file *lower_file,
+				      struct bkpfs_version *ver)
 {
 	int err = 0;
-	struct file *lower_file, *lower_bkp_file;
-	struct path lower_path, lower_parent_path, lower_bkp_path;
-	struct dentry *lower_dir_dentry;
-	struct vfsmount *lower_dir_mnt;
-	const unsigned char *file_name;
-	char *bkp_name, *ext;
+	struct file *lower_bkp_file;
+	struct path lower_dir_path, lower_bkp_path;
+	char *bkp_name;
 
-	lower_file = bkpfs_lower_file(file);
-	lower_path = lower_file->f_path;
-	bkpfs_get_lower_path(file->f_path.dentry->d_parent, &lower_parent_path);
+	// Do not create backup for an existing backup file
+	if (!__is_valid_filename(lower_file->f_path.dentry->d_name.name))
+		return ERR_PTR(-EINVAL);
 
-	// Create a backup dentry and file open
-	lower_dir_dentry = lower_file->f_path.dentry->d_parent;
-	lower_dir_mnt = lower_parent_path.mnt;
-	file_name = lower_file->f_path.dentry->d_name.name;
+	bkp_name = __bkpfs_bkp_name(lower_file, ver->loc, BKP_EXT,
+				    ver->fileno);
+	if (!bkp_name)
+		return ERR_PTR(-ENOMEM);
 
-	// Do not create backup for an existing backup file
-	if (!__is_valid_filename(file_name)) {
+	// Need to check if the backup file exists
+	err = __bkpfs_get_bkp_dir(inode, lower_file, ver->loc, 0,
+				  &lower_dir_path);
+	if (err) {
 		err = -EINVAL;
-		goto out_ignore;
-	}
-
-	// Fetch the backup file from bkpno
-	bkp_name = kmalloc(strlen(file_name) + MAX_BKP_NAME_EXT, GFP_KERNEL);
-	if (!bkp_name) {
-		err = -ENOMEM;
 		goto out_name;
 	}
-	__init_file_name(file_name, BKP_EXT, bkp_name);
-	ext = kmalloc(EXT_SIZE, GFP_KERNEL);
-	if (!ext) {
-		err = -ENOMEM;
-		goto out_name;
-	}
-	snprintf(ext, EXT_SIZE, "%03d", bkpno);
-	strncat(bkp_name, ext, EXT_SIZE);
-
-	// Need to check if the backup file exists
-	err = vfs_path_lookup(lower_dir_dentry,
-			      lower_dir_mnt, bkp_name,
+	err = vfs_path_lookup(lower_dir_path.dentry,
+			      lower_dir_path.mnt, bkp_name,
 			      0, &lower_bkp_path);
+	path_put(&lower_dir_path);
 	if (err) {
 		err = -EINVAL;
 		goto out_name;
@@ -426,414 +638,2099 @@ struct file *__bkpfs_fetch_bkp(struct file *file, int bkpno)
 				     O_RDONLY, current_cred());
 	path_put(&lower_bkp_path);
 out_name:
-	kfree(ext);
 	kfree(bkp_name);
-out_ignore:
-	path_put(&lower_parent_path);
 	if (err)
 		return ERR_PTR(err);
 	return lower_bkp_file;
 }
 
-/* Helper function to create, read or update a backup metadata
- * file based on the flags sent in. The input file pointer
- * is of the original file and not the backup
+/* Helper function to delete a backup given the parent directory
+ * path and the backup's file name.
  */
-static int __bkpfs_meta(struct file *file, int flag, struct bkpinfo *meta_info)
+int __remove_bkp(struct path lower_parent_path, char *bkp_name)
 {
-	int err = 0, mode_flag = O_RDWR;
-	const unsigned char *file_name;
-	char *bkp_name;
-	struct qstr this;
-	struct dentry *lower_bkp_dentry, *lower_dir_dentry;
-	struct path lower_path, lower_parent_path, lower_bkp_path;
-	struct file *lower_file, *lower_bkp_file = NULL;
+	int err = 0;
+	struct dentry *lower_dir_dentry, *lower_bkp_dentry;
+	struct path lower_bkp_path;
 	struct vfsmount *lower_dir_mnt;
 
-	// Initial/Essential parameters
-	lower_file = bkpfs_lower_file(file);
-	lower_path = lower_file->f_path;
-	bkpfs_get_lower_path(file->f_path.dentry->d_parent, &lower_parent_path);
-
-	// Create a backup dentry and file open
-	lower_dir_dentry = lower_file->f_path.dentry->d_parent;
+	lower_dir_dentry = lower_parent_path.dentry;
 	lower_dir_mnt = lower_parent_path.mnt;
-	file_name = lower_file->f_path.dentry->d_name.name;
-
-	// Do not create backup for an existing backup meta file
-	if (!__is_valid_filename(file_name)) {
-		err = -EINVAL;
-		goto out_ignore;
-	}
-
-	// Initialize string for backup file name
-	bkp_name = kmalloc(strlen(file_name) + MAX_BKP_NAME_EXT, GFP_KERNEL);
-	if (!bkp_name) {
-		err = -ENOMEM;
+	err = vfs_path_lookup(lower_dir_dentry,
+			      lower_dir_mnt, bkp_name,
+			      0, &lower_bkp_path);
+	if (err) {
+		pr_info("file for deletion not found\n");
+		err = 0;
 		goto out;
 	}
+	lower_bkp_dentry = lower_bkp_path.dentry;
+	dget(lower_bkp_dentry);
+	inode_lock(lower_dir_dentry->d_inode);
+	err = vfs_unlink(lower_dir_dentry->d_inode, lower_bkp_dentry, NULL);
+	if (err == -EBUSY && lower_bkp_dentry->d_flags & DCACHE_NFSFS_RENAMED)
+		err = 0;
 
-	__init_file_name(file_name, BKP_META_EXT, bkp_name);
+	inode_unlock(lower_dir_dentry->d_inode);
+	dput(lower_bkp_dentry);
 
-	// Need to check if the backup file exists before creating
-	err = vfs_path_lookup(lower_dir_dentry, lower_dir_mnt,
-			      bkp_name, 0, &lower_bkp_path);
-	if (!err) {
-		flag &= ~(BKPM_CREATE); // Reset create bit
-		goto bkp_fopen;
-	}
-	if (err && err != -ENOENT)
-		goto out;
+	path_put(&lower_bkp_path);
+out:
+	return err;
+}
 
-	// Populate negative dentry for bkp file
-	this.name = bkp_name;
-	this.len = strlen(bkp_name);
-	this.hash = full_name_hash(lower_dir_dentry, this.name, this.len);
-	lower_bkp_dentry = d_lookup(lower_dir_dentry, &this);
-	if (lower_bkp_dentry)
-		goto bkp_fcreate;
+/*
+ * Renames the file at from in the lower directory dir over the
+ * one named name, replacing it in one step.
+ */
+static int __bkpfs_rename_bkp(struct path *dir, struct dentry *from,
+			      const char *name)
+{
+	int err;
+	struct dentry *lower_dir_dentry = dir->dentry, *target;
 
-	lower_bkp_dentry = d_alloc(lower_dir_dentry, &this);
-	if (!lower_bkp_dentry) {
-		err = -ENOMEM;
-		goto out_path;
+	lock_rename(lower_dir_dentry, lower_dir_dentry);
+	target = lookup_one_len(name, lower_dir_dentry, strlen(name));
+	if (IS_ERR(target)) {
+		err = PTR_ERR(target);
+	} else {
+		err = vfs_rename(d_inode(lower_dir_dentry), from,
+				 d_inode(lower_dir_dentry), target, NULL, 0);
+		dput(target);
 	}
-	d_add(lower_bkp_dentry, NULL);
-bkp_fcreate:
-	// Create backup file
-	lower_bkp_path.mnt = lower_path.mnt;
-	lower_bkp_path.dentry = lower_bkp_dentry;
+	unlock_rename(lower_dir_dentry, lower_dir_dentry);
+	return err;
+}
 
-	err = vfs_create(d_inode(lower_dir_dentry),
-			 lower_bkp_dentry, 0700, 0);
-	if (err) {
-		err = -EIO;
-		goto out_path;
+/*
+ * Fills in the version table of a metadata file in the old
+ * format from the backup files themselves. Their checksums are
+ * not known, so the versions are left without one.
+ */
+static int __bkpfs_convert_meta(struct inode *inode,
+				struct file *lower_file,
+				struct bkpinfo *info)
+{
+	int err = 0;
+	u64 bkpno, oldest, latest;
+	struct bkpfs_version ver;
+	struct file *lower_bkp_file;
+
+	latest = info->latest_bkp;
+	oldest = latest - info->num_bkps + 1;
+	info->num_bkps = 0;
+	for (bkpno = oldest; bkpno <= latest; bkpno++) {
+		memset(&ver, 0, sizeof(ver));
+		ver.bkpno = bkpno;
+		ver.fileno = bkpno;
+		ver.loc = BKPM_LOC_FILE;
+		lower_bkp_file = __bkpfs_fetch_bkp(inode, lower_file, &ver);
+		if (IS_ERR(lower_bkp_file))
+			continue;
+		ver.size = i_size_read(file_inode(lower_bkp_file));
+		ver.stored = ver.size;
+		ver.mtime = file_inode(lower_bkp_file)->i_mtime;
+		ver.ctime = ver.mtime;
+		fput(lower_bkp_file);
+		err = __bkpfs_add_version(info, &ver);
+		if (err)
+			break;
 	}
-bkp_fopen:
-	// Create/Open a metadata file
-	lower_bkp_file = dentry_open(&lower_bkp_path,
-				     mode_flag, current_cred());
+	// Keep numbering where it was even if the newest backup is gone
+	info->latest_bkp = latest;
+	return err;
+}
 
-	if (IS_ERR(lower_bkp_file)) {
-		err = PTR_ERR(lower_bkp_file);
-		goto out_path;
-	}
+/*
+ * Opens the .bkpm file of a file kept at loc with flags.
+ * Returns -ENOENT if there is none.
+ */
+static struct file *__bkpfs_open_meta_file(struct inode *inode,
+					   struct file *lower_file, u32 loc,
+					   int flags)
+{
+	int err;
+	char *bkp_name;
+	struct path lower_dir_path, lower_bkp_path;
+	struct file *lower_bkp_file;
 
-	/*
-	 * Create a new metadata file if it does not exist,
-	 * otherwise read the existing metadata file
-	 */
-	if (flag & BKPM_CREATE) {
-		meta_info->num_bkps = 0;
-		meta_info->latest_bkp = 0;
-		err = __bkpfs_create_meta(lower_bkp_file);
-	} else {
-		err = __bkpfs_read_meta(lower_bkp_file, meta_info);
-	}
+	bkp_name = __bkpfs_bkp_name(lower_file, loc, BKP_META_EXT, 0);
+	if (!bkp_name)
+		return ERR_PTR(-ENOMEM);
 
-	// If update flag is passed then update the meta file
-	if (flag & BKPM_UPDATE) {
-		if (meta_info->latest_bkp >= MAX_BACKUPS)
-			meta_info->latest_bkp = meta_info->num_bkps;
-		else
-			meta_info->latest_bkp += 1;
-		if (meta_info->num_bkps < maxbkpver)
-			meta_info->num_bkps += 1;
-		//meta_info->latest_bkp += 1;
-		err = __bkpfs_update_meta(lower_bkp_file, meta_info);
-	}
-	if (flag & BKPM_UPDATE_DEL_LATEST) {
-		meta_info->num_bkps -= 1;
-		meta_info->latest_bkp -= 1;
-		err = __bkpfs_update_meta(lower_bkp_file, meta_info);
-	}
-	if (flag & BKPM_UPDATE_DEL_OLDEST) {
-		meta_info->num_bkps -= 1;
-		err = __bkpfs_update_meta(lower_bkp_file, meta_info);
-	}
-	if (flag & BKPM_UPDATE_DEL_ALL) {
-		meta_info->num_bkps = 0;
-		meta_info->latest_bkp = 0;
-		err = __bkpfs_update_meta(lower_bkp_file, meta_info);
-	}
+	err = __bkpfs_get_bkp_dir(inode, lower_file, loc, 0,
+				  &lower_dir_path);
+	if (err)
+		goto out;
+	err = vfs_path_lookup(lower_dir_path.dentry,
+			      lower_dir_path.mnt, bkp_name,
+			      0, &lower_bkp_path);
+	path_put(&lower_dir_path);
+	if (err)
+		goto out;
 
-	if (lower_bkp_file)
-		fput(lower_bkp_file);
-out_path:
+	lower_bkp_file = dentry_open(&lower_bkp_path, flags, current_cred());
 	path_put(&lower_bkp_path);
+	kfree(bkp_name);
+	return lower_bkp_file;
 out:
 	kfree(bkp_name);
-out_ignore:
-	path_put(&lower_parent_path);
-	return err;
+	return ERR_PTR(err);
 }
 
-/* Helper function to find the latest backup file name
- *  given a file and its backup information. The output
- *  file name is stored in output.
+/*
+ * With -o ring the .bkpm file of a file kept at loc is rewritten
+ * in place once it exists, so that a ring in steady state does not
+ * create or rename anything in the lower directory. The table has
+ * the same size from one version to the next there, so the write
+ * covers the old one exactly, and it is on disk before the version
+ * counts as made. Returns -ENOENT if there is no .bkpm file yet.
  */
-int __find_latest_bkp(const char *file_name, struct bkpinfo *info, char *output)
+static int __bkpfs_rewrite_meta_file(struct inode *inode,
+				     struct file *lower_file, u32 loc,
+				     struct bkpinfo *info)
 {
-	int latest_bkp;
-	char *ext;
-
-	if (!info)
-		return -EINVAL;
+	int err;
+	struct file *meta_file;
 
-	__init_file_name(file_name, BKP_EXT, output);
-	latest_bkp = (int)info->latest_bkp;
-	ext = kmalloc(EXT_SIZE, GFP_KERNEL);
-	if (!ext)
-		return -ENOMEM;
-	snprintf(ext, EXT_SIZE, "%03d", latest_bkp);
-	strncat(output, ext, EXT_SIZE);
-	return 0;
+	meta_file = __bkpfs_open_meta_file(inode, lower_file, loc, O_WRONLY);
+	if (IS_ERR(meta_file))
+		return PTR_ERR(meta_file);
+	err = __bkpfs_update_meta(meta_file, info);
+	if (!err)
+		err = vfs_fsync(meta_file, 0);
+	fput(meta_file);
+	return err;
 }
 
-/* Helper function to find oldest backup's file name
- * given a file and its backup information. The output
- * file name is stored int outpou;
+/*
+ * Replaces the .bkpm file of a file kept at loc with info. The
+ * table is written to a temporary file that is then renamed over
+ * the .bkpm file once it is on disk, so a crash in between leaves
+ * the old metadata rather than a partly written one.
  */
-int __find_oldest_bkp(const char *file_name, struct bkpinfo *info, char *output)
+static int __bkpfs_write_meta_file(struct inode *inode,
+				   struct file *lower_file, u32 loc,
+				   struct bkpinfo *info)
 {
-	int oldest_bkp;
-	char *ext;
+	int err;
+	char *bkp_name, *tmp_name = NULL;
+	struct path lower_dir_path, tmp_path;
+	struct dentry *tmp_dentry;
+	struct file *tmp_file;
+
+	if (BKPFS_OPTS(inode->i_sb)->ring) {
+		err = __bkpfs_rewrite_meta_file(inode, lower_file, loc, info);
+		if (err != -ENOENT)
+			return err;
+	}
 
-	if (!info)
-		return -EINVAL;
+	bkp_name = __bkpfs_bkp_name(lower_file, loc, BKP_META_EXT, 0);
+	if (bkp_name)
+		tmp_name = kasprintf(GFP_KERNEL, ".%s", bkp_name);
+	if (!tmp_name) {
+		err = -ENOMEM;
+		goto out_name;
+	}
+	err = __bkpfs_get_bkp_dir(inode, lower_file, loc, 1,
+				  &lower_dir_path);
+	if (err)
+		goto out_name;
 
-	__init_file_name(file_name, BKP_EXT, output);
-	oldest_bkp = (int)info->latest_bkp - (int)info->num_bkps + 1;
-	ext = kmalloc(EXT_SIZE, GFP_KERNEL);
-	if (!ext)
-		return -ENOMEM;
-	snprintf(ext, EXT_SIZE, "%03d", oldest_bkp);
-	strncat(output, ext, EXT_SIZE);
-	return 0;
+	tmp_dentry = __create_bkp_dentry(&lower_dir_path, tmp_name, &tmp_path);
+	if (IS_ERR(tmp_dentry)) {
+		err = PTR_ERR(tmp_dentry);
+		goto out_dir;
+	}
+	tmp_file = dentry_open(&tmp_path, O_WRONLY, current_cred());
+	if (IS_ERR(tmp_file)) {
+		err = PTR_ERR(tmp_file);
+		goto out_tmp;
+	}
+	// One left behind by a crash may still hold an older table
+	err = vfs_truncate(&tmp_path, 0);
+	if (!err)
+		err = __bkpfs_update_meta(tmp_file, info);
+	if (!err)
+		err = vfs_fsync(tmp_file, 0);
+	fput(tmp_file);
+	if (!err)
+		err = __bkpfs_rename_bkp(&lower_dir_path, tmp_dentry, bkp_name);
+out_tmp:
+	path_put(&tmp_path);
+	if (err)
+		__remove_bkp(lower_dir_path, tmp_name);
+out_dir:
+	path_put(&lower_dir_path);
+out_name:
+	kfree(tmp_name);
+	kfree(bkp_name);
+	return err;
 }
 
-/* Helper function to delete a backup given the parent directory
- * path and the backup's file name.
+/* Deletes the .bkpm file of a file kept at loc, if there is one */
+static void __bkpfs_remove_meta_file(struct inode *inode,
+				     struct file *lower_file, u32 loc)
+{
+	char *bkp_name;
+	struct path lower_dir_path;
+
+	bkp_name = __bkpfs_bkp_name(lower_file, loc, BKP_META_EXT, 0);
+	if (!bkp_name)
+		return;
+	if (!__bkpfs_get_bkp_dir(inode, lower_file, loc, 0,
+				 &lower_dir_path)) {
+		__remove_bkp(lower_dir_path, bkp_name);
+		path_put(&lower_dir_path);
+	}
+	kfree(bkp_name);
+}
+
+/*
+ * Reads the .bkpm file of a file kept at loc, converting it from
+ * the old format on the way. An empty file was created by an
+ * update that never got to write it. Returns -ENOENT if there
+ * is no .bkpm file.
  */
-int __remove_bkp(struct path lower_parent_path, char *bkp_name)
+static int __bkpfs_read_meta_file(struct inode *inode,
+				  struct file *lower_file, u32 loc,
+				  struct bkpinfo *meta_info)
 {
 	int err = 0;
-	struct dentry *lower_dir_dentry, *lower_bkp_dentry;
-	struct path lower_bkp_path;
-	struct vfsmount *lower_dir_mnt;
+	struct file *lower_bkp_file;
 
-	lower_dir_dentry = lower_parent_path.dentry;
-	lower_dir_mnt = lower_parent_path.mnt;
-	err = vfs_path_lookup(lower_dir_dentry,
-			      lower_dir_mnt, bkp_name,
-			      0, &lower_bkp_path);
-	if (err) {
-		pr_info("file for deletion not found\n");
-		err = 0;
-		goto out;
+	lower_bkp_file = __bkpfs_open_meta_file(inode, lower_file, loc,
+						O_RDONLY);
+	if (IS_ERR(lower_bkp_file))
+		return PTR_ERR(lower_bkp_file);
+
+	/*
+	 * The file is only ever renamed into place once written, so an
+	 * empty or short one is as corrupt as any other and must not be
+	 * mistaken for a file without backups.
+	 */
+	err = __bkpfs_read_meta(lower_bkp_file, meta_info);
+	if (err == -EIO)
+		pr_err("bkpfs: corrupt metadata file for %pd\n",
+		       lower_file->f_path.dentry);
+	fput(lower_bkp_file);
+	if (err == 1) {
+		err = __bkpfs_convert_meta(inode, lower_file, meta_info);
+		if (!err)
+			err = __bkpfs_write_meta_file(inode, lower_file, loc,
+						      meta_info);
 	}
-	lower_bkp_dentry = lower_bkp_path.dentry;
-	dget(lower_bkp_dentry);
-	inode_lock(lower_dir_dentry->d_inode);
-	err = vfs_unlink(lower_dir_dentry->d_inode, lower_bkp_dentry, NULL);
-	if (err == -EBUSY && lower_bkp_dentry->d_flags & DCACHE_NFSFS_RENAMED)
-		err = 0;
+	return err;
+}
 
-	inode_unlock(lower_dir_dentry->d_inode);
-	dput(lower_bkp_dentry);
+/*
+ * Reads or updates the metadata of a file kept in a .bkpm file
+ * next to it, or in its store directory with -o store, see
+ * __bkpfs_meta(). The file is only created by the first update.
+ */
+static int __bkpfs_meta_file(struct inode *inode, struct file *lower_file,
+			     int flag, struct bkpinfo *meta_info)
+{
+	int err;
+	u32 loc = __bkpfs_bkp_loc(inode);
+
+	if (flag & BKPM_UPDATE)
+		return __bkpfs_write_meta_file(inode, lower_file, loc,
+					       meta_info);
+
+	err = __bkpfs_read_meta_file(inode, lower_file, loc, meta_info);
+	if (err != -ENOENT)
+		return err;
+
+	// Backups made before the store was used are still next to the file
+	if (loc == BKPM_LOC_STORE)
+		err = __bkpfs_read_meta_file(inode, lower_file,
+					     BKPM_LOC_FILE, meta_info);
+	// No backups were made yet
+	if (err == -ENOENT) {
+		memset(meta_info, 0, sizeof(*meta_info));
+		return 0;
+	}
+	if (err)
+		return err;
 
-	path_put(&lower_bkp_path);
+	// Move their metadata into the store, the versions stay put
+	err = __bkpfs_meta_file(inode, lower_file, BKPM_UPDATE, meta_info);
+	if (!err)
+		__bkpfs_remove_meta_file(inode, lower_file, BKPM_LOC_FILE);
+	return err;
+}
+
+/*
+ * Stores info in the metadata xattr of the lower file. This is
+ * bkpfs' own bookkeeping, so the xattr permission checks, which
+ * would keep users from writing trusted xattrs, are skipped.
+ */
+static int __bkpfs_set_meta_xattr(struct dentry *lower_dentry,
+				  struct bkpinfo *info)
+{
+	int err;
+	char *buf;
+	size_t len;
+
+	err = __bkpfs_encode_meta(info, &buf, &len);
+	if (err)
+		return err;
+	if (len > XATTR_SIZE_MAX) {
+		err = -E2BIG;
+		goto out;
+	}
+	inode_lock(d_inode(lower_dentry));
+	err = __vfs_setxattr_noperm(lower_dentry, BKPFS_META_XATTR,
+				    buf, len, 0);
+	inode_unlock(d_inode(lower_dentry));
 out:
+	kvfree(buf);
 	return err;
 }
 
-/* Helper function to remove all backups associated
- * with the file based on the info from the metadata
+/*
+ * Reads or updates the metadata of a file kept in the
+ * BKPFS_META_XATTR xattr of the lower file, see __bkpfs_meta().
+ * Metadata still kept in a .bkpm file from before is moved into
+ * the xattr the first time it is read.
+ */
+/*
+ * Checks if the lower file system refused the metadata xattr for
+ * being too big
  */
-int __bkpfs_remove_all_bkps(struct file *file, struct bkpinfo *info)
+static int __bkpfs_xattr_full(int err)
 {
-	int i, oldest_bkp, err = 0;
-	char *bkp_name, *ext;
-	const unsigned char *file_name;
-	struct file *lower_file;
-	struct path lower_parent_path;
+	return err == -E2BIG || err == -ENOSPC || err == -ERANGE;
+}
 
-	lower_file = bkpfs_lower_file(file);
-	file_name = lower_file->f_path.dentry->d_name.name;
-	oldest_bkp = (int)info->latest_bkp - (int)info->num_bkps + 1;
-	bkpfs_get_lower_path(file->f_path.dentry->d_parent, &lower_parent_path);
+/*
+ * Stores meta_info in the metadata xattr or, once it is too big for
+ * the lower file system, in the .bkpm file that the xattr falls back
+ * to. With 4K blocks on ext4 that happens at about 40 versions. The
+ * file goes again once the versions fit into the xattr.
+ */
+static int __bkpfs_update_meta_xattr(struct inode *inode,
+				     struct file *lower_file,
+				     struct bkpinfo *meta_info)
+{
+	int err;
+	struct bkpfs_inode_info *ii = BKPFS_I(inode);
+	struct dentry *lower_dentry = lower_file->f_path.dentry;
+
+	err = __bkpfs_set_meta_xattr(lower_dentry, meta_info);
+	if (!err && ii->meta_in_file) {
+		__bkpfs_remove_meta_file(inode, lower_file,
+					 __bkpfs_bkp_loc(inode));
+		ii->meta_in_file = 0;
+	}
+	if (!__bkpfs_xattr_full(err))
+		return err;
 
-	bkp_name = kmalloc(strlen(file_name) + MAX_BKP_NAME_EXT, GFP_KERNEL);
-	if (!bkp_name) {
-		err = -ENOMEM;
+	err = __bkpfs_meta_file(inode, lower_file, BKPM_UPDATE, meta_info);
+	if (err)
+		return err;
+	ii->meta_in_file = 1;
+	inode_lock(d_inode(lower_dentry));
+	err = __vfs_removexattr(lower_dentry, BKPFS_META_XATTR);
+	inode_unlock(d_inode(lower_dentry));
+	return err == -ENODATA ? 0 : err;
+}
+
+static int __bkpfs_meta_xattr(struct inode *inode, struct file *lower_file,
+			      int flag, struct bkpinfo *meta_info)
+{
+	int err;
+	char *buf = NULL;
+	ssize_t size;
+	struct dentry *lower_dentry = lower_file->f_path.dentry;
+
+	if (flag & BKPM_UPDATE)
+		return __bkpfs_update_meta_xattr(inode, lower_file, meta_info);
+
+	// Size the buffer to the xattr, it may grow in between
+	do {
+		kvfree(buf);
+		buf = NULL;
+		size = __vfs_getxattr(lower_dentry, d_inode(lower_dentry),
+				      BKPFS_META_XATTR, NULL, 0);
+		if (size <= 0)
+			break;
+		buf = kvmalloc(size, GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+		size = __vfs_getxattr(lower_dentry, d_inode(lower_dentry),
+				      BKPFS_META_XATTR, buf, size);
+	} while (size == -ERANGE);
+	if (size >= 0) {
+		err = __bkpfs_decode_meta(buf, size, meta_info);
+		// The xattr is never written in the old format
+		if (err == 1)
+			err = -EINVAL;
 		goto out;
 	}
-	ext = kmalloc(EXT_SIZE, GFP_KERNEL);
-	if (!ext) {
-		err = -ENOMEM;
+	err = size;
+	if (err != -ENODATA)
 		goto out;
-	}
-	// Delete backups starting from the oldest
-	for (i = oldest_bkp; i <= (int)info->latest_bkp; i++) {
-		__init_file_name(file_name, BKP_EXT, bkp_name);
-		memset(ext, '\0', EXT_SIZE);
-		snprintf(ext, EXT_SIZE, "%03d", i);
-		strncat(bkp_name, ext, EXT_SIZE);
-		err = __remove_bkp(lower_parent_path, bkp_name);
+
+	err = __bkpfs_meta_file(inode, lower_file, BKPM_READ, meta_info);
+	if (!err && meta_info->latest_bkp) {
+		err = __bkpfs_set_meta_xattr(lower_dentry, meta_info);
+		// Too many versions for the xattr, they stay in the file
+		if (__bkpfs_xattr_full(err)) {
+			BKPFS_I(inode)->meta_in_file = 1;
+			err = 0;
+			goto out;
+		}
 		if (err)
 			goto out;
+		// The .bkpm file is not needed anymore
+		__bkpfs_remove_meta_file(inode, lower_file,
+					 __bkpfs_bkp_loc(inode));
+		BKPFS_I(inode)->meta_in_file = 0;
 	}
 out:
-	kfree(ext);
-	kfree(bkp_name);
-	path_put(&lower_parent_path);
+	kvfree(buf);
 	return err;
 }
 
-/* Renames a backup and takes in the old and new dentries */
-int bkpfs_rename_bkp(struct dentry *lower_old_dentry,
-		     struct dentry *lower_new_dentry)
+/*
+ * Helper function to read or update the backup metadata of a
+ * file based on the flags sent in. The input file pointer is
+ * the lower file of the original and not the backup.
+ * BKPM_READ fills in meta_info, whose version table the caller
+ * must release with __bkpfs_free_info(). A file that has no
+ * backups yet reads as empty; nothing is stored for it until
+ * the first BKPM_UPDATE, which writes meta_info out as it is.
+ * The metadata lives in a .bkpm file next to the file (in its
+ * store directory with -o store=1), or in an xattr of the lower
+ * file with -o metaxattr=1. It is cached in the upper inode once
+ * it has been read, so reads are served from memory and only
+ * updates go to the lower file system.
+ * The caller must hold the inode's meta_mutex across a read and
+ * the update that follows it, and the store credentials.
+ */
+static int __bkpfs_meta(struct inode *inode, struct file *lower_file,
+			int flag, struct bkpinfo *meta_info)
 {
-	int err = 0;
-	struct dentry *trap;
-	struct dentry *lower_dir_dentry = NULL;
+	int err;
+	struct bkpfs_inode_info *ii = BKPFS_I(inode);
+
+	lockdep_assert_held(&ii->meta_mutex);
 
-	lower_dir_dentry = dget_parent(lower_old_dentry);
+	// Do not create backup for an existing backup meta file
+	if (!__is_valid_filename(lower_file->f_path.dentry->d_name.name))
+		return -EINVAL;
 
-	trap = lock_rename(lower_dir_dentry, lower_dir_dentry);
+	if (!(flag & BKPM_UPDATE) && ii->meta_valid &&
+	    ii->meta_owner == lower_file->f_path.dentry)
+		return __bkpfs_copy_info(meta_info, &ii->meta);
 
-	err = vfs_rename(d_inode(lower_dir_dentry), lower_old_dentry,
-			 d_inode(lower_dir_dentry), lower_new_dentry,
-			NULL, 0);
+	if (BKPFS_OPTS(inode->i_sb)->metaxattr)
+		err = __bkpfs_meta_xattr(inode, lower_file, flag, meta_info);
+	else
+		err = __bkpfs_meta_file(inode, lower_file, flag, meta_info);
 
-	unlock_rename(lower_dir_dentry, lower_dir_dentry);
-	dput(lower_dir_dentry);
+	kfree(ii->meta.vers);
+	ii->meta.vers = NULL;
+	ii->meta_valid = 0;
+	if (!err) {
+		ii->meta_valid = !__bkpfs_copy_info(&ii->meta, meta_info);
+		ii->meta_owner = lower_file->f_path.dentry;
+		bkpfs_track_usage(inode, meta_info->num_bkps);
+	}
 	return err;
 }
 
-/* This function is invoked when the maximum backup
- * limit is reached which is 999. This is a design decision
- * based on how the metadata file is structured (3 bits for
- * storing number of backups). Once the limit is reached
- * all the backup files are renamed to start from 1 to N in
- * the same order as they were created.
+/*
+ * Layout of the backup file of a delta version. A header and a
+ * table of the extents that changed since the base version are
+ * followed by the contents of those extents back to back, all
+ * little endian. Everything outside of the extents is the same
+ * as in the base version, up to the size of this one.
  */
-int __reset_all_bkps(struct file *file, struct bkpinfo *info)
-{
-	int err = 0, oldest_bkp, i, new_file_num = 0;
-	struct file *lower_file;
-	const unsigned char *file_name;
-	char *new_bkp_name, *ext;
-	struct dentry *new_bkp_dentry;
-	struct path new_bkp_path;
-	struct file *old_bkp_file;
+#define BKPD_MAGIC 0x44504b42	/* "BKPD" */
+#define BKPD_VERSION 1
+#define BKPD_MAX_EXTENTS 4096
+
+struct bkpd_header {
+	__le32 magic;
+	__le16 version;
+	__le16 hdr_size;
+	__le32 nr_extents;
+	__le32 reserved;
+	__le64 base;
+	__le64 size;
+};
 
-	lower_file = bkpfs_lower_file(file);
-	file_name = lower_file->f_path.dentry->d_name.name;
-	new_bkp_name = kmalloc(strlen(file_name) + MAX_BKP_NAME_EXT,
-			       GFP_KERNEL);
+struct bkpd_extent {
+	__le64 start;
+	__le64 len;
+};
+
+/*
+ * Layout of the backup file of a chunked version. A header is
+ * followed by the list of the chunks that make up the contents,
+ * in order, all little endian. The chunks are in the chunk store.
+ */
+#define BKPR_MAGIC 0x52504b42	/* "BKPR" */
+#define BKPR_VERSION 1
+#define BKPR_MAX_CHUNKS (1 << 22)
+
+struct bkpr_header {
+	__le32 magic;
+	__le16 version;
+	__le16 hdr_size;
+	__le32 nr_chunks;
+	__le32 reserved;
+	__le64 size;
+};
+
+struct bkpr_chunk {
+	u8 hash[BKPFS_CHUNK_HASH];
+	__le32 len;
+	__le32 reserved;
+};
+
+/*
+ * Layout of the backup file of a compressed version. A header is
+ * followed by the contents in blocks of block_size bytes, each
+ * compressed on its own behind a struct bkpz_block. Blocks that do
+ * not get smaller are stored as they are, with BKPZ_RAW set.
+ */
+#define BKPZ_MAGIC 0x5a504b42	/* "BKPZ" */
+#define BKPZ_VERSION 1
+#define BKPZ_BLOCK (64 << 10)
+#define BKPZ_MAX_BLOCK (1 << 20)
+
+#define BKPZ_RAW 0x1
+
+struct bkpz_header {
+	__le32 magic;
+	__le16 version;
+	__le16 hdr_size;
+	__le32 alg;		/* BKP_COMPRESS_* */
+	__le32 block_size;
+	__le64 size;
+};
+
+struct bkpz_block {
+	__le32 len;		/* of the data that follows */
+	__le32 flags;		/* BKPZ_* */
+};
+
+/* A chunk of a chunked version and where it is in the file */
+struct bkpfs_cref {
+	loff_t start;
+	u32 len;
+	u8 hash[BKPFS_CHUNK_HASH];
+};
+
+/* An extent of a delta and where its contents are in the file */
+struct bkpfs_dext {
+	loff_t start;
+	loff_t len;
+	loff_t data;
+};
+
+/* One backup file of a version opened for reading */
+struct bkpfs_vlayer {
+	struct file *file;
+	loff_t size;			/* of the file at this version */
+	u32 nr_extents;			/* 0 for the full version */
+	struct bkpfs_dext *extents;
+	bool chunked;			/* full version kept as chunks */
+	u32 nr_chunks;
+	struct bkpfs_cref *chunks;
+	struct super_block *sb;		/* holds the chunk store */
+	struct file *chunk_file;	/* chunk_idx, the chunk read last */
+	u32 chunk_idx;
+	bool compressed;		/* full version kept compressed */
+	u32 zblock;			/* block size */
+	u32 nr_zblocks;
+	loff_t *zoff;			/* where each block is in file */
+	u32 zalg;			/* BKP_COMPRESS_* */
+	char *zin;			/* a block as stored */
+	char *zbuf;			/* zidx, the block read last */
+	u32 zidx;
+};
+
+/*
+ * A version opened with __bkpfs_open_version(): the full version
+ * its chain starts at, followed by the deltas up to the version.
+ */
+struct bkpfs_vreader {
+	int depth;
+	struct bkpfs_vlayer layers[BKP_DELTA_MAX];
+};
 
-	if (!new_bkp_name) {
+static void __bkpfs_close_version(struct bkpfs_vreader *vr)
+{
+	int i;
+
+	for (i = 0; i < BKP_DELTA_MAX; i++) {
+		if (vr->layers[i].file)
+			fput(vr->layers[i].file);
+		if (vr->layers[i].chunk_file)
+			fput(vr->layers[i].chunk_file);
+		kvfree(vr->layers[i].extents);
+		kvfree(vr->layers[i].chunks);
+		kvfree(vr->layers[i].zoff);
+		kvfree(vr->layers[i].zin);
+		kvfree(vr->layers[i].zbuf);
+	}
+	kfree(vr);
+}
+
+/* Reads the extent table of the delta version ver into layer */
+static int __bkpfs_load_delta(struct bkpfs_vlayer *layer,
+			      struct bkpfs_version *ver)
+{
+	int err = 0;
+	u32 i, nr;
+	size_t hdr_size;
+	ssize_t len;
+	loff_t pos = 0, data;
+	struct bkpd_header hdr;
+	struct bkpd_extent *ext;
+
+	len = kernel_read(layer->file, &hdr, sizeof(hdr), &pos);
+	if (len != sizeof(hdr))
+		return len < 0 ? len : -EIO;
+	hdr_size = le16_to_cpu(hdr.hdr_size);
+	nr = le32_to_cpu(hdr.nr_extents);
+	if (le32_to_cpu(hdr.magic) != BKPD_MAGIC ||
+	    hdr_size < sizeof(hdr) || nr > BKPD_MAX_EXTENTS ||
+	    le64_to_cpu(hdr.base) != ver->base)
+		return -EIO;
+	if (le16_to_cpu(hdr.version) > BKPD_VERSION)
+		return -EOPNOTSUPP;
+
+	ext = kvmalloc_array(nr, sizeof(*ext), GFP_KERNEL);
+	layer->extents = kvmalloc_array(nr, sizeof(*layer->extents),
+					GFP_KERNEL);
+	if (!ext || !layer->extents) {
 		err = -ENOMEM;
 		goto out;
 	}
-	ext = kmalloc(EXT_SIZE, GFP_KERNEL);
-	if (!ext) {
-		err = -ENOMEM;
-		goto out_name;
+	pos = hdr_size;
+	len = kernel_read(layer->file, ext, nr * sizeof(*ext), &pos);
+	if (len != nr * sizeof(*ext)) {
+		err = len < 0 ? len : -EIO;
+		goto out;
 	}
-	oldest_bkp = (int)info->latest_bkp - (int)info->num_bkps + 1;
-	for (i = oldest_bkp; i <= (int)info->latest_bkp; i++) {
-		old_bkp_file = __bkpfs_fetch_bkp(file, i);
-		if (IS_ERR(old_bkp_file)) {
-			err = PTR_ERR(old_bkp_file);
-			goto out_ext;
-		}
+	data = pos;
+	for (i = 0; i < nr; i++) {
+		layer->extents[i].start = le64_to_cpu(ext[i].start);
+		layer->extents[i].len = le64_to_cpu(ext[i].len);
+		layer->extents[i].data = data;
+		data += layer->extents[i].len;
+	}
+	layer->nr_extents = nr;
+out:
+	kvfree(ext);
+	return err;
+}
 
-		new_file_num += 1;
-		__init_file_name(file_name, BKP_EXT, new_bkp_name);
-		snprintf(ext, EXT_SIZE, "%03d", new_file_num);
-		strncat(new_bkp_name, ext, EXT_SIZE);
-
-		new_bkp_dentry = __create_bkp_dentry(file,
-						     new_bkp_name,
-						     &new_bkp_path);
-		if (IS_ERR(new_bkp_dentry)) {
-			err = PTR_ERR(new_bkp_dentry);
-			goto out_ext;
-		}
+/* Reads the chunk list of the chunked version ver into layer */
+static int __bkpfs_load_recipe(struct super_block *sb,
+			       struct bkpfs_vlayer *layer,
+			       struct bkpfs_version *ver)
+{
+	int err = 0;
+	u32 i, nr;
+	size_t hdr_size;
+	ssize_t len;
+	loff_t pos = 0, start = 0;
+	struct bkpr_header hdr;
+	struct bkpr_chunk *chunk;
+
+	len = kernel_read(layer->file, &hdr, sizeof(hdr), &pos);
+	if (len != sizeof(hdr))
+		return len < 0 ? len : -EIO;
+	hdr_size = le16_to_cpu(hdr.hdr_size);
+	nr = le32_to_cpu(hdr.nr_chunks);
+	if (le32_to_cpu(hdr.magic) != BKPR_MAGIC ||
+	    hdr_size < sizeof(hdr) || nr > BKPR_MAX_CHUNKS ||
+	    le64_to_cpu(hdr.size) != ver->size)
+		return -EIO;
+	if (le16_to_cpu(hdr.version) > BKPR_VERSION)
+		return -EOPNOTSUPP;
+
+	chunk = kvmalloc_array(nr, sizeof(*chunk), GFP_KERNEL);
+	layer->chunks = kvmalloc_array(nr, sizeof(*layer->chunks),
+				       GFP_KERNEL);
+	if (!chunk || !layer->chunks) {
+		err = -ENOMEM;
+		goto out;
+	}
+	pos = hdr_size;
+	len = kernel_read(layer->file, chunk, nr * sizeof(*chunk), &pos);
+	if (len != nr * sizeof(*chunk)) {
+		err = len < 0 ? len : -EIO;
+		goto out;
+	}
+	for (i = 0; i < nr; i++) {
+		layer->chunks[i].start = start;
+		layer->chunks[i].len = le32_to_cpu(chunk[i].len);
+		memcpy(layer->chunks[i].hash, chunk[i].hash,
+		       BKPFS_CHUNK_HASH);
+		start += layer->chunks[i].len;
+	}
+	if (start != ver->size) {
+		err = -EIO;
+		goto out;
+	}
+	layer->chunked = true;
+	layer->nr_chunks = nr;
+	layer->sb = sb;
+out:
+	kvfree(chunk);
+	return err;
+}
 
-		err = bkpfs_rename_bkp(old_bkp_file->f_path.dentry,
-				       new_bkp_dentry);
-		if (err)
-			goto out_ext;
+/* Reads the block table of the compressed version ver into layer */
+static int __bkpfs_load_compressed(struct super_block *sb,
+				   struct bkpfs_vlayer *layer,
+				   struct bkpfs_version *ver)
+{
+	u32 i, nr, block, alg;
+	size_t hdr_size;
+	ssize_t len;
+	loff_t pos = 0;
+	struct bkpz_header hdr;
+	struct bkpz_block blk;
+
+	len = kernel_read(layer->file, &hdr, sizeof(hdr), &pos);
+	if (len != sizeof(hdr))
+		return len < 0 ? len : -EIO;
+	hdr_size = le16_to_cpu(hdr.hdr_size);
+	block = le32_to_cpu(hdr.block_size);
+	if (le32_to_cpu(hdr.magic) != BKPZ_MAGIC ||
+	    hdr_size < sizeof(hdr) || block < PAGE_SIZE ||
+	    block > BKPZ_MAX_BLOCK ||
+	    le64_to_cpu(hdr.size) != ver->size)
+		return -EIO;
+	alg = le32_to_cpu(hdr.alg);
+	if (le16_to_cpu(hdr.version) > BKPZ_VERSION || !bkpfs_comp_name(alg))
+		return -EOPNOTSUPP;
+
+	nr = DIV_ROUND_UP_ULL(ver->size, block);
+	layer->zoff = kvmalloc_array(nr, sizeof(*layer->zoff), GFP_KERNEL);
+	layer->zin = kvmalloc(block, GFP_KERNEL);
+	layer->zbuf = kvmalloc(block, GFP_KERNEL);
+	if (!layer->zoff || !layer->zin || !layer->zbuf)
+		return -ENOMEM;
 
-		// Cleanup
-		if (old_bkp_file)
-			fput(old_bkp_file);
+	// Only the block headers are read here, the data when needed
+	pos = hdr_size;
+	for (i = 0; i < nr; i++) {
+		layer->zoff[i] = pos;
+		len = kernel_read(layer->file, &blk, sizeof(blk), &pos);
+		if (len != sizeof(blk))
+			return len < 0 ? len : -EIO;
+		if (le32_to_cpu(blk.len) > block)
+			return -EIO;
+		pos += le32_to_cpu(blk.len);
 	}
-	// Update info
-	info->latest_bkp = new_file_num;
+	layer->compressed = true;
+	layer->sb = sb;
+	layer->zalg = alg;
+	layer->zblock = block;
+	layer->nr_zblocks = nr;
+	layer->zidx = U32_MAX;
+	return 0;
+}
 
-out_ext:
-	path_put(&new_bkp_path);
-	kfree(ext);
-out_name:
-	kfree(new_bkp_name);
-out:
-	return err;
+/*
+ * Adds bytes, which may be negative, to the space taken by the
+ * versions of the mount. It never drops below 0, as versions made
+ * without -o mntmaxsize are not in it. The total is saved a little
+ * later, see bkpfs_usage_changed().
+ */
+static void __bkpfs_charge(struct super_block *sb, s64 bytes)
+{
+	atomic64_t *usage = &BKPFS_SB(sb)->bkp_bytes;
+
+	if (!bytes)
+		return;
+	if (atomic64_add_return(bytes, usage) < 0)
+		atomic64_set(usage, 0);
+	bkpfs_usage_changed(sb);
 }
 
-/* Helper function for creating a backup file*/
-static int __bkpfs_create_bkp(struct file *file, struct bkpinfo *info)
+/*
+ * Returns the bytes the lower file system allocated for file, which
+ * is what its backup costs, not its size.
+ */
+static u64 __bkpfs_allocated(struct file *file)
 {
-	int err = 0;
-	const unsigned char *file_name;
-	char *bkp_name, *ext;
-	struct dentry *lower_bkp_dentry, *lower_dir_dentry;
-	struct path lower_bkp_path, lower_path;
-	struct path lower_parent_path;
-	struct file *lower_file, *lower_bkp_file = NULL;
+	struct kstat stat;
 
-	// Initial/essetial parameters
-	lower_file = bkpfs_lower_file(file);
-	lower_path = lower_file->f_path;
-	bkpfs_get_lower_path(file->f_path.dentry->d_parent, &lower_parent_path);
+	if (vfs_getattr(&file->f_path, &stat, STATX_BLOCKS,
+			AT_STATX_SYNC_AS_STAT))
+		return i_size_read(file_inode(file));
+	return (u64)stat.blocks << 9;
+}
 
-	// Create a backup dentry and file open
-	lower_dir_dentry = lower_file->f_path.dentry->d_parent;
-	file_name = lower_file->f_path.dentry->d_name.name;
+/*
+ * Returns the bytes a chunk of len bytes takes in the store, whose
+ * files take whole blocks.
+ */
+static u64 __bkpfs_chunk_blocks(struct super_block *sb, size_t len)
+{
+	struct super_block *store_sb = BKPFS_SB(sb)->chunk_dir.dentry->d_sb;
 
-	// Do not create backup for an existing backup file
-	if (!__is_valid_filename(file_name))
-		goto out_ignore;
+	return ALIGN(BKPFS_CHUNK_DATA + len, store_sb->s_blocksize);
+}
 
-	// Initialize string for backup file name
-	bkp_name = kmalloc(strlen(file_name) + MAX_BKP_NAME_EXT, GFP_KERNEL);
-	if (!bkp_name) {
-		err = -ENOMEM;
-		goto out_name;
-	}
+/*
+ * Adds the chunks listed by the chunked version ver to set, except
+ * for those in but if that is given.
+ */
+static int __bkpfs_add_recipe(struct inode *inode, struct file *lower_file,
+			      struct bkpfs_version *ver,
+			      struct bkpfs_chunk_set *set,
+			      struct bkpfs_chunk_set *but)
+{
+	int err;
+	u32 i;
+	struct bkpfs_vlayer layer = {};
 
-	__init_file_name(file_name, BKP_EXT, bkp_name);
-	ext = kmalloc(EXT_SIZE, GFP_KERNEL);
-	if (!ext) {
-		err = -ENOMEM;
+	layer.file = __bkpfs_fetch_bkp(inode, lower_file, ver);
+	// Without the list the chunks can not be found anyway
+	if (IS_ERR(layer.file))
+		return 0;
+	err = __bkpfs_load_recipe(inode->i_sb, &layer, ver);
+	for (i = 0; !err && i < layer.nr_chunks; i++) {
+		if (but && bkpfs_chunk_set_has(but, layer.chunks[i].hash))
+			continue;
+		err = bkpfs_chunk_set_add(set, layer.chunks[i].hash);
+		if (err > 0)
+			err = 0;
+	}
+	kvfree(layer.chunks);
+	fput(layer.file);
+	return err;
+}
+
+/*
+ * Collects the chunks the chunked versions of a file in info refer
+ * to into set, leaving out version skip. These are the chunks the
+ * file holds a reference to, see chunk.c. Caller must free set.
+ */
+static int __bkpfs_held_chunks(struct inode *inode, struct file *lower_file,
+			       struct bkpinfo *info,
+			       struct bkpfs_version *skip,
+			       struct bkpfs_chunk_set *set)
+{
+	int err;
+	long i;
+	u64 size = 0;
+
+	for (i = 0; i < info->num_bkps; i++)
+		if (info->vers[i].flags & BKPV_CHUNKED)
+			size = max_t(u64, size, info->vers[i].size);
+	err = bkpfs_chunk_set_init(set, size / BKPFS_CHUNK_MIN);
+	for (i = 0; !err && i < info->num_bkps; i++) {
+		if (&info->vers[i] == skip ||
+		    !(info->vers[i].flags & BKPV_CHUNKED))
+			continue;
+		err = __bkpfs_add_recipe(inode, lower_file, &info->vers[i],
+					 set, NULL);
+	}
+	return err;
+}
+
+/*
+ * Drops the references of the chunked version ver of a file in info
+ * to the chunks no other version of the file refers to.
+ */
+static int __bkpfs_put_recipe(struct inode *inode, struct file *lower_file,
+			      struct bkpinfo *info, struct bkpfs_version *ver)
+{
+	int err;
+	struct bkpfs_chunk_set held = {}, gone = {};
+
+	err = __bkpfs_held_chunks(inode, lower_file, info, ver, &held);
+	if (!err)
+		err = bkpfs_chunk_set_init(&gone, ver->size / BKPFS_CHUNK_MIN);
+	if (!err)
+		err = __bkpfs_add_recipe(inode, lower_file, ver, &gone,
+					 &held);
+	if (!err)
+		err = bkpfs_put_chunk_set(inode->i_sb, &gone);
+	bkpfs_chunk_set_free(&gone);
+	bkpfs_chunk_set_free(&held);
+	return err;
+}
+
+/*
+ * Deletes the backup file of version ver of a file. A backup that
+ * is already gone is not an error.
+ */
+static int __bkpfs_unlink_version(struct inode *inode,
+				  struct file *lower_file,
+				  struct bkpfs_version *ver)
+{
+	int err;
+	char *bkp_name;
+	struct path lower_dir_path;
+
+	bkp_name = __bkpfs_bkp_name(lower_file, ver->loc, BKP_EXT,
+				    ver->fileno);
+	if (!bkp_name)
+		return -ENOMEM;
+	err = __bkpfs_get_bkp_dir(inode, lower_file, ver->loc, 0,
+				  &lower_dir_path);
+	if (err == -ENOENT) {
+		err = 0;
+		goto out;
+	}
+	if (err)
+		goto out;
+	// With -o reap the unlink is left to the reaper
+	if (!BKPFS_OPTS(inode->i_sb)->reap ||
+	    bkpfs_reap_later(inode->i_sb, &lower_dir_path, bkp_name, 0))
+		err = __remove_bkp(lower_dir_path, bkp_name);
+	path_put(&lower_dir_path);
+out:
+	if (!err)
+		__bkpfs_charge(inode->i_sb, -ver->stored);
+	kfree(bkp_name);
+	return err;
+}
+
+/*
+ * Deletes the backup file of version ver of a file in info, and for
+ * a chunked version the references only it had to its chunks.
+ */
+static int __bkpfs_remove_version(struct inode *inode,
+				  struct file *lower_file,
+				  struct bkpinfo *info,
+				  struct bkpfs_version *ver)
+{
+	int err;
+
+	if (ver->flags & BKPV_CHUNKED) {
+		err = __bkpfs_put_recipe(inode, lower_file, info, ver);
+		if (err)
+			return err;
+	}
+	return __bkpfs_unlink_version(inode, lower_file, ver);
+}
+
+/*
+ * Opens version ver of a file for __bkpfs_read_version(), along
+ * with the versions its delta chain is built on.
+ */
+static struct bkpfs_vreader *__bkpfs_open_version(struct inode *inode,
+						  struct file *lower_file,
+						  struct bkpinfo *info,
+						  struct bkpfs_version *ver)
+{
+	int err = 0, i;
+	struct bkpfs_version *cur;
+	struct bkpfs_vlayer *layer;
+	struct bkpfs_vreader *vr;
+
+	vr = kzalloc(sizeof(*vr), GFP_KERNEL);
+	if (!vr)
+		return ERR_PTR(-ENOMEM);
+
+	// Walk down to the full version the chain starts at
+	for (cur = ver; cur->flags & BKPV_DELTA; vr->depth++) {
+		cur = __bkpfs_find_version(info, cur->base);
+		if (!cur || vr->depth + 1 >= BKP_DELTA_MAX) {
+			err = -EIO;
+			goto out;
+		}
+	}
+	vr->depth++;
+
+	for (cur = ver, i = vr->depth - 1; i >= 0; i--) {
+		layer = &vr->layers[i];
+		layer->size = cur->size;
+		layer->file = __bkpfs_fetch_bkp(inode, lower_file, cur);
+		if (IS_ERR(layer->file)) {
+			err = PTR_ERR(layer->file);
+			layer->file = NULL;
+			goto out;
+		}
+		if (cur->flags & BKPV_DELTA) {
+			err = __bkpfs_load_delta(layer, cur);
+			if (err)
+				goto out;
+			cur = __bkpfs_find_version(info, cur->base);
+		} else if (cur->flags & BKPV_CHUNKED) {
+			err = __bkpfs_load_recipe(inode->i_sb, layer, cur);
+			if (err)
+				goto out;
+		} else if (cur->flags & BKPV_COMPRESSED) {
+			err = __bkpfs_load_compressed(inode->i_sb, layer,
+						      cur);
+			if (err)
+				goto out;
+		}
+	}
+	return vr;
+out:
+	__bkpfs_close_version(vr);
+	return ERR_PTR(err);
+}
+
+/* Reads [start, end) of a chunked version into buf */
+static ssize_t __bkpfs_read_chunks(struct bkpfs_vlayer *layer, char *buf,
+				   loff_t start, loff_t end)
+{
+	u32 lo = 0, hi = layer->nr_chunks, mid;
+	ssize_t n;
+	loff_t pos = start, to, off;
+	struct bkpfs_cref *c;
+
+	// Find the chunk that holds start
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		c = &layer->chunks[mid];
+		if (c->start + c->len <= start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < layer->nr_chunks && pos < end; lo++) {
+		c = &layer->chunks[lo];
+		if (!layer->chunk_file || layer->chunk_idx != lo) {
+			if (layer->chunk_file)
+				fput(layer->chunk_file);
+			layer->chunk_file = bkpfs_open_chunk(layer->sb,
+							     c->hash);
+			if (IS_ERR(layer->chunk_file)) {
+				n = PTR_ERR(layer->chunk_file);
+				layer->chunk_file = NULL;
+				return n;
+			}
+			layer->chunk_idx = lo;
+		}
+		to = min(end, c->start + c->len);
+		off = BKPFS_CHUNK_DATA + pos - c->start;
+		n = kernel_read(layer->chunk_file, buf + pos - start,
+				to - pos, &off);
+		if (n != to - pos)
+			return n < 0 ? n : -EIO;
+		pos = to;
+	}
+	return pos - start;
+}
+
+/* Reads block idx of a compressed version into layer->zbuf */
+static int __bkpfs_load_zblock(struct bkpfs_vlayer *layer, u32 idx)
+{
+	int err;
+	u32 len, raw_len;
+	unsigned int dlen = layer->zblock;
+	ssize_t n;
+	loff_t pos = layer->zoff[idx];
+	struct bkpz_block blk;
+	struct bkpfs_comp *comp;
+
+	n = kernel_read(layer->file, &blk, sizeof(blk), &pos);
+	if (n != sizeof(blk))
+		return n < 0 ? n : -EIO;
+	len = le32_to_cpu(blk.len);
+	raw_len = min_t(loff_t, layer->zblock,
+			layer->size - (loff_t)idx * layer->zblock);
+
+	if (le32_to_cpu(blk.flags) & BKPZ_RAW) {
+		n = kernel_read(layer->file, layer->zbuf, len, &pos);
+		if (n != len || len != raw_len)
+			return n < 0 ? n : -EIO;
+	} else {
+		n = kernel_read(layer->file, layer->zin, len, &pos);
+		if (n != len)
+			return n < 0 ? n : -EIO;
+		comp = bkpfs_lock_comp(layer->sb, layer->zalg);
+		if (IS_ERR(comp))
+			return PTR_ERR(comp);
+		err = crypto_comp_decompress(comp->tfm, layer->zin, len,
+					     layer->zbuf, &dlen);
+		bkpfs_unlock_comp(comp);
+		if (err || dlen != raw_len)
+			return -EIO;
+	}
+	layer->zidx = idx;
+	return 0;
+}
+
+/* Reads [start, end) of a compressed version into buf */
+static ssize_t __bkpfs_read_zblocks(struct bkpfs_vlayer *layer, char *buf,
+				    loff_t start, loff_t end)
+{
+	int err;
+	u32 idx;
+	loff_t pos, to, block_start;
+
+	for (pos = start; pos < end; pos = to) {
+		idx = div_u64(pos, layer->zblock);
+		if (idx != layer->zidx) {
+			err = __bkpfs_load_zblock(layer, idx);
+			if (err)
+				return err;
+		}
+		block_start = (loff_t)idx * layer->zblock;
+		to = min_t(loff_t, end, block_start + layer->zblock);
+		memcpy(buf + pos - start, layer->zbuf + pos - block_start,
+		       to - pos);
+	}
+	return end - start;
+}
+
+/*
+ * Reads up to len bytes at *pos of a version opened with
+ * __bkpfs_open_version() into buf. The full version is read
+ * first and then each delta is laid over it.
+ * Returns the number of bytes read, 0 at the end of the version.
+ */
+static ssize_t __bkpfs_read_version(struct bkpfs_vreader *vr, char *buf,
+				    size_t len, loff_t *pos)
+{
+	int i;
+	u32 j;
+	ssize_t n;
+	loff_t start = *pos, end, from, to, off;
+	struct bkpfs_vlayer *layer;
+	struct bkpfs_dext *ext;
+
+	if (start >= vr->layers[vr->depth - 1].size)
+		return 0;
+	end = min_t(loff_t, start + len, vr->layers[vr->depth - 1].size);
+
+	for (i = 0; i < vr->depth; i++) {
+		layer = &vr->layers[i];
+		if (i == 0) {
+			off = start;
+			if (layer->chunked)
+				n = __bkpfs_read_chunks(layer, buf, start, end);
+			else if (layer->compressed)
+				n = __bkpfs_read_zblocks(layer, buf, start,
+							 end);
+			else
+				n = kernel_read(layer->file, buf, end - start,
+						&off);
+			if (n < 0)
+				return n;
+			memset(buf + n, 0, end - start - n);
+		}
+		for (j = 0; j < layer->nr_extents; j++) {
+			ext = &layer->extents[j];
+			from = max(start, ext->start);
+			to = min(end, ext->start + ext->len);
+			if (from >= to)
+				continue;
+			off = ext->data + from - ext->start;
+			n = kernel_read(layer->file, buf + from - start,
+					to - from, &off);
+			if (n != to - from)
+				return n < 0 ? n : -EIO;
+		}
+		// Whatever was past the end of this version is gone
+		if (layer->size < end) {
+			from = max(layer->size, start);
+			memset(buf + from - start, 0, end - from);
+		}
+	}
+	*pos = end;
+	return end - start;
+}
+
+/*
+ * Copies the contents of a version opened with
+ * __bkpfs_open_version() to outfile. If csum is set, their
+ * checksum is computed on the way. Blocks of zeros are left
+ * as holes in outfile.
+ */
+static int __bkpfs_copy_version(struct bkpfs_vreader *vr,
+				struct file *outfile, u64 *csum)
+{
+	int err = 0;
+	char *buf;
+	loff_t pos = 0, out_pos = 0;
+	ssize_t len, written;
+	struct xxh64_state state;
+
+	// A full version can be copied, or cloned, as it is
+	if (vr->depth == 1 && !vr->layers[0].chunked &&
+	    !vr->layers[0].compressed && !csum)
+		return __bkpfs_copy_file(vr->layers[0].file, outfile);
+
+	buf = kvmalloc(BKP_CMP_CHUNK, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	xxh64_reset(&state, 0);
+	while ((len = __bkpfs_read_version(vr, buf, BKP_CMP_CHUNK,
+					   &pos)) > 0) {
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		xxh64_update(&state, buf, len);
+		if (!memchr_inv(buf, 0, len)) {
+			out_pos += len;
+			continue;
+		}
+		written = kernel_write(outfile, buf, len, &out_pos);
+		if (written != len) {
+			err = written < 0 ? written : -EIO;
+			break;
+		}
+	}
+	if (len < 0)
+		err = len;
+	if (!err && i_size_read(file_inode(outfile)) < out_pos)
+		err = vfs_truncate(&outfile->f_path, out_pos);
+	if (!err && csum)
+		*csum = xxh64_digest(&state);
+	kvfree(buf);
+	return err;
+}
+
+/*
+ * Reads up to len bytes of lower_file at *pos into buf, for a
+ * version that ends at size. A file cut short by a truncate since
+ * the version was described reads as zeros up to size, the next
+ * version has the truncate. Returns the number of bytes read, 0
+ * only at size.
+ */
+static ssize_t __bkpfs_read_lower(struct file *lower_file, char *buf,
+				  size_t len, loff_t *pos, loff_t size)
+{
+	ssize_t n;
+
+	len = min_t(loff_t, len, size - *pos);
+	if (!len)
+		return 0;
+	n = kernel_read(lower_file, buf, len, pos);
+	if (n)
+		return n;
+	memset(buf, 0, len);
+	*pos += len;
+	return len;
+}
+
+/*
+ * Writes the ranges of lower_file that were written since version
+ * ver->base to outfile, as the backup of the delta version ver
+ */
+static int __bkpfs_write_delta(struct file *lower_file, struct file *outfile,
+			       struct bkpfs_version *ver,
+			       struct list_head *ranges)
+{
+	int err = 0;
+	u32 nr = 0;
+	char *buf = NULL;
+	size_t hdr_len;
+	ssize_t len, written;
+	loff_t pos = 0, in_pos, end;
+	struct bkpfs_extent *ext;
+	struct bkpd_header *hdr;
+	struct bkpd_extent *dext;
+
+	list_for_each_entry(ext, ranges, list)
+		if (ext->start < ver->size)
+			nr++;
+	hdr_len = sizeof(*hdr) + nr * sizeof(*dext);
+	hdr = kvzalloc(hdr_len, GFP_KERNEL);
+	if (!hdr)
+		return -ENOMEM;
+
+	hdr->magic = cpu_to_le32(BKPD_MAGIC);
+	hdr->version = cpu_to_le16(BKPD_VERSION);
+	hdr->hdr_size = cpu_to_le16(sizeof(*hdr));
+	hdr->nr_extents = cpu_to_le32(nr);
+	hdr->base = cpu_to_le64(ver->base);
+	hdr->size = cpu_to_le64(ver->size);
+	dext = (struct bkpd_extent *)(hdr + 1);
+	list_for_each_entry(ext, ranges, list) {
+		if (ext->start >= ver->size)
+			continue;
+		dext->start = cpu_to_le64(ext->start);
+		dext->len = cpu_to_le64(min(ext->end, ver->size) - ext->start);
+		dext++;
+	}
+	written = kernel_write(outfile, hdr, hdr_len, &pos);
+	if (written != hdr_len) {
+		err = written < 0 ? written : -EIO;
+		goto out;
+	}
+
+	// Then the contents of the extents, in the same order
+	buf = kvmalloc(BKP_CMP_CHUNK, GFP_KERNEL);
+	if (!buf) {
+		err = -ENOMEM;
+		goto out;
+	}
+	list_for_each_entry(ext, ranges, list) {
+		end = min(ext->end, ver->size);
+		for (in_pos = ext->start; in_pos < end; ) {
+			len = __bkpfs_read_lower(lower_file, buf, BKP_CMP_CHUNK,
+						 &in_pos, end);
+			if (len < 0) {
+				err = len;
+				goto out;
+			}
+			written = kernel_write(outfile, buf, len, &pos);
+			if (written != len) {
+				err = written < 0 ? written : -EIO;
+				goto out;
+			}
+		}
+	}
+out:
+	kvfree(buf);
+	kvfree(hdr);
+	return err;
+}
+
+/*
+ * Writes the chunk list of lower_file to outfile, as the backup of
+ * the chunked version ver, and adds the chunks to the chunk store.
+ * The file already holds the chunks in held, which are left alone.
+ */
+static int __bkpfs_write_chunks(struct super_block *sb,
+				struct file *lower_file, struct file *outfile,
+				struct bkpfs_version *ver,
+				struct bkpfs_chunk_set *held)
+{
+	int err = 0;
+	u8 *buf;
+	u32 nr = 0, max = 256;
+	size_t have = 0, cut;
+	ssize_t len, written;
+	loff_t in_pos = 0, pos = 0;
+	struct bkpr_header hdr = {};
+	struct bkpr_chunk *list, *new;
+	struct xxh64_state state;
+	struct bkpfs_chunk_set added = {};
+
+	buf = kvmalloc(BKPFS_CHUNK_MAX, GFP_KERNEL);
+	list = kvmalloc_array(max, sizeof(*list), GFP_KERNEL);
+	if (!buf || !list) {
+		err = -ENOMEM;
+		goto out;
+	}
+	err = bkpfs_chunk_set_init(&added, ver->size / BKPFS_CHUNK_MIN);
+	if (err)
+		goto out;
+
+	xxh64_reset(&state, 0);
+	while (in_pos < ver->size || have) {
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		// Cut only once the window is full, or at the end
+		if (have < BKPFS_CHUNK_MAX && in_pos < ver->size) {
+			len = __bkpfs_read_lower(lower_file, buf + have,
+						 BKPFS_CHUNK_MAX - have,
+						 &in_pos, ver->size);
+			if (len < 0) {
+				err = len;
+				break;
+			}
+			xxh64_update(&state, buf + have, len);
+			have += len;
+			continue;
+		}
+		if (nr == max) {
+			if (max >= BKPR_MAX_CHUNKS) {
+				err = -EFBIG;
+				break;
+			}
+			new = kvmalloc_array(max * 2, sizeof(*list),
+					     GFP_KERNEL);
+			if (!new) {
+				err = -ENOMEM;
+				break;
+			}
+			memcpy(new, list, nr * sizeof(*list));
+			kvfree(list);
+			list = new;
+			max *= 2;
+		}
+		cut = bkpfs_chunk_cut(buf, have);
+		err = bkpfs_chunk_hash(sb, buf, cut, list[nr].hash);
+		if (err)
+			break;
+		// Only a chunk new to the file takes a reference
+		if (!bkpfs_chunk_set_has(held, list[nr].hash) &&
+		    !bkpfs_chunk_set_has(&added, list[nr].hash)) {
+			err = bkpfs_get_chunk(sb, list[nr].hash, buf, cut);
+			if (err < 0)
+				break;
+			// A new chunk is charged to the version that stored it
+			if (err)
+				ver->stored += __bkpfs_chunk_blocks(sb, cut);
+			err = bkpfs_chunk_set_add(&added, list[nr].hash);
+			if (err < 0) {
+				bkpfs_put_chunk(sb, list[nr].hash);
+				break;
+			}
+			err = 0;
+		}
+		list[nr].len = cpu_to_le32(cut);
+		list[nr].reserved = 0;
+		nr++;
+		have -= cut;
+		memmove(buf, buf + cut, have);
+	}
+	if (err)
+		goto out_put;
+	// The contents went through buf anyway, so the checksum is free
+	ver->csum = xxh64_digest(&state);
+	ver->flags |= BKPV_CSUM;
+
+	hdr.magic = cpu_to_le32(BKPR_MAGIC);
+	hdr.version = cpu_to_le16(BKPR_VERSION);
+	hdr.hdr_size = cpu_to_le16(sizeof(hdr));
+	hdr.nr_chunks = cpu_to_le32(nr);
+	hdr.size = cpu_to_le64(ver->size);
+	written = kernel_write(outfile, &hdr, sizeof(hdr), &pos);
+	if (written != sizeof(hdr)) {
+		err = written < 0 ? written : -EIO;
+		goto out_put;
+	}
+	len = nr * sizeof(*list);
+	written = kernel_write(outfile, list, len, &pos);
+	if (written != len) {
+		err = written < 0 ? written : -EIO;
+		goto out_put;
+	}
+	goto out;
+out_put:
+	// The version is not made, so drop the references it took
+	bkpfs_put_chunk_set(sb, &added);
+out:
+	bkpfs_chunk_set_free(&added);
+	kvfree(list);
+	kvfree(buf);
+	return err;
+}
+
+/*
+ * Writes lower_file to outfile as the backup of the compressed
+ * version ver, compressing it block by block on the way.
+ */
+static int __bkpfs_write_compressed(struct super_block *sb,
+				    struct file *lower_file,
+				    struct file *outfile,
+				    struct bkpfs_version *ver)
+{
+	int err = 0;
+	u32 alg = BKPFS_OPTS(sb)->compress;
+	char *buf, *zbuf, *data;
+	unsigned int zlen;
+	ssize_t len, want, have, written;
+	loff_t in_pos = 0, pos = 0;
+	struct bkpfs_comp *comp;
+	struct bkpz_header hdr = {};
+	struct bkpz_block blk;
+	struct xxh64_state state;
+
+	buf = kvmalloc(BKPZ_BLOCK, GFP_KERNEL);
+	zbuf = kvmalloc(BKPZ_BLOCK, GFP_KERNEL);
+	if (!buf || !zbuf) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	hdr.magic = cpu_to_le32(BKPZ_MAGIC);
+	hdr.version = cpu_to_le16(BKPZ_VERSION);
+	hdr.hdr_size = cpu_to_le16(sizeof(hdr));
+	hdr.alg = cpu_to_le32(alg);
+	hdr.block_size = cpu_to_le32(BKPZ_BLOCK);
+	hdr.size = cpu_to_le64(ver->size);
+	written = kernel_write(outfile, &hdr, sizeof(hdr), &pos);
+	if (written != sizeof(hdr)) {
+		err = written < 0 ? written : -EIO;
+		goto out;
+	}
+
+	xxh64_reset(&state, 0);
+	while (in_pos < ver->size) {
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		// Blocks are always full, so they can be found by offset
+		want = min_t(loff_t, BKPZ_BLOCK, ver->size - in_pos);
+		for (have = 0; have < want; have += len) {
+			len = __bkpfs_read_lower(lower_file, buf + have,
+						 want - have, &in_pos,
+						 ver->size);
+			if (len < 0) {
+				err = len;
+				goto out;
+			}
+		}
+		xxh64_update(&state, buf, want);
+
+		zlen = BKPZ_BLOCK;
+		comp = bkpfs_lock_comp(sb, alg);
+		if (IS_ERR(comp)) {
+			err = PTR_ERR(comp);
+			break;
+		}
+		if (crypto_comp_compress(comp->tfm, buf, want, zbuf, &zlen))
+			zlen = want;
+		bkpfs_unlock_comp(comp);
+		if (zlen < want) {
+			blk.len = cpu_to_le32(zlen);
+			blk.flags = 0;
+			data = zbuf;
+		} else {
+			blk.len = cpu_to_le32(want);
+			blk.flags = cpu_to_le32(BKPZ_RAW);
+			data = buf;
+		}
+		written = kernel_write(outfile, &blk, sizeof(blk), &pos);
+		if (written != sizeof(blk)) {
+			err = written < 0 ? written : -EIO;
+			break;
+		}
+		len = le32_to_cpu(blk.len);
+		written = kernel_write(outfile, data, len, &pos);
+		if (written != len) {
+			err = written < 0 ? written : -EIO;
+			break;
+		}
+	}
+	if (!err) {
+		ver->csum = xxh64_digest(&state);
+		ver->flags |= BKPV_CSUM;
+	}
+out:
+	kvfree(zbuf);
+	kvfree(buf);
+	return err;
+}
+
+/* Number of deltas between ver and the full version it is built on */
+static int __bkpfs_chain_len(struct bkpinfo *info, struct bkpfs_version *ver)
+{
+	int len = 0;
+
+	while (ver && (ver->flags & BKPV_DELTA)) {
+		ver = __bkpfs_find_version(info, ver->base);
+		len++;
+	}
+	return len;
+}
+
+/*
+ * Turns the delta version ver into a full version, so that the
+ * version it is based on can be removed. The full contents are
+ * written to a hidden file next to the delta first and then
+ * renamed over it.
+ */
+static int __bkpfs_rebase_version(struct inode *inode, struct file *lower_file,
+				  struct bkpinfo *info,
+				  struct bkpfs_version *ver)
+{
+	int err;
+	u64 csum, stored;
+	char *bkp_name, *tmp_name = NULL;
+	struct bkpfs_vreader *vr;
+	struct path lower_dir_path, tmp_path;
+	struct dentry *tmp_dentry;
+	struct file *tmp_file;
+
+	bkp_name = __bkpfs_bkp_name(lower_file, ver->loc, BKP_EXT,
+				    ver->fileno);
+	if (bkp_name)
+		tmp_name = kasprintf(GFP_KERNEL, ".%s", bkp_name);
+	if (!tmp_name) {
+		err = -ENOMEM;
+		goto out_name;
+	}
+	err = __bkpfs_get_bkp_dir(inode, lower_file, ver->loc, 0,
+				  &lower_dir_path);
+	if (err)
+		goto out_name;
+	vr = __bkpfs_open_version(inode, lower_file, info, ver);
+	if (IS_ERR(vr)) {
+		err = PTR_ERR(vr);
+		goto out_dir;
+	}
+
+	tmp_dentry = __create_bkp_dentry(&lower_dir_path, tmp_name, &tmp_path);
+	if (IS_ERR(tmp_dentry)) {
+		err = PTR_ERR(tmp_dentry);
+		goto out_vr;
+	}
+	// dentry_open() ignores O_TRUNC, and a crash may leave one behind
+	err = vfs_truncate(&tmp_path, 0);
+	if (err)
+		goto out_tmp;
+	tmp_file = dentry_open(&tmp_path, O_WRONLY, current_cred());
+	if (IS_ERR(tmp_file)) {
+		err = PTR_ERR(tmp_file);
+		goto out_tmp;
+	}
+	err = __bkpfs_copy_version(vr, tmp_file, &csum);
+	stored = __bkpfs_allocated(tmp_file);
+	fput(tmp_file);
+	if (err)
+		goto out_tmp;
+
+	err = __bkpfs_rename_bkp(&lower_dir_path, tmp_dentry, bkp_name);
+	if (!err) {
+		ver->flags = (ver->flags & ~BKPV_DELTA) | BKPV_CSUM;
+		ver->base = 0;
+		ver->csum = csum;
+		__bkpfs_charge(inode->i_sb, stored - ver->stored);
+		ver->stored = stored;
+	}
+out_tmp:
+	path_put(&tmp_path);
+	if (err)
+		__remove_bkp(lower_dir_path, tmp_name);
+out_vr:
+	__bkpfs_close_version(vr);
+out_dir:
+	path_put(&lower_dir_path);
+out_name:
+	kfree(tmp_name);
+	kfree(bkp_name);
+	return err;
+}
+
+/*
+ * Removes the version at index idx of info from the lower file
+ * system and from info. Delta versions based on it become full
+ * versions. If reuse is set, its backup file is left in place for
+ * the next version instead, and the number in its name is stored
+ * in reuse.
+ */
+static int __bkpfs_remove_nth(struct inode *inode, struct file *lower_file,
+			      struct bkpinfo *info, long idx, u64 *reuse)
+{
+	int err = 0;
+	long i;
+	struct bkpfs_version *victim = &info->vers[idx];
+
+	for (i = idx + 1; i < info->num_bkps; i++) {
+		if (!(info->vers[i].flags & BKPV_DELTA) ||
+		    info->vers[i].base != victim->bkpno)
+			continue;
+		err = __bkpfs_rebase_version(inode, lower_file, info,
+					     &info->vers[i]);
+		if (err)
+			return err;
+	}
+	if (reuse) {
+		// Only the chunks go, the file is truncated when reused
+		if (victim->flags & BKPV_CHUNKED)
+			err = __bkpfs_put_recipe(inode, lower_file, info,
+						 victim);
+		if (!err)
+			__bkpfs_charge(inode->i_sb, -victim->stored);
+		*reuse = victim->fileno;
+	} else {
+		err = __bkpfs_remove_version(inode, lower_file, info,
+					     victim);
+	}
+	if (err)
+		return err;
+	__bkpfs_del_version(info, idx);
+	return 0;
+}
+
+/* Removes the oldest version of a file, see __bkpfs_remove_nth() */
+static int __bkpfs_remove_oldest(struct inode *inode, struct file *lower_file,
+				 struct bkpinfo *info, u64 *reuse)
+{
+	return __bkpfs_remove_nth(inode, lower_file, info, 0, reuse);
+}
+
+/*
+ * Returns the most bytes the versions of a file may take, or 0
+ * for no limit. A user.bkpfs.maxsize xattr on the file overrides
+ * -o maxsize, so "0" there lifts the limit for that file.
+ */
+static u64 __bkpfs_max_size(struct inode *inode, struct file *lower_file)
+{
+	char buf[24], *end;
+	ssize_t len;
+	u64 max;
+	struct dentry *lower_dentry = lower_file->f_path.dentry;
+
+	len = __vfs_getxattr(lower_dentry, d_inode(lower_dentry),
+			     BKPFS_MAXSIZE_XATTR, buf, sizeof(buf) - 1);
+	if (len <= 0)
+		return BKPFS_OPTS(inode->i_sb)->maxsize;
+	buf[len] = '\0';
+	max = memparse(buf, &end);
+	if (end == buf)
+		return BKPFS_OPTS(inode->i_sb)->maxsize;
+	return max;
+}
+
+/* Returns the bytes taken by all versions of a file */
+static u64 __bkpfs_stored(struct bkpinfo *info)
+{
+	u64 total = 0;
+	long i;
+
+	for (i = 0; i < info->num_bkps; i++)
+		total += info->vers[i].stored;
+	return total;
+}
+
+/*
+ * Opens the lower file of inode, another file of the mount, for
+ * -o mntmaxsize. Returns an ERR_PTR if it has no name anymore.
+ */
+static struct file *__bkpfs_open_other(struct inode *inode)
+{
+	struct dentry *dentry;
+	struct path lower_path;
+	struct file *lower_file;
+
+	dentry = d_find_alias(inode);
+	if (!dentry)
+		return ERR_PTR(-ENOENT);
+	bkpfs_get_lower_path(dentry, &lower_path);
+	lower_file = dentry_open(&lower_path, O_RDONLY | O_LARGEFILE,
+				 current_cred());
+	bkpfs_put_lower_path(dentry, &lower_path);
+	dput(dentry);
+	return lower_file;
+}
+
+/*
+ * Reads the metadata of inode, another file of the mount, back in
+ * after it was dropped from memory. Called with its meta_mutex held.
+ */
+static void __bkpfs_reload_meta_of(struct inode *inode)
+{
+	struct bkpinfo info = {};
+	struct file *lower_file;
+
+	lower_file = __bkpfs_open_other(inode);
+	if (IS_ERR(lower_file))
+		return;
+	__bkpfs_meta(inode, lower_file, BKPM_READ, &info);
+	__bkpfs_free_info(&info);
+	fput(lower_file);
+}
+
+/* How many files __bkpfs_oldest_elsewhere() reads the metadata of */
+#define BKP_EVICT_RELOAD 16
+
+/*
+ * Returns the file, other than inode, with the oldest version older
+ * than *when among the files with versions of the mount, with a
+ * reference and its meta_mutex held, and sets *when to the age of
+ * that version. The versions are those in the metadata of each file,
+ * which is read back for files that dropped it from memory. Files
+ * busy with versions of their own are passed over, as the caller
+ * holds the meta_mutex of inode already, and *busy is set if there
+ * were any.
+ */
+static struct inode *__bkpfs_oldest_elsewhere(struct inode *inode,
+					      struct timespec64 *when,
+					      int *busy)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	struct bkpfs_inode_info *ii, *best;
+	struct inode *found, *stale;
+	int reload = BKP_EVICT_RELOAD;
+
+again:
+	best = NULL;
+	found = stale = NULL;
+	*busy = 0;
+	spin_lock(&sbi->usage_lock);
+	list_for_each_entry(ii, &sbi->usage_inodes, usage_list) {
+		if (&ii->vfs_inode == inode)
+			continue;
+		if (!mutex_trylock(&ii->meta_mutex)) {
+			*busy = 1;
+			continue;
+		}
+		if (!ii->meta_valid && !stale && reload > 0)
+			stale = igrab(&ii->vfs_inode);
+		// The newest version of every file stays
+		if (ii->meta_valid && ii->meta.num_bkps > 1 &&
+		    timespec64_compare(&ii->meta.vers[0].ctime, when) < 0) {
+			*when = ii->meta.vers[0].ctime;
+			best = ii;
+		}
+		mutex_unlock(&ii->meta_mutex);
+	}
+	if (best && !stale)
+		found = igrab(&best->vfs_inode);
+	spin_unlock(&sbi->usage_lock);
+	if (stale) {
+		reload--;
+		if (mutex_trylock(&BKPFS_I(stale)->meta_mutex)) {
+			__bkpfs_reload_meta_of(stale);
+			mutex_unlock(&BKPFS_I(stale)->meta_mutex);
+		}
+		iput(stale);
+		goto again;
+	}
+	if (found && !mutex_trylock(&best->meta_mutex)) {
+		iput(found);
+		found = NULL;
+		*busy = 1;
+	}
+	return found;
+}
+
+/*
+ * Removes the oldest version of inode, another file of the mount,
+ * for -o mntmaxsize. Called with its meta_mutex held.
+ */
+static int __bkpfs_remove_oldest_of(struct inode *inode)
+{
+	int err, ret;
+	struct bkpinfo info = {};
+	struct file *lower_file;
+
+	lower_file = __bkpfs_open_other(inode);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
+
+	err = __bkpfs_meta(inode, lower_file, BKPM_READ, &info);
+	if (err)
+		goto out;
+	if (info.num_bkps < 2)
+		goto out;
+	err = __bkpfs_remove_oldest(inode, lower_file, &info, NULL);
+	ret = __bkpfs_meta(inode, lower_file, BKPM_UPDATE, &info);
+	if (!err)
+		err = ret;
+out:
+	__bkpfs_free_info(&info);
+	fput(lower_file);
+	return err;
+}
+
+/*
+ * Removes the oldest versions of the mount while they take more than
+ * -o mntmaxsize, whichever of the files in memory they belong to. A
+ * version of inode goes when none of another file is older. Versions
+ * of other files are removed with the credentials of the mounter, as
+ * they need not belong to the caller. If that fails, which is logged,
+ * or another file is busy, the trim stops there rather than taking
+ * versions of inode that are not the oldest; the next version made
+ * trims again.
+ */
+static int __bkpfs_trim_mount(struct inode *inode, struct file *lower_file,
+			      struct bkpinfo *info)
+{
+	int err, busy;
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	struct timespec64 when;
+	struct inode *other;
+	const struct cred *old_cred;
+
+	while (atomic64_read(&sbi->bkp_bytes) > sbi->opts.mntmaxsize) {
+		when.tv_sec = TIME64_MAX;
+		when.tv_nsec = 0;
+		if (info->num_bkps > 1)
+			when = info->vers[0].ctime;
+		old_cred = override_creds(sbi->usage_cred);
+		other = __bkpfs_oldest_elsewhere(inode, &when, &busy);
+		if (other) {
+			err = __bkpfs_remove_oldest_of(other);
+			mutex_unlock(&BKPFS_I(other)->meta_mutex);
+			revert_creds(old_cred);
+			iput(other);
+			if (err) {
+				pr_err("bkpfs: mntmaxsize eviction: %d\n",
+				       err);
+				break;
+			}
+			continue;
+		}
+		revert_creds(old_cred);
+		if (busy || info->num_bkps <= 1)
+			break;
+		err = __bkpfs_remove_oldest(inode, lower_file, info, NULL);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/*
+ * Removes the oldest versions of a file while they take more than
+ * its size budget, and then the oldest versions of the mount while
+ * they take more than -o mntmaxsize. Both are kept up to date as
+ * versions come and go, so nothing has to be looked up. The newest
+ * version of a file always stays.
+ */
+static int __bkpfs_trim_versions(struct inode *inode,
+				 struct file *lower_file,
+				 struct bkpinfo *info)
+{
+	int err;
+	u64 max = __bkpfs_max_size(inode, lower_file);
+
+	while (info->num_bkps > 1) {
+		if (!max || __bkpfs_stored(info) <= max)
+			break;
+		err = __bkpfs_remove_oldest(inode, lower_file, info, NULL);
+		if (err)
+			return err;
+	}
+	if (!BKPFS_OPTS(inode->i_sb)->mntmaxsize)
+		return 0;
+	return __bkpfs_trim_mount(inode, lower_file, info);
+}
+
+/*
+ * Returns the tier of -o retain for a version of the given age,
+ * or -1 if it is older than all of them.
+ */
+static int __bkpfs_retain_tier(struct bkpfs_mount_opts *opts, time64_t age)
+{
+	int i;
+
+	for (i = 0; i < opts->nretain; i++)
+		if (age <= opts->retain[i].age)
+			return i;
+	return -1;
+}
+
+/*
+ * Returns the index of the oldest version of a file that -o retain
+ * thins out, or -1 if there is none. Of the versions that fall in a
+ * tier only the oldest one of every period of its step is kept, so
+ * a version that was kept once stays until it ages into a coarser
+ * tier. Versions older than the last tier go. Ages are counted from
+ * when a version was made, which touching the file does not change.
+ * The newest keep versions are left alone.
+ */
+static long __bkpfs_thin_victim(struct bkpfs_mount_opts *opts,
+				struct bkpinfo *info, long keep)
+{
+	int tier, last_tier = -1;
+	long i;
+	time64_t now, made, step, period, last_period = 0;
+
+	if (!opts->nretain)
+		return -1;
+	now = ktime_get_real_seconds();
+	for (i = 0; i < info->num_bkps - keep; i++) {
+		made = info->vers[i].ctime.tv_sec;
+		tier = __bkpfs_retain_tier(opts, now - made);
+		if (tier < 0)
+			return i;
+		step = opts->retain[tier].step;
+		period = step ? div64_s64(made, step) : 0;
+		if (step && tier == last_tier && period == last_period)
+			return i;
+		last_tier = tier;
+		last_period = period;
+	}
+	return -1;
+}
+
+/*
+ * Thins out the versions of a file as -o retain asks for, see
+ * __bkpfs_thin_victim(). The newest version always stays.
+ */
+static int __bkpfs_thin_versions(struct inode *inode,
+				 struct file *lower_file,
+				 struct bkpinfo *info)
+{
+	int err;
+	long i;
+	struct bkpfs_mount_opts *opts = BKPFS_OPTS(inode->i_sb);
+
+	while ((i = __bkpfs_thin_victim(opts, info, 1)) >= 0) {
+		err = __bkpfs_remove_nth(inode, lower_file, info, i, NULL);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/* Helper function to remove all backups associated
+ * with the file based on the info from the metadata
+ */
+int __bkpfs_remove_all_bkps(struct inode *inode, struct file *lower_file,
+			    struct bkpinfo *info)
+{
+	int err = 0;
+	long i;
+	struct bkpfs_chunk_set held = {};
+
+	// All references of the file go at once
+	err = __bkpfs_held_chunks(inode, lower_file, info, NULL, &held);
+	if (!err)
+		err = bkpfs_put_chunk_set(inode->i_sb, &held);
+	bkpfs_chunk_set_free(&held);
+	if (err)
+		return err;
+
+	// Delete backups starting from the oldest
+	for (i = 0; i < info->num_bkps; i++) {
+		err = __bkpfs_unlink_version(inode, lower_file,
+					     &info->vers[i]);
+		if (err)
+			break;
+	}
+	return err;
+}
+
+/*
+ * Helper function for creating the backup file of version ver.
+ * A delta version only stores the ranges written since its base,
+ * a chunked one takes references to the chunks not in held.
+ */
+static int __bkpfs_create_bkp(struct inode *inode, struct file *lower_file,
+			      struct bkpfs_version *ver,
+			      struct list_head *ranges,
+			      struct bkpfs_chunk_set *held)
+{
+	int err = 0;
+	char *bkp_name;
+	struct dentry *lower_bkp_dentry, *lower_dir_dentry;
+	struct path lower_dir_path, lower_bkp_path;
+	struct file *lower_bkp_file;
+
+	// Do not create backup for an existing backup file
+	if (!__is_valid_filename(lower_file->f_path.dentry->d_name.name))
+		return 0;
+
+	// Initialize string for backup file name
+	bkp_name = __bkpfs_bkp_name(lower_file, ver->loc, BKP_EXT,
+				    ver->fileno);
+	if (!bkp_name)
+		return -ENOMEM;
+
+	err = __bkpfs_get_bkp_dir(inode, lower_file, ver->loc, 1,
+				  &lower_dir_path);
+	if (err)
+		goto out_name;
+	lower_bkp_dentry = __create_bkp_dentry(&lower_dir_path, bkp_name,
+					       &lower_bkp_path);
+	path_put(&lower_dir_path);
+	if (IS_ERR(lower_bkp_dentry)) {
+		err = PTR_ERR(lower_bkp_dentry);
 		goto out_name;
 	}
-	snprintf(ext, EXT_SIZE, "%03d", (int)info->latest_bkp + 1);
-	strncat(bkp_name, ext, EXT_SIZE);
 
-	lower_bkp_dentry = __create_bkp_dentry(file, bkp_name, &lower_bkp_path);
-	if (IS_ERR(lower_bkp_dentry)) {
-		err = PTR_ERR(lower_bkp_dentry);
+	// A file taken over by -o ring still holds the oldest version
+	err = vfs_truncate(&lower_bkp_path, 0);
+	if (err)
 		goto out;
-	}
 
 	// Copy main file contents to backup file
-	lower_bkp_file = dentry_open(&lower_bkp_path,
-				     O_WRONLY | O_CREAT | O_TRUNC,
+	lower_bkp_file = dentry_open(&lower_bkp_path, O_WRONLY,
 				     current_cred());
 
 	if (IS_ERR(lower_bkp_file)) {
@@ -841,69 +2738,65 @@ static int __bkpfs_create_bkp(struct file *file, struct bkpinfo *info)
 		goto out;
 	}
 
-	// Create a copy of the original file
-	err = __bkpfs_read_write(lower_file, lower_bkp_file);
+	// Create a copy of the original file, or of what changed in it
+	ver->stored = 0;
+	if (ver->flags & BKPV_DELTA)
+		err = __bkpfs_write_delta(lower_file, lower_bkp_file, ver,
+					  ranges);
+	else if (ver->flags & BKPV_CHUNKED)
+		err = __bkpfs_write_chunks(inode->i_sb, lower_file,
+					   lower_bkp_file, ver, held);
+	else if (ver->flags & BKPV_COMPRESSED)
+		err = __bkpfs_write_compressed(inode->i_sb, lower_file,
+					       lower_bkp_file, ver);
+	else
+		err = __bkpfs_copy_file(lower_file, lower_bkp_file);
+	ver->stored += __bkpfs_allocated(lower_bkp_file);
+	fput(lower_bkp_file);
 	if (err) {
 		//Need to remove the backup file created
-		if (!lower_bkp_dentry)
-			lower_bkp_dentry = lower_bkp_path.dentry;
-		dget(lower_bkp_dentry);
-		inode_lock(lower_dir_dentry->d_inode);
-		err = vfs_unlink(lower_dir_dentry->d_inode,
-				 lower_bkp_dentry, NULL);
-		inode_unlock(lower_dir_dentry->d_inode);
-		dput(lower_bkp_dentry);
+		lower_dir_dentry = lock_parent(lower_bkp_dentry);
+		vfs_unlink(d_inode(lower_dir_dentry), lower_bkp_dentry, NULL);
+		unlock_dir(lower_dir_dentry);
 	}
-
-	if (lower_bkp_file)
-		fput(lower_bkp_file);
 out:
 	path_put(&lower_bkp_path);
 out_name:
-	kfree(ext);
 	kfree(bkp_name);
-out_ignore:
-	path_put(&lower_parent_path);
 	return err;
 }
 
-/* Helper function for creating a temp file when a restore
+/*
+ * Helper function for creating a temp file next to the file
+ * with the contents of the version opened as vr when a restore
  * is called
  */
-static int __bkpfs_create_temp_bkp(struct file *file, int bkpno)
+static int __bkpfs_create_temp_bkp(struct file *lower_file,
+				   struct bkpfs_vreader *vr)
 {
 	int err = 0;
-	const unsigned char *file_name;
-	char *temp_name, *ext;
+	char *temp_name;
 	struct dentry *lower_bkpt_dentry;
-	struct path lower_bkpt_path;
-	struct file *lower_file;
-	struct file *lower_bkpt_file = NULL;
-	struct file *lower_bkp_file = NULL;
-
-	// Initial/essetial parameters
-	lower_file = bkpfs_lower_file(file);
-	file_name = lower_file->f_path.dentry->d_name.name;
+	struct path lower_parent_path, lower_bkpt_path;
+	struct file *lower_bkpt_file;
 
 	// Do not create backup for an existing backup file
-	if (!__is_valid_filename(file_name))
-		goto out_ignore;
+	if (!__is_valid_filename(lower_file->f_path.dentry->d_name.name))
+		return 0;
 
 	// Initialize string for backup file name
-	temp_name = kmalloc(strlen(file_name) + MAX_BKP_NAME_EXT, GFP_KERNEL);
-	if (!temp_name) {
-		err = -ENOMEM;
-		goto out_name;
-	}
-
-	__init_file_name(file_name, BKPT_EXT, temp_name);
+	temp_name = __bkpfs_bkp_name(lower_file, BKPM_LOC_FILE, BKPT_EXT, 0);
+	if (!temp_name)
+		return -ENOMEM;
 
-	lower_bkpt_dentry = __create_bkp_dentry(file,
+	__bkpfs_get_lower_parent(lower_file, &lower_parent_path);
+	lower_bkpt_dentry = __create_bkp_dentry(&lower_parent_path,
 						temp_name,
 						&lower_bkpt_path);
+	path_put(&lower_parent_path);
 	if (IS_ERR(lower_bkpt_dentry)) {
 		err = PTR_ERR(lower_bkpt_dentry);
-		goto out;
+		goto out_name;
 	}
 
 	// Copy main file contents to backup file
@@ -916,45 +2809,27 @@ static int __bkpfs_create_temp_bkp(struct file *file, int bkpno)
 		goto out;
 	}
 
-	// Fetch the backup file
-	lower_bkp_file = __bkpfs_fetch_bkp(file, bkpno);
-	if (IS_ERR(lower_bkp_file)) {
-		err = PTR_ERR(lower_bkp_file);
-		goto out_file;
-	}
-	// Create a copy of the original file
-	err = __bkpfs_read_write(lower_bkp_file, lower_bkpt_file);
-
-	if (lower_bkp_file)
-		fput(lower_bkp_file);
+	// Create a copy of the backup
+	err = __bkpfs_copy_version(vr, lower_bkpt_file, NULL);
 
-out_file:
-	if (lower_bkpt_file)
-		fput(lower_bkpt_file);
+	fput(lower_bkpt_file);
 out:
 	path_put(&lower_bkpt_path);
 out_name:
-	kfree(ext);
 	kfree(temp_name);
-out_ignore:
 	return err;
 }
 
-/* Helper function to read a backup file's contents*/
-int __bkpfs_read_bkp(struct file *file, char *buf, loff_t *pos)
+/* Helper function to read a page of a version's contents*/
+static int __bkpfs_read_bkp(struct bkpfs_vreader *vr, char *buf, loff_t *pos)
 {
-	int err = 0, len;
-	mm_segment_t old_fs;
-
-	old_fs = get_fs();
-	set_fs(get_ds());
+	ssize_t len;
 
 	memset(buf, '\0', PAGE_SIZE);
-	len = vfs_read(file, (char __user *)buf, PAGE_SIZE - 1, pos);
+	len = __bkpfs_read_version(vr, buf, PAGE_SIZE - 1, pos);
 	if (len < 0)
-		err = len;
-	set_fs(old_fs);
-	return err;
+		return len;
+	return 0;
 }
 
 static ssize_t bkpfs_read(struct file *file, char __user *buf,
@@ -987,6 +2862,7 @@ static ssize_t bkpfs_write(struct file *file, const char __user *buf,
 	if (err >= 0) {
 		// Update flag to notify a write has occurred
 		BKPFS_F(file)->is_write = 1;
+		bkpfs_mark_dirty(d_inode(dentry), *ppos - err, *ppos);
 		fsstack_copy_inode_size(d_inode(dentry),
 					file_inode(lower_file));
 		fsstack_copy_attr_times(d_inode(dentry),
@@ -1041,182 +2917,244 @@ out:
 	return err;
 }
 
+/*
+ * Describes the versions of a file in q->buf, one line per
+ * version holding its number, size, mtime and checksum (0 if
+ * unknown). The listing starts at the version with index
+ * q->offset, and q->offset is moved past the last version that
+ * fit so that long lists can be fetched in several calls.
+ */
+static void __bkpfs_list_versions(struct bkpinfo *info, query_arg_t *q)
+{
+	long i;
+	size_t len = 0;
+	int n;
+	struct bkpfs_version *ver;
+
+	memset(q->buf, '\0', sizeof(q->buf));
+	if (q->offset < 0)
+		q->offset = 0;
+	for (i = q->offset; i < info->num_bkps; i++) {
+		ver = &info->vers[i];
+		n = snprintf(q->buf + len, sizeof(q->buf) - len,
+			     "%llu %lld %lld.%09ld %016llx\n",
+			     (unsigned long long)ver->bkpno,
+			     (long long)ver->size,
+			     (long long)ver->mtime.tv_sec,
+			     ver->mtime.tv_nsec,
+			     (unsigned long long)ver->csum);
+		if (n >= sizeof(q->buf) - len) {
+			q->buf[len] = '\0';
+			break;
+		}
+		len += n;
+	}
+	q->offset = i;
+}
+
 static long bkpfs_unlocked_ioctl(struct file *file,
 				 unsigned int cmd,
 				 unsigned long arg)
 {
-	int flag = 0, oldest, newest, bkpno;
+	int flag = 0;
 	long err = 0;
-	const unsigned char *file_name;
-	char *bkp_name;
-	struct file *lower_file, *bkp_file;
-	struct bkpinfo info;
-	struct path lower_parent_path;
-	query_arg_t *q1;
+	struct file *lower_file;
+	struct inode *inode = file_inode(file);
+	struct bkpinfo info = {};
+	struct bkpfs_version *ver;
+	struct bkpfs_vreader *vr;
+	struct bkpfs_file_info *fi = BKPFS_F(file);
+	const struct cred *old_cred;
+	query_arg_t *q1 = NULL;
 
 	lower_file = bkpfs_lower_file(file);
-	file_name = lower_file->f_path.dentry->d_name.name;
-	bkpfs_get_lower_path(file->f_path.dentry->d_parent, &lower_parent_path);
 
-	bkp_name = kmalloc(strlen(file_name) + MAX_BKP_NAME_EXT, GFP_KERNEL);
-	if (!bkp_name) {
-		err = -ENOMEM;
-		goto out;
-	}
 	q1 = kmalloc(sizeof(query_arg_t), GFP_KERNEL);
 	if (!q1) {
 		err = -ENOMEM;
 		goto out;
 	}
+	mutex_lock(&BKPFS_I(inode)->meta_mutex);
+	old_cred = bkpfs_store_creds(inode->i_sb);
 	switch (cmd) {
 	case QUERY_LIST_VER:
 		if (!access_ok(VERIFY_WRITE,
 			       arg, sizeof(query_arg_t))) {
 			err = -EFAULT;
-			goto out;
+			goto out_unlock;
+		}
+		if (copy_from_user(q1,
+				   (query_arg_t *)arg,
+				   sizeof(query_arg_t))) {
+			err = -EACCES;
+			goto out_unlock;
 		}
 
 		// Read metadata file
 		flag |= BKPM_READ;
-		err = __bkpfs_meta(file, flag, &info);
+		err = __bkpfs_meta(inode, lower_file, flag, &info);
 		if (err)
-			goto out;
+			goto out_unlock;
 
+		// The counts of query_arg_t are ints, do not wrap them
+		if (info.num_bkps > INT_MAX || info.latest_bkp > INT_MAX) {
+			err = -EOVERFLOW;
+			goto out_unlock;
+		}
 		q1->num_bkps = (int)info.num_bkps;
 		q1->latest_bkp = (int)info.latest_bkp;
+		__bkpfs_list_versions(&info, q1);
 
 		if (copy_to_user((query_arg_t *)arg,
 				 q1, sizeof(query_arg_t))) {
 			err = -EACCES;
-			goto out;
+			goto out_unlock;
 		}
-		goto out;
+		goto out_unlock;
 
 	case QUERY_DELETE_VER:
 		if (!access_ok(VERIFY_READ, arg, sizeof(query_arg_t))) {
 			err = -EFAULT;
-			goto out;
+			goto out_unlock;
 		}
 		if (copy_from_user(q1,
 				   (query_arg_t *)arg,
 				   sizeof(query_arg_t))) {
 			err = -EACCES;
-			goto out;
+			goto out_unlock;
 		}
 
 		// Read metadata file
 		flag |= BKPM_READ;
-		err = __bkpfs_meta(file, flag, &info);
+		err = __bkpfs_meta(inode, lower_file, flag, &info);
 		if (err)
-			goto out;
+			goto out_unlock;
 
 		if (info.num_bkps == 0)
-			goto out;
+			goto out_unlock;
 		if (q1->delete_ver & DEL_LATEST) {
-			err = __find_latest_bkp(file_name, &info, bkp_name);
-			err = __remove_bkp(lower_parent_path, bkp_name);
-
-			// Update the metadata file
-			flag = 0; //Reset
-			flag |= BKPM_UPDATE_DEL_LATEST;
-			err = __bkpfs_meta(file, flag, &info);
+			err = __bkpfs_remove_version(inode, lower_file, &info,
+					&info.vers[info.num_bkps - 1]);
+			__bkpfs_del_latest(&info);
 		} else if (q1->delete_ver & DEL_OLDEST) {
-			err = __find_oldest_bkp(file_name, &info, bkp_name);
-			err = __remove_bkp(lower_parent_path, bkp_name);
-
-			// Update the metadata file
-			flag = 0; //Reset
-			flag |= BKPM_UPDATE_DEL_OLDEST;
-			err = __bkpfs_meta(file, flag, &info);
+			err = __bkpfs_remove_oldest(inode, lower_file, &info,
+						    NULL);
 		} else if (q1->delete_ver & DEL_ALL) {
-			err = __bkpfs_remove_all_bkps(file, &info);
-
-			// Update the metadata file
-			flag = 0; //Reset
-			flag |= BKPM_UPDATE_DEL_ALL;
-			err = __bkpfs_meta(file, flag, &info);
+			err = __bkpfs_remove_all_bkps(inode, lower_file, &info);
+			info.num_bkps = 0;
 		} else {
 			pr_info("Invalid delete option\n");
+			goto out_unlock;
 		}
 
-		goto out;
+		// Update the metadata file
+		flag = 0; //Reset
+		flag |= BKPM_UPDATE;
+		err = __bkpfs_meta(inode, lower_file, flag, &info);
+		goto out_unlock;
 
 	case QUERY_VIEW_VER:
 		if (!access_ok(VERIFY_WRITE, arg, sizeof(query_arg_t))) {
 			err = -EFAULT;
-			goto out;
+			goto out_unlock;
 		}
 		if (copy_from_user(q1,
 				   (query_arg_t *)arg,
 				   sizeof(query_arg_t))) {
 			err = -EACCES;
-			goto out;
+			goto out_unlock;
 		}
 
 		// Read metadata file
 		flag |= BKPM_READ;
-		err = __bkpfs_meta(file, flag, &info);
+		err = __bkpfs_meta(inode, lower_file, flag, &info);
 		if (err)
-			goto out;
+			goto out_unlock;
 		if (info.num_bkps == 0)
-			goto out;
+			goto out_unlock;
 		if (q1->version == VIEW_NEW)
-			bkpno = (int)info.latest_bkp;
+			ver = &info.vers[info.num_bkps - 1];
 		else if (q1->version == VIEW_OLD)
-			bkpno = (int)(info.latest_bkp - info.num_bkps + 1);
+			ver = &info.vers[0];
 		else
-			bkpno = q1->version;
-		bkp_file = __bkpfs_fetch_bkp(file, bkpno);
-		if (IS_ERR(bkp_file)) {
-			err = PTR_ERR(bkp_file);
-			goto out;
+			ver = __bkpfs_find_version(&info, q1->version);
+		if (!ver) {
+			err = -EINVAL;
+			goto out_unlock;
+		}
+		/*
+		 * bkpctl views a version a page per call, so the version
+		 * stays open until another one is viewed or the file is
+		 * closed. Numbers are not reused, and a version only
+		 * changes how it is stored when a delta is rebased.
+		 */
+		if (!fi->view_vr || fi->view_bkpno != ver->bkpno ||
+		    fi->view_flags != ver->flags) {
+			vr = __bkpfs_open_version(inode, lower_file, &info,
+						  ver);
+			if (IS_ERR(vr)) {
+				err = PTR_ERR(vr);
+				goto out_unlock;
+			}
+			if (fi->view_vr)
+				__bkpfs_close_version(fi->view_vr);
+			fi->view_vr = vr;
+			fi->view_bkpno = ver->bkpno;
+			fi->view_flags = ver->flags;
 		}
-		err = __bkpfs_read_bkp(bkp_file, q1->buf, &q1->offset);
+		err = __bkpfs_read_bkp(fi->view_vr, q1->buf, &q1->offset);
 		if (err)
-			goto out;
+			goto out_unlock;
 		if (copy_to_user((query_arg_t *)arg,
 				 q1, sizeof(query_arg_t))) {
 			err = -EACCES;
-			goto out;
+			goto out_unlock;
 		}
-		if (bkp_file)
-			fput(bkp_file);
 
-		goto out;
+		goto out_unlock;
 
 	case QUERY_RESTORE_VER:
 		if (!access_ok(VERIFY_READ, arg, sizeof(query_arg_t))) {
 			err = -EFAULT;
-			goto out;
+			goto out_unlock;
 		}
 		if (copy_from_user(q1,
 				   (query_arg_t *)arg,
 				   sizeof(query_arg_t))) {
 			err = -EACCES;
-			goto out;
+			goto out_unlock;
 		}
 
 		flag |= BKPM_READ;
-		err = __bkpfs_meta(file, flag, &info);
+		err = __bkpfs_meta(inode, lower_file, flag, &info);
 		if (err)
-			goto out;
-
-		oldest = (int)info.latest_bkp - (int)info.num_bkps + 1;
-		newest = (int)info.latest_bkp;
+			goto out_unlock;
 
 		if (info.num_bkps == 0)
-			goto out;
+			goto out_unlock;
 		if (q1->version == RESTORE_NEW)
-			err = __bkpfs_create_temp_bkp(file, newest);
+			ver = &info.vers[info.num_bkps - 1];
 		else if (q1->version == RESTORE_OLD)
-			err = __bkpfs_create_temp_bkp(file, oldest);
+			ver = &info.vers[0];
 		else
-			if (q1->version <= newest && q1->version >= oldest)
-				err = __bkpfs_create_temp_bkp(file,
-							      q1->version);
+			ver = __bkpfs_find_version(&info, q1->version);
+		if (!ver)
+			goto out_unlock;
+		vr = __bkpfs_open_version(inode, lower_file, &info, ver);
+		if (IS_ERR(vr)) {
+			err = PTR_ERR(vr);
+			goto out_unlock;
+		}
+		// The restored copy belongs to the caller, not to the store
+		bkpfs_revert_store_creds(old_cred);
+		old_cred = NULL;
+		err = __bkpfs_create_temp_bkp(lower_file, vr);
+		__bkpfs_close_version(vr);
 
-		goto out;
+		goto out_unlock;
 	}
+	bkpfs_revert_store_creds(old_cred);
+	mutex_unlock(&BKPFS_I(inode)->meta_mutex);
 
 	err = -ENOTTY;
 	/* XXX: use vfs_ioctl if/when VFS exports it */
@@ -1229,13 +3167,13 @@ static long bkpfs_unlocked_ioctl(struct file *file,
 	if (!err)
 		fsstack_copy_attr_all(file_inode(file),
 				      file_inode(lower_file));
-	goto out_ioctl;
+	goto out;
+out_unlock:
+	bkpfs_revert_store_creds(old_cred);
+	mutex_unlock(&BKPFS_I(inode)->meta_mutex);
 out:
+	__bkpfs_free_info(&info);
 	kfree(q1);
-	kfree(bkp_name);
-	path_put(&lower_parent_path);
-
-out_ioctl:
 	return err;
 }
 
@@ -1259,6 +3197,37 @@ out:
 }
 #endif
 
+/*
+ * Mappings that can never write to the file are handed to the lower
+ * file system as they are: the VMA gets the lower file, so faults,
+ * fault-around and huge pages work as they do there and bkpfs is not
+ * involved in them at all. Shared writable mappings keep going through
+ * bkpfs_vm_ops, whose ->page_mkwrite tracks the writes for versioning
+ * and whose upper file defers the backup until the mapping is gone.
+ */
+static int __bkpfs_mmap_lower(struct file *file, struct vm_area_struct *vma)
+{
+	int err;
+	struct file *lower_file = bkpfs_lower_file(file);
+
+	if (!lower_file->f_op->mmap)
+		return -ENODEV;
+	if (WARN_ON(file != vma->vm_file))
+		return -EIO;
+
+	vma->vm_file = get_file(lower_file);
+	err = call_mmap(vma->vm_file, vma);
+	if (err) {
+		/* drop the reference of the new vm_file */
+		fput(lower_file);
+	} else {
+		/* drop the reference of the old vm_file */
+		fput(file);
+	}
+	file_accessed(file);
+	return err;
+}
+
 static int bkpfs_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	int err = 0;
@@ -1266,6 +3235,9 @@ static int bkpfs_mmap(struct file *file, struct vm_area_struct *vma)
 	struct file *lower_file;
 	const struct vm_operations_struct *saved_vm_ops = NULL;
 
+	if (!(vma->vm_flags & VM_SHARED) || !(vma->vm_flags & VM_MAYWRITE))
+		return __bkpfs_mmap_lower(file, vma);
+
 	/* this might be deferred to mmap's writepage */
 	willwrite = ((vma->vm_flags | VM_SHARED | VM_WRITE) == vma->vm_flags);
 
@@ -1318,12 +3290,9 @@ out:
 
 static int bkpfs_open(struct inode *inode, struct file *file)
 {
-	int err = 0, flag;
-	const unsigned char *file_name;
+	int err = 0;
 	struct file *lower_file = NULL;
 	struct path lower_path;
-	struct inode *lower_inode;
-	struct bkpinfo info;
 
 	/* don't open unhashed/deleted files */
 	if (d_unhashed(file->f_path.dentry)) {
@@ -1339,33 +3308,27 @@ static int bkpfs_open(struct inode *inode, struct file *file)
 	}
 
 	/* open lower object and link bkpfs's file struct to lower's */
-	bkpfs_get_lower_path(file->f_path.dentry, &lower_path);
+	bkpfs_peek_lower_path(file->f_path.dentry, &lower_path);
 	lower_file = dentry_open(&lower_path, file->f_flags, current_cred());
-	path_put(&lower_path);
+	/*
+	 * The backup metadata is not touched here, it is only read
+	 * once a version is made or asked for.
+	 */
 	if (IS_ERR(lower_file)) {
 		err = PTR_ERR(lower_file);
+		lower_file = bkpfs_lower_file(file);
+		if (lower_file) {
+			bkpfs_set_lower_file(file, NULL);
+			fput(lower_file); /* fput calls dput for lower_dentry */
+		}
 	} else {
 		bkpfs_set_lower_file(file, lower_file);
-		lower_inode = bkpfs_lower_inode(inode);
-		file_name = lower_file->f_path.dentry->d_name.name;
-
-		// Check for regular file and valid file name
-		if (S_ISREG(lower_inode->i_mode) &&
-		    __is_valid_filename(file_name)) {
-			flag |= BKPM_CREATE;
-			flag |= BKPM_READ;
-			err = __bkpfs_meta(file, flag, &info);
+		if (file->f_mode & FMODE_WRITE) {
+			atomic_inc(&BKPFS_I(inode)->writers);
+			BKPFS_F(file)->is_writer = 1;
 		}
-		if (!err)
-			goto out;
-	}
-	lower_file = bkpfs_lower_file(file);
-	if (lower_file) {
-		bkpfs_set_lower_file(file, NULL);
-		fput(lower_file); /* fput calls dput for lower_dentry */
 	}
 
-out:
 	if (err)
 		kfree(BKPFS_F(file));
 	else
@@ -1388,102 +3351,345 @@ static int bkpfs_flush(struct file *file, fl_owner_t id)
 	return err;
 }
 
-/* release all lower object references & free the file info structure */
-static int bkpfs_file_release(struct inode *inode, struct file *file)
+
+/*
+ * Describes the current contents of lower_file as a version
+ * for the metadata table. Everything but the backup number and
+ * the checksum is filled in.
+ */
+static void __bkpfs_init_version(struct inode *inode,
+				 struct file *lower_file,
+				 struct bkpfs_version *ver)
 {
-	struct file *lower_file;
-	int flag = 0, err = 0, i;
-	long temp_count;
-	struct bkpinfo info;
-	const unsigned char *file_name;
-	char *bkp_name;
-	struct path lower_parent_path;
+	struct inode *lower_inode = file_inode(lower_file);
 
-	pr_info("file_release entered\n");
-	lower_file = bkpfs_lower_file(file);
+	memset(ver, 0, sizeof(*ver));
+	ver->size = i_size_read(lower_inode);
+	ver->mtime = lower_inode->i_mtime;
+	ktime_get_real_ts64(&ver->ctime);
+	ver->loc = __bkpfs_bkp_loc(inode);
+}
+
+/*
+ * Checks if the file behind lower_file still has the same
+ * contents as its newest backup, in which case another version
+ * would only be a duplicate. ver describes the current contents
+ * and ranges the bytes written since version base. Only those
+ * ranges are read back and compared with the backup, so the
+ * check costs as much as what was written and not the size of
+ * the file. If they are not known, the file counts as changed
+ * unless its mtime is the one of the newest version.
+ * Returns 1 if the file is unchanged.
+ */
+static int __bkpfs_same_as_latest(struct inode *inode,
+				  struct file *lower_file,
+				  struct bkpinfo *info,
+				  struct bkpfs_version *ver, u64 base,
+				  struct list_head *ranges)
+{
+	int ret = 0;
+	char *buf, *bkp_buf;
+	loff_t pos, bkp_pos, end;
+	ssize_t len, bkp_len;
+	struct bkpfs_vreader *vr;
+	struct bkpfs_version *latest;
+	struct bkpfs_extent *ext;
+
+	if (info->num_bkps <= 0)
+		return 0;
+	latest = &info->vers[info->num_bkps - 1];
+	if (latest->size != ver->size)
+		return 0;
+	if (!base || base != latest->bkpno)
+		return timespec64_equal(&latest->mtime, &ver->mtime);
+	if (list_empty(ranges))
+		return 1;
 
-	// Need to be able to read file to create a backup
-	lower_file->f_mode |= (FMODE_READ | FMODE_CAN_READ);
-	lower_file->f_mode &= ~FMODE_WRITE;
+	vr = __bkpfs_open_version(inode, lower_file, info, latest);
+	if (IS_ERR(vr))
+		return 0;
 
-	// Check if metadata file exists, if not create one
-	file_name = lower_file->f_path.dentry->d_name.name;
-	bkpfs_get_lower_path(file->f_path.dentry->d_parent, &lower_parent_path);
+	buf = kvmalloc(BKP_CMP_CHUNK, GFP_KERNEL);
+	bkp_buf = kvmalloc(BKP_CMP_CHUNK, GFP_KERNEL);
+	if (!buf || !bkp_buf)
+		goto out_buf;
 
-	// Initialize string for backup file name
-	bkp_name = kmalloc(strlen(file_name) + MAX_BKP_NAME_EXT, GFP_KERNEL);
-	if (!bkp_name) {
-		err = -ENOMEM;
+	list_for_each_entry(ext, ranges, list) {
+		end = min_t(loff_t, ext->end, ver->size);
+		for (pos = ext->start; pos < end; ) {
+			bkp_pos = pos;
+			len = kernel_read(lower_file, buf,
+					  min_t(loff_t, end - pos,
+						BKP_CMP_CHUNK), &pos);
+			if (len <= 0)
+				goto out_buf;
+			bkp_len = __bkpfs_read_version(vr, bkp_buf, len,
+						       &bkp_pos);
+			if (len != bkp_len || memcmp(buf, bkp_buf, len))
+				goto out_buf;
+		}
+	}
+	ret = 1;
+out_buf:
+	kvfree(bkp_buf);
+	kvfree(buf);
+	__bkpfs_close_version(vr);
+	return ret;
+}
+
+/*
+ * Creates a new version of the file behind lower_file, removing
+ * the oldest backups once -o maxver is reached or they take more
+ * than -o maxsize or -o mntmaxsize allow, and thinning out older
+ * ones as -o retain asks for. Only the lower
+ * file and the upper inode are used, so this can also run from
+ * the backup workqueue after the upper file has been released
+ * as long as the caller holds a reference on the inode.
+ * With -o delta=N the new version only stores the ranges written
+ * since the newest one, as long as those are known and the chain
+ * of deltas stays shorter than N.
+ */
+int bkpfs_backup_file(struct inode *inode, struct file *lower_file)
+{
+	int flag = 0, err = 0, dirty = 0, delta = 0, mapped = 0, ret;
+	long num, idx;
+	u64 base, base_no = 0, fileno = 0;
+	struct bkpinfo info = {};
+	struct bkpfs_version ver, *latest = NULL;
+	struct bkpfs_inode_info *ii = BKPFS_I(inode);
+	struct bkpfs_mount_opts *opts = BKPFS_OPTS(inode->i_sb);
+	struct bkpfs_chunk_set held = {};
+	const struct cred *old_cred;
+	LIST_HEAD(ranges);
+
+	mutex_lock(&ii->meta_mutex);
+	old_cred = bkpfs_store_creds(inode->i_sb);
+
+	// The versions of a removed file went with its last link
+	if (!file_inode(lower_file)->i_nlink)
 		goto out;
+
+	/*
+	 * Stores through a shared mapping are not seen until the page
+	 * is written to, so while one exists the ranges are not trusted.
+	 */
+	base = bkpfs_take_dirty(inode, &ranges);
+	if (mapping_writably_mapped(inode->i_mapping)) {
+		mapped = 1;
+		base = 0;
 	}
 
-	if (BKPFS_F(file)->is_write && __is_valid_filename(file_name)) {
-		flag |=  BKPM_CREATE; // Create
-		flag |= BKPM_READ; // Read
-		err = __bkpfs_meta(file, flag, &info);
+	// Read the metadata, it is created along with the first backup
+	flag |= BKPM_READ; // Read
+	err = __bkpfs_meta(inode, lower_file, flag, &info);
+	if (err)
+		goto out;
 
-		if (err)
-			goto out;
+	if (info.num_bkps > 0)
+		latest = &info.vers[info.num_bkps - 1];
+	// Nothing was written since the newest version
+	if (base && latest && latest->bkpno == base && list_empty(&ranges) &&
+	    latest->size == i_size_read(file_inode(lower_file)))
+		goto out;
 
-		// Reset if latest_bkp reaches MAX_BACKUPS
-		if (info.latest_bkp >= MAX_BACKUPS) {
-			err = __reset_all_bkps(file, &info);
-			if (err)
-				goto out;
+	// Describe the new version
+	__bkpfs_init_version(inode, lower_file, &ver);
 
-			// Update metafile
-			flag = 0; // flag reset
-			flag |= BKPM_UPDATE; // update
-			err = __bkpfs_meta(file, flag, &info);
-			if (err)
-				goto out;
-		}
-		pr_info("maxbkpver= %ld\n", maxbkpver);
-		// When number of backups exceeds max, we delete the oldest one
-		if (info.num_bkps >= maxbkpver) {
-			pr_info("num_bkp greater than maxbkpver\n");
-			temp_count = info.num_bkps;
-			for (i = 0; i <= (temp_count - maxbkpver); i++) {
-				err = __find_oldest_bkp(file_name,
-							&info, bkp_name);
-				err = __remove_bkp(lower_parent_path, bkp_name);
-				if (err)
-					break;
-				info.num_bkps -= 1;
-			}
-			path_put(&lower_parent_path);
-			if (err) {
-				pr_info("error in loop\n");
-				goto out;
-			}
-			pr_info("after loop, info is %ld, %ld\n",
-				info.num_bkps, info.latest_bkp);
-		}
-		// Create a backup before releasing file
-		err = __bkpfs_create_bkp(file, &info);
+	/*
+	 * With -o dedup, writes that left the contents as they were
+	 * need no new version, be it a full one or a delta
+	 */
+	if (opts->dedup &&
+	    __bkpfs_same_as_latest(inode, lower_file, &info, &ver,
+				   base, &ranges))
+		goto out;
+
+	if (base && latest && latest->bkpno == base) {
+		delta = opts->delta && opts->maxver > 1 &&
+			__bkpfs_chain_len(&info, latest) + 1 < opts->delta;
+		base_no = latest->bkpno;
+	}
+	if (delta) {
+		ver.flags |= BKPV_DELTA;
+		ver.base = base_no;
+	} else if (bkpfs_has_chunks(inode->i_sb) &&
+		   ver.size / BKPFS_CHUNK_MIN < BKPR_MAX_CHUNKS) {
+		ver.flags |= BKPV_CHUNKED;
+	} else if (opts->compress) {
+		ver.flags |= BKPV_COMPRESSED;
+	}
+
+	// Thin out first, so that -o maxver only takes what is left
+	num = info.num_bkps;
+	err = __bkpfs_thin_versions(inode, lower_file, &info);
+	if (info.num_bkps != num)
+		dirty = 1;
+	if (err)
+		goto out_update;
+
+	/*
+	 * When number of backups exceeds max, we delete the oldest one,
+	 * or the oldest one -o retain would thin out once versions age.
+	 * With -o ring the backup file of the victim is taken over
+	 * by the new version, which saves an unlink and a create.
+	 */
+	while (info.num_bkps >= opts->maxver) {
+		idx = __bkpfs_thin_victim(opts, &info, 1);
+		if (idx < 0)
+			idx = 0;
+		if (opts->ring && !fileno && info.vers[idx].loc == ver.loc)
+			err = __bkpfs_remove_nth(inode, lower_file, &info,
+						 idx, &fileno);
+		else
+			err = __bkpfs_remove_nth(inode, lower_file, &info,
+						 idx, NULL);
 		if (err)
-			goto out;
+			goto out_update;
+		dirty = 1;
+	}
+	// Create a backup of the file
+	ver.bkpno = info.latest_bkp + 1;
+	ver.fileno = fileno ? fileno : ver.bkpno;
+	if (ver.flags & BKPV_CHUNKED)
+		err = __bkpfs_held_chunks(inode, lower_file, &info, NULL,
+					  &held);
+	if (!err)
+		err = __bkpfs_create_bkp(inode, lower_file, &ver, &ranges,
+					 &held);
+	bkpfs_chunk_set_free(&held);
+	if (err)
+		goto out_update;
+	err = __bkpfs_add_version(&info, &ver);
+	if (err)
+		goto out_update;
+	dirty = 1;
+	__bkpfs_charge(inode->i_sb, ver.stored);
+
+	// Older versions make way for the new one
+	err = __bkpfs_thin_versions(inode, lower_file, &info);
+	if (!err)
+		err = __bkpfs_trim_versions(inode, lower_file, &info);
 
-		// Update metafile
+out_update:
+	// Update metafile, also after a failure so it matches the backups
+	if (dirty) {
 		flag = 0; // flag reset
 		flag |= BKPM_UPDATE; // update
-		err = __bkpfs_meta(file, flag, &info);
+		ret = __bkpfs_meta(inode, lower_file, flag, &info);
+		if (!err)
+			err = ret;
+	}
+out:
+	// Later writes are relative to the newest version from now on
+	if (!err && !mapped)
+		bkpfs_set_dirty_base(inode, info.num_bkps > 0 ?
+				     info.vers[info.num_bkps - 1].bkpno : 0);
+	else
+		bkpfs_forget_dirty(inode);
+	bkpfs_free_dirty(&ranges);
+	bkpfs_revert_store_creds(old_cred);
+	mutex_unlock(&ii->meta_mutex);
+	__bkpfs_free_info(&info);
+	return err;
+}
 
-		if (err)
-			goto out;
+/*
+ * Removes all versions of the file behind lower_file along with its
+ * metadata and store directory. Called by ->unlink and ->rename once
+ * the last link to the file is gone, as nothing can reach them after
+ * that. The versions go through the reaper with -o reap like any
+ * other removed version, and no longer count against -o mntmaxsize.
+ */
+void bkpfs_remove_backups(struct inode *inode, struct file *lower_file)
+{
+	int err;
+	struct bkpinfo info = {};
+	struct bkpfs_inode_info *ii = BKPFS_I(inode);
+	const struct cred *old_cred;
+
+	if (!__is_valid_filename(lower_file->f_path.dentry->d_name.name))
+		return;
+
+	mutex_lock(&ii->meta_mutex);
+	old_cred = bkpfs_store_creds(inode->i_sb);
+	err = __bkpfs_meta(inode, lower_file, BKPM_READ, &info);
+	// A file without metadata never had a version
+	if (err || !info.latest_bkp)
+		goto out;
+	err = __bkpfs_remove_all_bkps(inode, lower_file, &info);
+	if (err)
+		goto out;
+	if (!BKPFS_OPTS(inode->i_sb)->metaxattr)
+		__bkpfs_remove_meta_file(inode, lower_file,
+					 __bkpfs_bkp_loc(inode));
+	err = bkpfs_remove_store_dir(inode->i_sb, file_inode(lower_file));
+out:
+	bkpfs_revert_store_creds(old_cred);
+	mutex_unlock(&ii->meta_mutex);
+	__bkpfs_free_info(&info);
+	bkpfs_invalidate_meta(inode);
+	if (err)
+		pr_err("bkpfs: cannot remove the backups of %pD: %d\n",
+		       lower_file, err);
+}
+
+/* release all lower object references & free the file info structure */
+static int bkpfs_file_release(struct inode *inode, struct file *file)
+{
+	struct file *lower_file, *bkp_file;
+	struct bkpfs_inode_info *ii = BKPFS_I(inode);
+	int err = 0, is_write;
+	const unsigned char *file_name;
+
+	lower_file = bkpfs_lower_file(file);
+	if (!lower_file)
+		goto out;
 
-		// Reset the flag
-		BKPFS_F(file)->is_write = 0;
+	/*
+	 * While other writers still have the file open, a version would
+	 * be outdated by their writes, so only the last writer to close
+	 * makes one, also for the writes of those that closed before it.
+	 */
+	is_write = BKPFS_F(file)->is_write;
+	if (BKPFS_F(file)->is_writer) {
+		if (is_write)
+			atomic_set(&ii->bkp_wanted, 1);
+		is_write = 0;
+		if (atomic_dec_and_test(&ii->writers))
+			is_write = atomic_xchg(&ii->bkp_wanted, 0);
 	}
 
-	// File release code
-	if (lower_file) {
-		bkpfs_set_lower_file(file, NULL);
-		fput(lower_file);
+	/*
+	 * The backup is read from a lower file of its own, as the one of
+	 * this file may have been opened write-only.  In async and debounce
+	 * mode the workqueue takes its own reference on it, so close()
+	 * does not wait for the copy.
+	 */
+	file_name = lower_file->f_path.dentry->d_name.name;
+	if (is_write && __is_valid_filename(file_name)) {
+		bkp_file = dentry_open(&lower_file->f_path,
+				       O_RDONLY | O_LARGEFILE, current_cred());
+		if (IS_ERR(bkp_file)) {
+			err = PTR_ERR(bkp_file);
+			goto out_fput;
+		}
+		if (BKPFS_OPTS(inode->i_sb)->debounce)
+			bkpfs_debounce_backup(inode, bkp_file);
+		else if (BKPFS_OPTS(inode->i_sb)->async)
+			err = bkpfs_queue_backup(inode, bkp_file);
+		else
+			err = bkpfs_backup_file(inode, bkp_file);
+		fput(bkp_file);
 	}
+
+out_fput:
+	// File release code
+	bkpfs_set_lower_file(file, NULL);
+	fput(lower_file);
 out:
+	if (BKPFS_F(file)->view_vr)
+		__bkpfs_close_version(BKPFS_F(file)->view_vr);
 	kfree(BKPFS_F(file));
-	kfree(bkp_name);
 	return err;
 }
 
@@ -1492,16 +3698,12 @@ static int bkpfs_fsync(struct file *file, loff_t start, loff_t end,
 {
 	int err;
 	struct file *lower_file;
-	struct path lower_path;
-	struct dentry *dentry = file->f_path.dentry;
 
 	err = __generic_file_fsync(file, start, end, datasync);
 	if (err)
 		goto out;
 	lower_file = bkpfs_lower_file(file);
-	bkpfs_get_lower_path(dentry, &lower_path);
 	err = vfs_fsync_range(lower_file, start, end, datasync);
-	bkpfs_put_lower_path(dentry, &lower_path);
 out:
 	return err;
 }
@@ -1590,6 +3792,13 @@ bkpfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 	fput(lower_file);
 	/* update upper inode times/sizes as needed */
 	if (err >= 0 || err == -EIOCBQUEUED) {
+		BKPFS_F(file)->is_write = 1;
+		/* the range of a queued write is not known until it is done */
+		if (err == -EIOCBQUEUED)
+			bkpfs_forget_dirty(file_inode(file));
+		else
+			bkpfs_mark_dirty(file_inode(file),
+					 iocb->ki_pos - err, iocb->ki_pos);
 		fsstack_copy_inode_size(d_inode(file->f_path.dentry),
 					file_inode(lower_file));
 		fsstack_copy_attr_times(d_inode(file->f_path.dentry),
@@ -1599,6 +3808,57 @@ out:
 	return err;
 }
 
+/*
+ * Splicing goes straight to the lower file, so sendfile() hands the
+ * pages of the lower page cache to the pipe without copying them.
+ */
+static ssize_t bkpfs_splice_read(struct file *file, loff_t *ppos,
+				 struct pipe_inode_info *pipe, size_t len,
+				 unsigned int flags)
+{
+	ssize_t err;
+	struct file *lower_file;
+
+	lower_file = bkpfs_lower_file(file);
+	if (!lower_file->f_op->splice_read)
+		return generic_file_splice_read(file, ppos, pipe, len, flags);
+
+	err = lower_file->f_op->splice_read(lower_file, ppos, pipe, len,
+					    flags);
+	/* update upper inode atime as needed */
+	if (err >= 0)
+		fsstack_copy_attr_atime(d_inode(file->f_path.dentry),
+					file_inode(lower_file));
+	return err;
+}
+
+static ssize_t bkpfs_splice_write(struct pipe_inode_info *pipe,
+				  struct file *file, loff_t *ppos,
+				  size_t len, unsigned int flags)
+{
+	ssize_t err;
+	struct file *lower_file;
+
+	lower_file = bkpfs_lower_file(file);
+	if (!lower_file->f_op->splice_write)
+		return iter_file_splice_write(pipe, file, ppos, len, flags);
+
+	file_start_write(lower_file);
+	err = lower_file->f_op->splice_write(pipe, lower_file, ppos, len,
+					     flags);
+	file_end_write(lower_file);
+	/* the file was written to, as with bkpfs_write_iter */
+	if (err > 0) {
+		BKPFS_F(file)->is_write = 1;
+		bkpfs_mark_dirty(file_inode(file), *ppos - err, *ppos);
+		fsstack_copy_inode_size(d_inode(file->f_path.dentry),
+					file_inode(lower_file));
+		fsstack_copy_attr_times(d_inode(file->f_path.dentry),
+					file_inode(lower_file));
+	}
+	return err;
+}
+
 const struct file_operations bkpfs_main_fops = {
 	.llseek		= generic_file_llseek,
 	.read		= bkpfs_read,
@@ -1615,6 +3875,8 @@ const struct file_operations bkpfs_main_fops = {
 	.fasync		= bkpfs_fasync,
 	.read_iter	= bkpfs_read_iter,
 	.write_iter	= bkpfs_write_iter,
+	.splice_read	= bkpfs_splice_read,
+	.splice_write	= bkpfs_splice_write,
 };
 
 /* trimmed directory options */
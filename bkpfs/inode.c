@@ -19,14 +19,10 @@ static int bkpfs_create(struct inode *dir, struct dentry *dentry,
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
 
-	printk("bkpfs_create entered\n");
-	if (!dentry)
-		printk("create dentry is null\n");
 	bkpfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	lower_parent_dentry = lock_parent(lower_dentry);
-	
-	printk("create dentry name is %s", lower_dentry->d_name.name);
+
 	err = vfs_create(d_inode(lower_parent_dentry), lower_dentry, mode,
 			 want_excl);
 	if (err)
@@ -53,7 +49,6 @@ static int bkpfs_link(struct dentry *old_dentry, struct inode *dir,
 	int err;
 	struct path lower_old_path, lower_new_path;
 
-	printk("bkpfs_link entered \n");
 	file_size_save = i_size_read(d_inode(old_dentry));
 	bkpfs_get_lower_path(old_dentry, &lower_old_path);
 	bkpfs_get_lower_path(new_dentry, &lower_new_path);
@@ -81,6 +76,38 @@ out:
 	return err;
 }
 
+/*
+ * Opens the lower file at lower_path if removing that name is about
+ * to drop the last link to a regular file, so that its versions can
+ * be found once the name is gone, see __bkpfs_put_last_link().
+ */
+static struct file *__bkpfs_open_last_link(struct path *lower_path)
+{
+	struct inode *lower_inode = d_inode(lower_path->dentry);
+	struct file *lower_file;
+
+	if (!lower_inode || !S_ISREG(lower_inode->i_mode) ||
+	    lower_inode->i_nlink != 1)
+		return NULL;
+	lower_file = dentry_open(lower_path, O_RDONLY | O_LARGEFILE,
+				 current_cred());
+	return IS_ERR(lower_file) ? NULL : lower_file;
+}
+
+/*
+ * Drops the file __bkpfs_open_last_link() opened, first removing the
+ * versions of inode if the name was removed and was its last link.
+ */
+static void __bkpfs_put_last_link(struct inode *inode,
+				  struct file *lower_file, int removed)
+{
+	if (!lower_file)
+		return;
+	if (removed && !file_inode(lower_file)->i_nlink)
+		bkpfs_remove_backups(inode, lower_file);
+	fput(lower_file);
+}
+
 static int bkpfs_unlink(struct inode *dir, struct dentry *dentry)
 {
 	int err;
@@ -88,10 +115,11 @@ static int bkpfs_unlink(struct inode *dir, struct dentry *dentry)
 	struct inode *lower_dir_inode = bkpfs_lower_inode(dir);
 	struct dentry *lower_dir_dentry;
 	struct path lower_path;
+	struct file *last_file;
 
-	printk("bkpfs unlink entered\n");
 	bkpfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
+	last_file = __bkpfs_open_last_link(&lower_path);
 	dget(lower_dentry);
 	lower_dir_dentry = lock_parent(lower_dentry);
 
@@ -116,6 +144,13 @@ static int bkpfs_unlink(struct inode *dir, struct dentry *dentry)
 	d_drop(dentry); /* this is needed, else LTP fails (VFS won't do it) */
 out:
 	unlock_dir(lower_dir_dentry);
+	/*
+	 * meta_mutex is taken outside of the lower directory lock, as a
+	 * backup holds it while it creates files in that directory.
+	 */
+	if (!err)
+		bkpfs_invalidate_meta(d_inode(dentry));
+	__bkpfs_put_last_link(d_inode(dentry), last_file, !err);
 	dput(lower_dentry);
 	bkpfs_put_lower_path(dentry, &lower_path);
 	return err;
@@ -129,7 +164,6 @@ static int bkpfs_symlink(struct inode *dir, struct dentry *dentry,
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
 
-	printk("bkpfs_symlink entered\n");
 	bkpfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	lower_parent_dentry = lock_parent(lower_dentry);
@@ -156,7 +190,6 @@ static int bkpfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
 
-	printk("bkpfs_mkdir entered\n");
 	bkpfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	lower_parent_dentry = lock_parent(lower_dentry);
@@ -187,7 +220,6 @@ static int bkpfs_rmdir(struct inode *dir, struct dentry *dentry)
 	int err;
 	struct path lower_path;
 
-	printk("bkpfs_rmdir entered\n");
 	bkpfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	lower_dir_dentry = lock_parent(lower_dentry);
@@ -217,7 +249,6 @@ static int bkpfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
 
-	printk("bkpfs_mknod entered\n");
 	bkpfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	lower_parent_dentry = lock_parent(lower_dentry);
@@ -253,8 +284,8 @@ static int bkpfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	struct dentry *lower_new_dir_dentry = NULL;
 	struct dentry *trap = NULL;
 	struct path lower_old_path, lower_new_path;
+	struct file *last_file = NULL;
 
-	printk("bkpfs_rename entered\n");
 	if (flags)
 		return -EINVAL;
 
@@ -262,6 +293,9 @@ static int bkpfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	bkpfs_get_lower_path(new_dentry, &lower_new_path);
 	lower_old_dentry = lower_old_path.dentry;
 	lower_new_dentry = lower_new_path.dentry;
+	/* A file renamed over goes away like an unlinked one */
+	if (d_really_is_positive(new_dentry))
+		last_file = __bkpfs_open_last_link(&lower_new_path);
 	lower_old_dir_dentry = dget_parent(lower_old_dentry);
 	lower_new_dir_dentry = dget_parent(lower_new_dentry);
 
@@ -294,6 +328,17 @@ static int bkpfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 
 out:
 	unlock_rename(lower_old_dir_dentry, lower_new_dir_dentry);
+	/*
+	 * Cached backup metadata was read under the old names. It is
+	 * dropped once the lower directories are unlocked, see
+	 * bkpfs_unlink().
+	 */
+	if (!err) {
+		bkpfs_invalidate_meta(d_inode(old_dentry));
+		if (d_really_is_positive(new_dentry))
+			bkpfs_invalidate_meta(d_inode(new_dentry));
+	}
+	__bkpfs_put_last_link(d_inode(new_dentry), last_file, !err);
 	dput(lower_old_dir_dentry);
 	dput(lower_new_dir_dentry);
 	bkpfs_put_lower_path(old_dentry, &lower_old_path);
@@ -307,8 +352,7 @@ static int bkpfs_readlink(struct dentry *dentry, char __user *buf, int bufsiz)
 	struct dentry *lower_dentry;
 	struct path lower_path;
 
-	printk("bkpfs_readlink entered\n");
-	bkpfs_get_lower_path(dentry, &lower_path);
+	bkpfs_peek_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	if (!d_inode(lower_dentry)->i_op ||
 	    !d_inode(lower_dentry)->i_op->readlink) {
@@ -323,10 +367,30 @@ static int bkpfs_readlink(struct dentry *dentry, char __user *buf, int bufsiz)
 	fsstack_copy_attr_atime(d_inode(dentry), d_inode(lower_dentry));
 
 out:
-	bkpfs_put_lower_path(dentry, &lower_path);
 	return err;
 }
 
+/*
+ * Hands the link to the lower inode, which may keep its target in
+ * memory (i_link) or in the page cache. It returns -ECHILD itself if
+ * it can not do without blocking.
+ */
+static const char *__bkpfs_get_link_rcu(struct inode *inode,
+					struct delayed_call *done)
+{
+	struct inode *lower_inode = READ_ONCE(BKPFS_I(inode)->lower_inode);
+	const char *link;
+
+	if (!lower_inode)
+		return ERR_PTR(-ECHILD);
+	link = READ_ONCE(lower_inode->i_link);
+	if (link)
+		return link;
+	if (!lower_inode->i_op->get_link)
+		return ERR_PTR(-ECHILD);
+	return lower_inode->i_op->get_link(NULL, lower_inode, done);
+}
+
 static const char *bkpfs_get_link(struct dentry *dentry, struct inode *inode,
 				   struct delayed_call *done)
 {
@@ -334,9 +398,9 @@ static const char *bkpfs_get_link(struct dentry *dentry, struct inode *inode,
 	int len = PAGE_SIZE, err;
 	mm_segment_t old_fs;
 
-	printk("bkpfs_get_link entered\n");
+	/* RCU walk, which only the lower file system can follow the link in */
 	if (!dentry)
-		return ERR_PTR(-ECHILD);
+		return __bkpfs_get_link_rcu(inode, done);
 
 	/* This is freed by the put_link method assuming a successful call. */
 	buf = kmalloc(len, GFP_KERNEL);
@@ -365,8 +429,13 @@ static int bkpfs_permission(struct inode *inode, int mask)
 	struct inode *lower_inode;
 	int err;
 
-	printk("bkpfs_permission entered\n");
-	lower_inode = bkpfs_lower_inode(inode);
+	/*
+	 * Also called in RCU walk mode (MAY_NOT_BLOCK), where the inode
+	 * may be on its way out and have let go of the lower one.
+	 */
+	lower_inode = READ_ONCE(BKPFS_I(inode)->lower_inode);
+	if (!lower_inode)
+		return -ECHILD;
 	err = inode_permission(lower_inode, mask);
 	return err;
 }
@@ -379,8 +448,8 @@ static int bkpfs_setattr(struct dentry *dentry, struct iattr *ia)
 	struct inode *lower_inode;
 	struct path lower_path;
 	struct iattr lower_ia;
+	loff_t old_size;
 
-	printk("bkpfs_setattr entered \n");
 	inode = d_inode(dentry);
 
 	/*
@@ -430,12 +499,18 @@ static int bkpfs_setattr(struct dentry *dentry, struct iattr *ia)
 	 * tries to open(), unlink(), then ftruncate() a file.
 	 */
 	inode_lock(d_inode(lower_dentry));
+	old_size = i_size_read(d_inode(lower_dentry));
 	err = notify_change(lower_dentry, &lower_ia, /* note: lower_ia */
 			    NULL);
 	inode_unlock(d_inode(lower_dentry));
 	if (err)
 		goto out;
 
+	/* the bytes between the old and the new eof changed too */
+	if (ia->ia_valid & ATTR_SIZE)
+		bkpfs_mark_dirty(inode, min(old_size, ia->ia_size),
+				 max(old_size, ia->ia_size));
+
 	/* get attributes from the lower inode */
 	fsstack_copy_attr_all(inode, lower_inode);
 	/*
@@ -457,13 +532,8 @@ static int bkpfs_getattr(const struct path *path, struct kstat *stat,
         struct dentry *dentry = path->dentry;
 	struct kstat lower_stat;
 	struct path lower_path;
-	struct dentry *lower_dentry; //abc
-
-	printk("bkpfs_getattr entered \n");
-	bkpfs_get_lower_path(dentry, &lower_path);
 
-	lower_dentry = lower_path.dentry;
-	printk("getattr lower dentry name is %s", lower_dentry->d_name.name);
+	bkpfs_peek_lower_path(dentry, &lower_path);
 	err = vfs_getattr(&lower_path, &lower_stat, request_mask, flags);
 	if (err)
 		goto out;
@@ -472,10 +542,16 @@ static int bkpfs_getattr(const struct path *path, struct kstat *stat,
 	generic_fillattr(d_inode(dentry), stat);
 	stat->blocks = lower_stat.blocks;
 out:
-	bkpfs_put_lower_path(dentry, &lower_path);
 	return err;
 }
 
+/* Checks if name is one of the xattrs bkpfs keeps its own state in */
+static int __bkpfs_is_private_xattr(const char *name)
+{
+	return !strcmp(name, BKPFS_META_XATTR) ||
+	       !strcmp(name, BKPFS_USAGE_XATTR);
+}
+
 static int
 bkpfs_setxattr(struct dentry *dentry, struct inode *inode, const char *name,
 		const void *value, size_t size, int flags)
@@ -483,7 +559,9 @@ bkpfs_setxattr(struct dentry *dentry, struct inode *inode, const char *name,
 	int err; struct dentry *lower_dentry;
 	struct path lower_path;
 
-	printk("bkpfs_setxattr entered \n");
+	/* The backup metadata is only changed by bkpfs itself */
+	if (__bkpfs_is_private_xattr(name))
+		return -EPERM;
 	bkpfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	if (!(d_inode(lower_dentry)->i_opflags & IOP_XATTR)) {
@@ -509,8 +587,9 @@ bkpfs_getxattr(struct dentry *dentry, struct inode *inode,
 	struct inode *lower_inode;
 	struct path lower_path;
 
-	printk("bkpfs_getxattr entered \n");
-	bkpfs_get_lower_path(dentry, &lower_path);
+	if (__bkpfs_is_private_xattr(name))
+		return -ENODATA;
+	bkpfs_peek_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	lower_inode = bkpfs_lower_inode(inode);
 	if (!(d_inode(lower_dentry)->i_opflags & IOP_XATTR)) {
@@ -523,10 +602,28 @@ bkpfs_getxattr(struct dentry *dentry, struct inode *inode,
 	fsstack_copy_attr_atime(d_inode(dentry),
 				d_inode(lower_path.dentry));
 out:
-	bkpfs_put_lower_path(dentry, &lower_path);
 	return err;
 }
 
+/* Drops the xattrs of bkpfs itself from a list of xattr names */
+static ssize_t __bkpfs_hide_meta_xattr(char *buffer, ssize_t len)
+{
+	char *name = buffer;
+	size_t name_len;
+
+	while (name < buffer + len) {
+		name_len = strlen(name) + 1;
+		if (__bkpfs_is_private_xattr(name)) {
+			memmove(name, name + name_len,
+				buffer + len - name - name_len);
+			len -= name_len;
+			continue;
+		}
+		name += name_len;
+	}
+	return len;
+}
+
 static ssize_t
 bkpfs_listxattr(struct dentry *dentry, char *buffer, size_t buffer_size)
 {
@@ -534,20 +631,20 @@ bkpfs_listxattr(struct dentry *dentry, char *buffer, size_t buffer_size)
 	struct dentry *lower_dentry;
 	struct path lower_path;
 
-	printk("bkpfs_listxattr entered \n");
-	bkpfs_get_lower_path(dentry, &lower_path);
+	bkpfs_peek_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	if (!(d_inode(lower_dentry)->i_opflags & IOP_XATTR)) {
 		err = -EOPNOTSUPP;
 		goto out;
 	}
 	err = vfs_listxattr(lower_dentry, buffer, buffer_size);
-	if (err)
+	if (err <= 0)
 		goto out;
+	if (buffer)
+		err = __bkpfs_hide_meta_xattr(buffer, err);
 	fsstack_copy_attr_atime(d_inode(dentry),
 				d_inode(lower_path.dentry));
 out:
-	bkpfs_put_lower_path(dentry, &lower_path);
 	return err;
 }
 
@@ -559,7 +656,8 @@ bkpfs_removexattr(struct dentry *dentry, struct inode *inode, const char *name)
 	struct inode *lower_inode;
 	struct path lower_path;
 
-	printk("bkpfs_removexattr entered \n");
+	if (__bkpfs_is_private_xattr(name))
+		return -EPERM;
 	bkpfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	lower_inode = bkpfs_lower_inode(inode);
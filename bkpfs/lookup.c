@@ -16,7 +16,6 @@ static struct kmem_cache *bkpfs_dentry_cachep;
 
 int bkpfs_init_dentry_cache(void)
 {
-	printk("bkpfs_init_dentry_cache entered\n");
 	bkpfs_dentry_cachep =
 		kmem_cache_create("bkpfs_dentry",
 				  sizeof(struct bkpfs_dentry_info),
@@ -27,17 +26,30 @@ int bkpfs_init_dentry_cache(void)
 
 void bkpfs_destroy_dentry_cache(void)
 {
-	printk("bkpfs_destroy_dentry_cache entered\n");
+	/* wait for free_dentry_private_data() */
+	rcu_barrier();
 	if (bkpfs_dentry_cachep)
 		kmem_cache_destroy(bkpfs_dentry_cachep);
 }
 
+static void bkpfs_dentry_callback(struct rcu_head *head)
+{
+	struct bkpfs_dentry_info *info =
+		container_of(head, struct bkpfs_dentry_info, rcu);
+
+	kmem_cache_free(bkpfs_dentry_cachep, info);
+}
+
+/* freed after a grace period, as RCU path walks read it without a lock */
 void free_dentry_private_data(struct dentry *dentry)
 {
+	struct bkpfs_dentry_info *info;
+
 	if (!dentry || !dentry->d_fsdata)
 		return;
-	kmem_cache_free(bkpfs_dentry_cachep, dentry->d_fsdata);
-	dentry->d_fsdata = NULL;
+	info = dentry->d_fsdata;
+	WRITE_ONCE(dentry->d_fsdata, NULL);
+	call_rcu(&info->rcu, bkpfs_dentry_callback);
 }
 
 /* allocate new dentry private data */
@@ -50,7 +62,7 @@ int new_dentry_private_data(struct dentry *dentry)
 	if (!info)
 		return -ENOMEM;
 
-	spin_lock_init(&info->lock);
+	seqlock_init(&info->lock);
 	dentry->d_fsdata = info;
 
 	return 0;
@@ -76,7 +88,6 @@ struct inode *bkpfs_iget(struct super_block *sb, struct inode *lower_inode)
 	struct bkpfs_inode_info *info;
 	struct inode *inode; /* the new inode to return */
 
-	printk("bkpfs_iget (inode initialization) entered \n");
 	if (!igrab(lower_inode))
 		return ERR_PTR(-ESTALE);
 	inode = iget5_locked(sb, /* our superblock */
@@ -197,7 +208,6 @@ int bkpfs_interpose(struct dentry *dentry, struct super_block *sb,
 {
 	struct dentry *ret_dentry;
 
-	printk("bkpfs_interpose entered \n");
 	ret_dentry = __bkpfs_interpose(dentry, sb, lower_path);
 	return PTR_ERR(ret_dentry);
 }
@@ -218,7 +228,6 @@ static struct dentry *__bkpfs_lookup(struct dentry *dentry,
 	struct dentry *lower_dentry;
 	const char *name;
 	struct path lower_path;
-	struct qstr this;
 	struct dentry *ret_dentry = NULL;
 
 	/* must initialize dentry operations */
@@ -233,13 +242,33 @@ static struct dentry *__bkpfs_lookup(struct dentry *dentry,
 	lower_dir_dentry = lower_parent_path->dentry;
 	lower_dir_mnt = lower_parent_path->mnt;
 
-	/* Use vfs_path_lookup to check if the dentry exists or not */
-	err = vfs_path_lookup(lower_dir_dentry, lower_dir_mnt, name, 0,
-			      &lower_path);
+	/*
+	 * A single name only needs the lower dcache. The lower directory
+	 * is only locked if the name is not cached there, and a miss goes
+	 * to the lower ->lookup, which decides whether to cache it.
+	 */
+	lower_dentry = lookup_one_len_unlocked(name, lower_dir_dentry,
+					       dentry->d_name.len);
+	if (IS_ERR(lower_dentry)) {
+		err = PTR_ERR(lower_dentry);
+		goto out;
+	}
+
+	/* a full walk knows which mounts to cross, see __bkpfs_interpose */
+	if (d_managed(lower_dentry)) {
+		dput(lower_dentry);
+		err = vfs_path_lookup(lower_dir_dentry, lower_dir_mnt, name, 0,
+				      &lower_path);
+		if (err)
+			goto out;
+	} else {
+		lower_path.dentry = lower_dentry;
+		lower_path.mnt = mntget(lower_dir_mnt);
+	}
+	bkpfs_set_lower_path(dentry, &lower_path);
 
 	/* no error: handle positive dentries */
-	if (!err) {
-		bkpfs_set_lower_path(dentry, &lower_path);
+	if (d_really_is_positive(lower_path.dentry)) {
 		ret_dentry =
 			__bkpfs_interpose(dentry, dentry->d_sb, &lower_path);
 		if (IS_ERR(ret_dentry)) {
@@ -251,39 +280,14 @@ static struct dentry *__bkpfs_lookup(struct dentry *dentry,
 	}
 
 	/*
-	 * We don't consider ENOENT an error, and we want to return a
-	 * negative dentry.
+	 * Misses are cached like on the lower file system: the negative
+	 * dentry pins the lower one until the dcache shrinks it, and it
+	 * is dropped earlier once the lower file system stops caching
+	 * the miss or the name shows up below, see bkpfs_d_delete() and
+	 * bkpfs_d_revalidate(). If the intent is to create a file, the
+	 * VFS goes on to make it a positive one.
 	 */
-	if (err && err != -ENOENT)
-		goto out;
-
-	/* instatiate a new negative dentry */
-	this.name = name;
-	this.len = strlen(name);
-	this.hash = full_name_hash(lower_dir_dentry, this.name, this.len);
-	lower_dentry = d_lookup(lower_dir_dentry, &this);
-	if (lower_dentry)
-		goto setup_lower;
-
-	lower_dentry = d_alloc(lower_dir_dentry, &this);
-	if (!lower_dentry) {
-		err = -ENOMEM;
-		goto out;
-	}
-	d_add(lower_dentry, NULL); /* instantiate and hash */
-
-setup_lower:
-	lower_path.dentry = lower_dentry;
-	lower_path.mnt = mntget(lower_dir_mnt);
-	bkpfs_set_lower_path(dentry, &lower_path);
-
-	/*
-	 * If the intent is to create a file, then don't return an error, so
-	 * the VFS will continue the process of making this negative dentry
-	 * into a positive one.
-	 */
-	if (err == -ENOENT || (flags & (LOOKUP_CREATE|LOOKUP_RENAME_TARGET)))
-		err = 0;
+	d_add(dentry, NULL);
 
 out:
 	if (err)
@@ -298,10 +302,16 @@ struct dentry *bkpfs_lookup(struct inode *dir, struct dentry *dentry,
 	struct dentry *ret, *parent;
 	struct path lower_parent_path;
 
-	printk("bkpfs_lookup entered \n");
 	parent = dget_parent(dentry);
 
-	bkpfs_get_lower_path(parent, &lower_parent_path);
+	bkpfs_peek_lower_path(parent, &lower_parent_path);
+
+	/* the backup store is not part of the namespace */
+	if (IS_ROOT(parent) &&
+	    bkpfs_is_store_name(dir->i_sb, &dentry->d_name)) {
+		ret = ERR_PTR(-ENOENT);
+		goto out;
+	}
 
 	/* allocate dentry private data.  We free it in ->d_release */
 	err = new_dentry_private_data(dentry);
@@ -310,8 +320,6 @@ struct dentry *bkpfs_lookup(struct inode *dir, struct dentry *dentry,
 		goto out;
 	}
 	ret = __bkpfs_lookup(dentry, flags, &lower_parent_path);
-	if (!ret)
-		printk("lookup returns null\n");
 	if (IS_ERR(ret))
 		goto out;
 	if (ret)
@@ -324,7 +332,6 @@ struct dentry *bkpfs_lookup(struct inode *dir, struct dentry *dentry,
 				bkpfs_lower_inode(d_inode(parent)));
 
 out:
-	bkpfs_put_lower_path(parent, &lower_parent_path);
 	dput(parent);
 	return ret;
 }
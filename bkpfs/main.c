@@ -10,9 +10,15 @@
  */
 
 #include "bkpfs.h"
+#include "main.h"
 #include <linux/module.h>
 
-long maxbkpver = 10;
+/* what bkpfs_mount() hands to bkpfs_read_super() */
+struct bkpfs_mount_data {
+	const char *dev_name;
+	struct bkpfs_mount_opts opts;
+};
+
 /*
  * There is no need to lock the bkpfs_super_info's rwsem as there is no
  * way anyone can have a reference to the superblock at this point in time.
@@ -22,7 +28,9 @@ static int bkpfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	int err = 0;
 	struct super_block *lower_sb;
 	struct path lower_path;
-	char *dev_name = (char *)raw_data;
+	struct bkpfs_mount_data *data = raw_data;
+	const char *dev_name = data->dev_name;
+	struct bkpfs_mount_opts *opts;
 	struct inode *inode;
 
 	//pr_info("bkpfs_read_super entered\n");
@@ -49,12 +57,54 @@ static int bkpfs_read_super(struct super_block *sb, void *raw_data, int silent)
 		err = -ENOMEM;
 		goto out_free;
 	}
+	opts = BKPFS_OPTS(sb);
+	*opts = data->opts;
+
+	err = bkpfs_init_sb_work(sb);
+	if (err)
+		goto out_freesbi;
 
 	/* set the lower superblock field of upper superblock */
 	lower_sb = lower_path.dentry->d_sb;
 	atomic_inc(&lower_sb->s_active);
 	bkpfs_set_lower_super(sb, lower_sb);
 
+	/* keep versions in a hidden store at the lower root */
+	if (opts->store) {
+		err = bkpfs_init_store(sb, &lower_path);
+		if (err) {
+			pr_info(KERN_ERR
+			       "bkpfs: cannot set up the backup store: %d\n",
+			       err);
+			goto out_sput;
+		}
+	}
+	/* compressed versions need the algorithm when they are made */
+	err = bkpfs_init_comp(sb);
+	if (err) {
+		pr_info(KERN_ERR "bkpfs: %s compression is not available\n",
+			bkpfs_comp_name(opts->compress));
+		err = -ENOPROTOOPT;
+		goto out_sput;
+	}
+	/* split full versions into chunks kept once in the store */
+	if (opts->chunk) {
+		err = bkpfs_init_chunks(sb);
+		if (err) {
+			pr_info(KERN_ERR
+			       "bkpfs: cannot set up the chunk store: %d\n",
+			       err);
+			goto out_sput;
+		}
+	}
+	/* the bytes taken by versions are kept across mounts */
+	err = bkpfs_load_usage(sb, lower_path.dentry);
+	if (err) {
+		pr_info(KERN_ERR "bkpfs: cannot read the backup usage: %d\n",
+			err);
+		goto out_sput;
+	}
+
 	/* inherit maxbytes from lower file system */
 	sb->s_maxbytes = lower_sb->s_maxbytes;
 
@@ -113,6 +163,12 @@ out_iput:
 out_sput:
 	/* drop refs we took earlier */
 	atomic_dec(&lower_sb->s_active);
+	bkpfs_put_usage(sb);
+	bkpfs_put_comp(sb);
+	bkpfs_put_chunks(sb);
+	bkpfs_put_store(sb);
+	bkpfs_destroy_sb_work(sb);
+out_freesbi:
 	kfree(BKPFS_SB(sb));
 	sb->s_fs_info = NULL;
 out_free:
@@ -122,64 +178,235 @@ out:
 	return err;
 }
 
+/*
+ * Returns the value of a "name=value" mount option if option is
+ * exp_option.  The option string is left untouched so that it can
+ * be matched against several names.
+ */
 long parse_option(char *option, char *exp_option)
 {
-	char *opt_name;
-	//char *opt_val_str;
+	char *opt_val_str;
 	long opt_val;
-	int err = 0;
+	int err = 0, len;
 
 	if (!option || !exp_option)
 		return -EINVAL;
 
-	pr_info("current option is %s\n", option);
-	opt_name = strsep(&option, "=");
-	if (!opt_name)
+	len = strlen(exp_option);
+	if (strncmp(option, exp_option, len) != 0 || option[len] != '=')
 		return -EINVAL;
 
-	if (strncmp(opt_name, exp_option, strlen(exp_option)) != 0)
+	opt_val_str = option + len + 1;
+	err = kstrtol(opt_val_str, 10, &opt_val);
+	if (err)
+		return err;
+	return opt_val;
+}
+
+/*
+ * Like parse_option(), for a size in bytes that may end in K, M or G.
+ */
+static long parse_size_option(char *option, char *exp_option)
+{
+	char *opt_val_str, *end;
+	long opt_val;
+	int len;
+
+	if (!option || !exp_option)
 		return -EINVAL;
 
-	opt_name = strsep(&option, "=");
-	if (!opt_name)
+	len = strlen(exp_option);
+	if (strncmp(option, exp_option, len) != 0 || option[len] != '=')
 		return -EINVAL;
 
-	err = kstrtol(opt_name, 10, &opt_val);
-	if (err)
-		return err;
+	opt_val_str = option + len + 1;
+	opt_val = memparse(opt_val_str, &end);
+	if (end == opt_val_str || *end || opt_val < 0)
+		return -EINVAL;
 	return opt_val;
 }
 
-struct dentry *bkpfs_mount(struct file_system_type *fs_type, int flags,
-			   const char *dev_name, void *raw_data)
+/*
+ * Parses a time in seconds that may end in m, h, d or w.
+ */
+static int parse_duration(char *str, time64_t *secs)
+{
+	char *end;
+	unsigned long long val, unit;
+
+	val = simple_strtoull(str, &end, 10);
+	if (end == str)
+		return -EINVAL;
+	switch (*end) {
+	case 'w':
+		unit = 7 * 24 * 60 * 60;
+		break;
+	case 'd':
+		unit = 24 * 60 * 60;
+		break;
+	case 'h':
+		unit = 60 * 60;
+		break;
+	case 'm':
+		unit = 60;
+		break;
+	case 's':
+	case '\0':
+		unit = 1;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (*end)
+		end++;
+	/* checked before multiplying, so that it cannot wrap */
+	if (*end || val > S64_MAX / unit)
+		return -EINVAL;
+	*secs = val * unit;
+	return 0;
+}
+
+/*
+ * Parses the tiers of -o retain=STEP/AGE:STEP/AGE:..., each keeping one
+ * version per STEP among the versions up to AGE old, or all of them
+ * for a STEP of 0. The tiers must be ordered by AGE.
+ */
+static int parse_retain(char *option, struct bkpfs_mount_opts *opts)
+{
+	char *tier, *step;
+	int err;
+	long n = 0;
+	struct bkp_tier tiers[BKP_RETAIN_MAX];
+
+	if (strncmp(option, "retain=", 7) != 0)
+		return -EINVAL;
+	option += 7;
+	while ((tier = strsep(&option, ":")) != NULL) {
+		if (n == BKP_RETAIN_MAX)
+			return -E2BIG;
+		step = strsep(&tier, "/");
+		if (!tier)
+			return -EINVAL;
+		err = parse_duration(step, &tiers[n].step);
+		if (!err)
+			err = parse_duration(tier, &tiers[n].age);
+		if (err)
+			return err;
+		if (n && tiers[n].age <= tiers[n - 1].age)
+			return -EINVAL;
+		n++;
+	}
+	/* Only a complete list replaces the tiers */
+	memcpy(opts->retain, tiers, n * sizeof(*tiers));
+	opts->nretain = n;
+	return 0;
+}
+
+/*
+ * Parses the mount options into opts, which start out with the
+ * defaults. Options that are not known are ignored, but a compress
+ * option naming an unknown algorithm, or asked for along with chunk,
+ * fails the mount.
+ */
+static int parse_mount_options(char *raw_data, struct bkpfs_mount_opts *opts)
 {
-	void *lower_path_name = (void *)dev_name;
 	char *option;
 	long opt_val = -1;
 
-	//pr_info("bkpfs_mount entered\n");
-	pr_info("raw data at mount: %s\n", (char *)raw_data);
-
-	// Parse the mount options
-	while ((option = strsep((char **)&raw_data, ",")) != NULL) {
-		pr_info("%s\n", option);
+	while ((option = strsep(&raw_data, ",")) != NULL) {
 		opt_val = parse_option(option, "maxver");
 		if (opt_val > 0)
-			maxbkpver = opt_val;
+			opts->maxver = opt_val;
+		opt_val = parse_option(option, "async");
+		if (opt_val >= 0)
+			opts->async = opt_val;
+		opt_val = parse_option(option, "debounce");
+		if (opt_val >= 0)
+			opts->debounce = opt_val;
+		opt_val = parse_option(option, "metaxattr");
+		if (opt_val >= 0)
+			opts->metaxattr = opt_val;
+		opt_val = parse_option(option, "store");
+		if (opt_val >= 0)
+			opts->store = opt_val;
+		opt_val = parse_option(option, "delta");
+		if (opt_val >= 0)
+			opts->delta = min_t(long, opt_val, BKP_DELTA_MAX);
+		opt_val = parse_option(option, "dedup");
+		if (opt_val >= 0)
+			opts->dedup = opt_val;
+		opt_val = parse_option(option, "chunk");
+		if (opt_val >= 0)
+			opts->chunk = opt_val;
+		opt_val = parse_option(option, "ring");
+		if (opt_val >= 0)
+			opts->ring = opt_val;
+		opt_val = parse_option(option, "reap");
+		if (opt_val >= 0)
+			opts->reap = opt_val;
+		opt_val = parse_size_option(option, "maxsize");
+		if (opt_val >= 0)
+			opts->maxsize = opt_val;
+		opt_val = parse_size_option(option, "mntmaxsize");
+		if (opt_val >= 0)
+			opts->mntmaxsize = opt_val;
+		if (!strncmp(option, "retain=", 7) &&
+		    parse_retain(option, opts))
+			pr_info(KERN_ERR "bkpfs: ignoring bad retain tiers\n");
+		/* compress alone picks lz4 */
+		if (!strcmp(option, "compress") ||
+		    !strcmp(option, "compress=lz4"))
+			opts->compress = BKP_COMPRESS_LZ4;
+		else if (!strcmp(option, "compress=zstd"))
+			opts->compress = BKP_COMPRESS_ZSTD;
+		else if (!strncmp(option, "compress=", 9)) {
+			pr_info(KERN_ERR "bkpfs: unknown compression %s\n",
+				option + 9);
+			return -EINVAL;
+		}
 	}
-	if (opt_val == -1)
-		maxbkpver = 10;
-	pr_info("at mount, maxbkpver=%ld\n", maxbkpver);
+	/* Chunked versions are not compressed, see README */
+	if (opts->chunk && opts->compress) {
+		pr_info(KERN_ERR "bkpfs: chunk and compress do not mix\n");
+		return -EINVAL;
+	}
+	/* The chunks are kept in the backup store */
+	if (opts->chunk)
+		opts->store = 1;
+	return 0;
+}
 
-	return mount_nodev(fs_type, flags, lower_path_name,
-			   bkpfs_read_super);
+/*
+ * The options are parsed here, before there is a superblock, and
+ * handed to bkpfs_read_super() to keep, so every mount has its own.
+ */
+struct dentry *bkpfs_mount(struct file_system_type *fs_type, int flags,
+			   const char *dev_name, void *raw_data)
+{
+	int err;
+	struct bkpfs_mount_data data = {
+		.dev_name = dev_name,
+		.opts.maxver = 10,
+	};
+
+	err = parse_mount_options(raw_data, &data.opts);
+	if (err)
+		return ERR_PTR(err);
+	return mount_nodev(fs_type, flags, &data, bkpfs_read_super);
+}
+
+/* let queued backups finish before the superblock goes away */
+static void bkpfs_kill_super(struct super_block *sb)
+{
+	bkpfs_drain_backups(sb);
+	generic_shutdown_super(sb);
 }
 
 static struct file_system_type bkpfs_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= BKPFS_NAME,
 	.mount		= bkpfs_mount,
-	.kill_sb	= generic_shutdown_super,
+	.kill_sb	= bkpfs_kill_super,
 	.fs_flags	= 0,
 };
 MODULE_ALIAS_FS(BKPFS_NAME);
@@ -190,6 +417,8 @@ static int __init init_bkpfs_fs(void)
 
 	pr_info("Registering bkpfs " BKPFS_VERSION "\n");
 
+	bkpfs_init_gear();
+
 	err = bkpfs_init_inode_cache();
 	if (err)
 		goto out;
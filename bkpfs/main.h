@@ -1,3 +1,6 @@
-/* mount options */
-extern long maxbkpver;
-//static long maxbkpsize;
+/* longest a burst of closes can hold back a backup, in debounce windows */
+#define BKP_DEBOUNCE_MAX 8
+/* longest chain of delta versions on top of a full one */
+#define BKP_DELTA_MAX 64
+/* the reaper runs this many times a second while it has work */
+#define BKP_REAP_TICKS 10
@@ -74,6 +74,12 @@ static int bkpfs_page_mkwrite(struct vm_fault *vmf)
 	err = lower_vm_ops->page_mkwrite(vmf);
 	vmf->vma = vma; /* restore vma */
 out:
+	/* the page is about to be written through the mapping */
+	if (!(err & VM_FAULT_ERROR)) {
+		BKPFS_F(file)->is_write = 1;
+		bkpfs_mark_dirty(file_inode(file), page_offset(vmf->page),
+				 page_offset(vmf->page) + PAGE_SIZE);
+	}
 	return err;
 }
 
@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+#include "main.h"
+
+/*
+ * With -o store=1 the backups of a file are not kept next to it but
+ * in a hidden store at the root of the lower directory:
+ *
+ *	<lower root>/.bkpfs_store/<hh>/<ino>-<gen>/v.bkpNNN
+ *
+ * The per-file directories are keyed by the lower inode and spread
+ * over BKP_STORE_BUCKETS buckets, so no lower directory grows with
+ * the number of versions and the directories users see only hold
+ * their own files. The store belongs to the mounter and is only
+ * accessed with its credentials, see bkpfs_store_creds().
+ */
+#define BKP_STORE_BUCKETS 256
+
+/*
+ * Looks up name in dir and creates it as a directory if it does
+ * not exist yet. Caller must path_put the result.
+ */
+int bkpfs_store_mkdir(struct path *dir, const char *name,
+		      struct path *path)
+{
+	int err = 0;
+	struct dentry *dentry;
+	struct inode *dir_inode = d_inode(dir->dentry);
+
+	inode_lock_nested(dir_inode, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, dir->dentry, strlen(name));
+	if (IS_ERR(dentry)) {
+		err = PTR_ERR(dentry);
+		goto out;
+	}
+	if (d_really_is_negative(dentry)) {
+		err = vfs_mkdir(dir_inode, dentry, 0700);
+		if (!err && d_really_is_negative(dentry))
+			err = -ENOENT;
+	} else if (!d_is_dir(dentry)) {
+		err = -ENOTDIR;
+	}
+	if (err) {
+		dput(dentry);
+		goto out;
+	}
+	path->mnt = mntget(dir->mnt);
+	path->dentry = dentry;
+out:
+	inode_unlock(dir_inode);
+	return err;
+}
+
+/* Sets up the store of a new mount under lower_root */
+int bkpfs_init_store(struct super_block *sb, struct path *lower_root)
+{
+	int err;
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	const struct cred *old_cred;
+
+	mutex_init(&sbi->chunk_mutex);
+	sbi->store_cred = prepare_creds();
+	if (!sbi->store_cred)
+		return -ENOMEM;
+
+	old_cred = override_creds(sbi->store_cred);
+	err = bkpfs_store_mkdir(lower_root, BKPFS_STORE_NAME,
+				&sbi->bkp_store);
+	revert_creds(old_cred);
+	if (err) {
+		put_cred(sbi->store_cred);
+		sbi->store_cred = NULL;
+	}
+	return err;
+}
+
+void bkpfs_put_store(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (!sbi->store_cred)
+		return;
+	path_put(&sbi->bkp_store);
+	put_cred(sbi->store_cred);
+	sbi->store_cred = NULL;
+}
+
+/*
+ * Names the bucket and the directory in it that hold the versions
+ * of the file behind lower_inode in the store.
+ */
+static void __bkpfs_store_names(struct inode *lower_inode, char *bucket,
+				char *name, size_t len)
+{
+	snprintf(bucket, len, "%02lx",
+		 (lower_inode->i_ino ^ lower_inode->i_generation) %
+		 BKP_STORE_BUCKETS);
+	snprintf(name, len, "%lu-%u",
+		 lower_inode->i_ino, lower_inode->i_generation);
+}
+
+/*
+ * Gets the store directory of the file behind lower_inode. It is
+ * only created if create is set, otherwise -ENOENT is returned
+ * for a file that has nothing in the store. Must be called with
+ * the store credentials. Caller must path_put the result.
+ */
+int bkpfs_get_store_dir(struct super_block *sb, struct inode *lower_inode,
+			int create, struct path *dir)
+{
+	int err;
+	char bucket_name[32], name[32];
+	struct path bucket;
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	/* Versions in the store are unreachable if it is not mounted */
+	if (!bkpfs_has_store(sb))
+		return -ENOENT;
+
+	__bkpfs_store_names(lower_inode, bucket_name, name, sizeof(name));
+	if (create)
+		err = bkpfs_store_mkdir(&sbi->bkp_store, bucket_name, &bucket);
+	else
+		err = vfs_path_lookup(sbi->bkp_store.dentry,
+				      sbi->bkp_store.mnt, bucket_name, 0,
+				      &bucket);
+	if (err)
+		return err;
+
+	if (create)
+		err = bkpfs_store_mkdir(&bucket, name, dir);
+	else
+		err = vfs_path_lookup(bucket.dentry, bucket.mnt, name, 0, dir);
+	path_put(&bucket);
+	return err;
+}
+
+/*
+ * Removes the store directory of the file behind lower_inode, which
+ * must hold nothing but backup files already removed or queued for
+ * the reaper. With -o reap the rmdir is queued behind them. Must be
+ * called with the store credentials.
+ */
+int bkpfs_remove_store_dir(struct super_block *sb, struct inode *lower_inode)
+{
+	int err;
+	char bucket_name[32], name[32];
+	struct path bucket;
+	struct dentry *dentry;
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (!bkpfs_has_store(sb))
+		return 0;
+
+	__bkpfs_store_names(lower_inode, bucket_name, name, sizeof(name));
+	err = vfs_path_lookup(sbi->bkp_store.dentry, sbi->bkp_store.mnt,
+			      bucket_name, 0, &bucket);
+	if (err)
+		return err == -ENOENT ? 0 : err;
+
+	if (sbi->opts.reap && !bkpfs_reap_later(sb, &bucket, name, 1))
+		goto out;
+	inode_lock_nested(d_inode(bucket.dentry), I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, bucket.dentry, strlen(name));
+	err = PTR_ERR_OR_ZERO(dentry);
+	if (!err) {
+		if (d_really_is_positive(dentry))
+			err = vfs_rmdir(d_inode(bucket.dentry), dentry);
+		dput(dentry);
+	}
+	inode_unlock(d_inode(bucket.dentry));
+out:
+	path_put(&bucket);
+	return err;
+}
+
+/* Checks if name is the store at the root of a mount using one */
+int bkpfs_is_store_name(struct super_block *sb, const struct qstr *name)
+{
+	if (!bkpfs_has_store(sb))
+		return 0;
+	return name->len == strlen(BKPFS_STORE_NAME) &&
+	       !memcmp(name->name, BKPFS_STORE_NAME, name->len);
+}
+
+/*
+ * Switches to the credentials the store is accessed with. Returns
+ * the credentials to hand to bkpfs_revert_store_creds(), or NULL
+ * if the mount does not use a store.
+ */
+const struct cred *bkpfs_store_creds(struct super_block *sb)
+{
+	if (!bkpfs_has_store(sb))
+		return NULL;
+	return override_creds(BKPFS_SB(sb)->store_cred);
+}
+
+void bkpfs_revert_store_creds(const struct cred *old_cred)
+{
+	if (old_cred)
+		revert_creds(old_cred);
+}
@@ -10,6 +10,7 @@
  */
 
 #include "bkpfs.h"
+#include "main.h"
 
 /*
  * The inode cache is used with alloc_inode for both our inode info and the
@@ -27,6 +28,13 @@ static void bkpfs_put_super(struct super_block *sb)
 	if (!spd)
 		return;
 
+	/* no backups may be running once the lower sb reference is gone */
+	bkpfs_destroy_sb_work(sb);
+	bkpfs_put_usage(sb);
+	bkpfs_put_comp(sb);
+	bkpfs_put_chunks(sb);
+	bkpfs_put_store(sb);
+
 	/* decrement lower super references */
 	s = bkpfs_lower_super(sb);
 	bkpfs_set_lower_super(sb, NULL);
@@ -36,14 +44,152 @@ static void bkpfs_put_super(struct super_block *sb)
 	sb->s_fs_info = NULL;
 }
 
+/* sync(2) also waits for backups that were deferred to the workqueue */
+static int bkpfs_sync_fs(struct super_block *sb, int wait)
+{
+	if (wait)
+		bkpfs_drain_backups(sb);
+	bkpfs_save_usage(sb);
+	return 0;
+}
+
+/*
+ * With -o mntmaxsize the bytes taken by all versions of the mount are
+ * kept in an xattr of the lower root while it is not mounted, so the
+ * budget can be enforced without looking for the backups. Versions
+ * made while the mount went without the option are not counted.
+ * Changes are only made in memory and saved BKP_USAGE_DELAY later,
+ * on sync(2) and at unmount, so backups do not take turns on the
+ * inode lock of the lower root.
+ */
+#define BKP_USAGE_DELAY (5 * HZ)
+
+static void __bkpfs_save_usage(struct bkpfs_sb_info *sbi)
+{
+	struct dentry *root = sbi->usage_root;
+	__le64 usage;
+	int err;
+
+	if (!root)
+		return;
+	/* Read under the lock, so the last one to save has the latest */
+	inode_lock(d_inode(root));
+	usage = cpu_to_le64(atomic64_read(&sbi->bkp_bytes));
+	err = __vfs_setxattr_noperm(root, BKPFS_USAGE_XATTR, &usage,
+				    sizeof(usage), 0);
+	inode_unlock(d_inode(root));
+	if (err)
+		pr_err("bkpfs: cannot save the backup usage: %d\n", err);
+}
+
+static void bkpfs_usage_worker(struct work_struct *work)
+{
+	__bkpfs_save_usage(container_of(to_delayed_work(work),
+					struct bkpfs_sb_info, usage_dwork));
+}
+
+int bkpfs_load_usage(struct super_block *sb, struct dentry *lower_root)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	__le64 usage;
+	ssize_t len;
+
+	atomic64_set(&sbi->bkp_bytes, 0);
+	spin_lock_init(&sbi->usage_lock);
+	INIT_LIST_HEAD(&sbi->usage_inodes);
+	INIT_DELAYED_WORK(&sbi->usage_dwork, bkpfs_usage_worker);
+	if (!sbi->opts.mntmaxsize)
+		return 0;
+	len = __vfs_getxattr(lower_root, d_inode(lower_root),
+			     BKPFS_USAGE_XATTR, &usage, sizeof(usage));
+	if (len == sizeof(usage))
+		atomic64_set(&sbi->bkp_bytes, le64_to_cpu(usage));
+	else if (len < 0 && len != -ENODATA)
+		return len;
+	sbi->usage_cred = prepare_creds();
+	if (!sbi->usage_cred)
+		return -ENOMEM;
+	sbi->usage_root = dget(lower_root);
+	return 0;
+}
+
+void bkpfs_save_usage(struct super_block *sb)
+{
+	__bkpfs_save_usage(BKPFS_SB(sb));
+}
+
+/* bkp_bytes changed, save it soon if that is not already pending */
+void bkpfs_usage_changed(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (sbi->usage_root)
+		schedule_delayed_work(&sbi->usage_dwork, BKP_USAGE_DELAY);
+}
+
+void bkpfs_put_usage(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (!sbi->usage_root)
+		return;
+	cancel_delayed_work_sync(&sbi->usage_dwork);
+	bkpfs_save_usage(sb);
+	dput(sbi->usage_root);
+	sbi->usage_root = NULL;
+	put_cred(sbi->usage_cred);
+	sbi->usage_cred = NULL;
+}
+
+/*
+ * With -o mntmaxsize the files with versions are kept on a list of
+ * the mount while their inode is in memory, so the budget can take
+ * the oldest version of any of them, see __bkpfs_trim_mount().
+ * Called with the meta_mutex of the inode held.
+ */
+void bkpfs_track_usage(struct inode *inode, long num_bkps)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	struct bkpfs_inode_info *ii = BKPFS_I(inode);
+
+	if (!sbi->opts.mntmaxsize ||
+	    list_empty(&ii->usage_list) == !num_bkps)
+		return;
+	spin_lock(&sbi->usage_lock);
+	if (num_bkps)
+		list_add_tail(&ii->usage_list, &sbi->usage_inodes);
+	else
+		list_del_init(&ii->usage_list);
+	spin_unlock(&sbi->usage_lock);
+}
+
+void bkpfs_untrack_usage(struct inode *inode)
+{
+	struct bkpfs_inode_info *ii = BKPFS_I(inode);
+
+	mutex_lock(&ii->meta_mutex);
+	bkpfs_track_usage(inode, 0);
+	mutex_unlock(&ii->meta_mutex);
+}
+
+/* backup counters, shown in /proc/<pid>/mountstats */
+static int bkpfs_show_stats(struct seq_file *m, struct dentry *root)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(root->d_sb);
+
+	seq_printf(m, " coalesced=%lld usage=%lld",
+		   (long long)atomic64_read(&sbi->bkp_coalesced),
+		   (long long)atomic64_read(&sbi->bkp_bytes));
+	return 0;
+}
+
 static int bkpfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
 	int err;
 	struct path lower_path;
 
-	bkpfs_get_lower_path(dentry, &lower_path);
+	bkpfs_peek_lower_path(dentry, &lower_path);
 	err = vfs_statfs(&lower_path, buf);
-	bkpfs_put_lower_path(dentry, &lower_path);
 
 	/* set return buf to our f/s to avoid confusing user-level utils */
 	buf->f_type = BKPFS_SUPER_MAGIC;
@@ -85,12 +231,14 @@ static void bkpfs_evict_inode(struct inode *inode)
 
 	truncate_inode_pages(&inode->i_data, 0);
 	clear_inode(inode);
+	bkpfs_untrack_usage(inode);
+	bkpfs_invalidate_meta(inode);
 	/*
 	 * Decrement a reference to a lower_inode, which was incremented
 	 * by our read_inode when it was created initially.
 	 */
 	lower_inode = bkpfs_lower_inode(inode);
-	bkpfs_set_lower_inode(inode, NULL);
+	WRITE_ONCE(BKPFS_I(inode)->lower_inode, NULL);
 	iput(lower_inode);
 }
 
@@ -98,23 +246,34 @@ static struct inode *bkpfs_alloc_inode(struct super_block *sb)
 {
 	struct bkpfs_inode_info *i;
 
-	printk("bkpfs_alloc_inode entered \n");
 	i = kmem_cache_alloc(bkpfs_inode_cachep, GFP_KERNEL);
 	if (!i)
 		return NULL;
 
 	/* memset everything up to the inode to 0 */
 	memset(i, 0, offsetof(struct bkpfs_inode_info, vfs_inode));
+	bkpfs_init_inode_work(i);
+	mutex_init(&i->meta_mutex);
+	INIT_LIST_HEAD(&i->usage_list);
+	bkpfs_init_inode_dirty(i);
 
         atomic64_set(&i->vfs_inode.i_version, 1);
 	return &i->vfs_inode;
 }
 
-static void bkpfs_destroy_inode(struct inode *inode)
+static void bkpfs_i_callback(struct rcu_head *head)
 {
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+
 	kmem_cache_free(bkpfs_inode_cachep, BKPFS_I(inode));
 }
 
+/* an RCU path walk may still be looking at the inode, see bkpfs_permission */
+static void bkpfs_destroy_inode(struct inode *inode)
+{
+	call_rcu(&inode->i_rcu, bkpfs_i_callback);
+}
+
 /* bkpfs inode cache constructor */
 static void init_once(void *obj)
 {
@@ -139,6 +298,8 @@ int bkpfs_init_inode_cache(void)
 /* bkpfs inode cache destructor */
 void bkpfs_destroy_inode_cache(void)
 {
+	/* wait for the inodes still being freed by bkpfs_destroy_inode */
+	rcu_barrier();
 	if (bkpfs_inode_cachep)
 		kmem_cache_destroy(bkpfs_inode_cachep);
 }
@@ -158,6 +319,8 @@ static void bkpfs_umount_begin(struct super_block *sb)
 
 const struct super_operations bkpfs_sops = {
 	.put_super	= bkpfs_put_super,
+	.sync_fs	= bkpfs_sync_fs,
+	.show_stats	= bkpfs_show_stats,
 	.statfs		= bkpfs_statfs,
 	.remount_fs	= bkpfs_remount_fs,
 	.evict_inode	= bkpfs_evict_inode,
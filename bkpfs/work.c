@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+#include "main.h"
+
+/*
+ * Deferred backups of a file all go through its own work item, which
+ * the workqueue never runs concurrently with itself, so the versions
+ * of one file are made one after the other. Closes that come in while
+ * a backup is still pending are folded into it.
+ */
+static void bkpfs_backup_worker(struct work_struct *work)
+{
+	struct bkpfs_inode_info *info = container_of(to_delayed_work(work),
+						     struct bkpfs_inode_info,
+						     bkp_dwork);
+	struct inode *inode = &info->vfs_inode;
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	struct file *lower_file;
+	const struct cred *cred, *old_cred;
+	int err;
+
+	spin_lock(&info->bkp_lock);
+	lower_file = info->bkp_file;
+	cred = info->bkp_cred;
+	info->bkp_file = NULL;
+	info->bkp_cred = NULL;
+	spin_lock(&sbi->bkp_list_lock);
+	list_del_init(&info->bkp_list);
+	spin_unlock(&sbi->bkp_list_lock);
+	spin_unlock(&info->bkp_lock);
+	if (!lower_file)
+		return;
+
+	/* create the backup files as the user that closed the file */
+	old_cred = override_creds(cred);
+	err = bkpfs_backup_file(inode, lower_file);
+	revert_creds(old_cred);
+	if (err)
+		pr_err("bkpfs: backup of %pD failed: %d\n", lower_file, err);
+
+	fput(lower_file);
+	put_cred(cred);
+	/* give back the slot bkpfs_queue_backup() took for the file */
+	if (!sbi->opts.debounce) {
+		atomic_dec(&sbi->bkp_pending);
+		wake_up(&sbi->bkp_wait);
+	}
+	/* drop the reference taken when the backup was deferred */
+	iput(inode);
+}
+
+/*
+ * How long to hold back the backup of a file that was just closed.
+ * Every close within the debounce window pushes the backup out again,
+ * and files that keep being closed get a longer window (doubling the
+ * close count adds one more window, up to BKP_DEBOUNCE_MAX), so hot
+ * files get fewer versions.  A version is still made at most
+ * BKP_DEBOUNCE_MAX windows after the first close of a burst.
+ */
+static unsigned long __bkpfs_debounce_delay(struct bkpfs_inode_info *info)
+{
+	struct inode *inode = &info->vfs_inode;
+	unsigned long window, delay, deadline;
+
+	window = msecs_to_jiffies(BKPFS_OPTS(inode->i_sb)->debounce);
+	delay = window * min_t(unsigned int, ilog2(info->bkp_closes) + 1,
+			       BKP_DEBOUNCE_MAX);
+	deadline = info->bkp_first + window * BKP_DEBOUNCE_MAX;
+	if (time_after_eq(jiffies, deadline))
+		return 0;
+	return min(delay, deadline - jiffies);
+}
+
+/*
+ * Leave the backup of inode to its work item, made from lower_file,
+ * which replaces the one kept from earlier closes. With debounce set
+ * it is held back as __bkpfs_debounce_delay() says, otherwise it is
+ * made as soon as the worker gets to it. Returns 1 if a backup was
+ * pending already, which then covers this close too.
+ */
+static int __bkpfs_defer_backup(struct inode *inode, struct file *lower_file,
+				int debounce)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	struct file *old_file;
+	const struct cred *old_cred;
+
+	spin_lock(&info->bkp_lock);
+	old_file = info->bkp_file;
+	old_cred = info->bkp_cred;
+	if (old_file) {
+		info->bkp_closes++;
+		atomic64_inc(&sbi->bkp_coalesced);
+	} else {
+		/* pin the inode until the backup is made */
+		ihold(inode);
+		info->bkp_first = jiffies;
+		info->bkp_closes = 1;
+		spin_lock(&sbi->bkp_list_lock);
+		list_add_tail(&info->bkp_list, &sbi->bkp_debounced);
+		spin_unlock(&sbi->bkp_list_lock);
+	}
+	info->bkp_file = get_file(lower_file);
+	info->bkp_cred = get_current_cred();
+	mod_delayed_work(sbi->bkp_wq, &info->bkp_dwork,
+			 debounce ? __bkpfs_debounce_delay(info) : 0);
+	spin_unlock(&info->bkp_lock);
+
+	if (old_file) {
+		fput(old_file);
+		put_cred(old_cred);
+	}
+	return old_file != NULL;
+}
+
+/*
+ * Queue a backup of lower_file.  At most -o async files can have a
+ * backup pending per superblock; past that the caller waits for the
+ * worker to catch up.  The version holds the contents the file has
+ * when the worker gets to it, so writes made after this close may
+ * already be in it.
+ */
+int bkpfs_queue_backup(struct inode *inode, struct file *lower_file)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+
+	wait_event(sbi->bkp_wait,
+		   atomic_add_unless(&sbi->bkp_pending, 1, sbi->opts.async));
+	if (__bkpfs_defer_backup(inode, lower_file, 0)) {
+		/* the pending backup holds a slot already */
+		atomic_dec(&sbi->bkp_pending);
+		wake_up(&sbi->bkp_wait);
+	}
+	return 0;
+}
+
+/*
+ * Coalesce this close with any other closes of the same file within
+ * the debounce window, so that the whole burst produces one version.
+ */
+void bkpfs_debounce_backup(struct inode *inode, struct file *lower_file)
+{
+	__bkpfs_defer_backup(inode, lower_file, 1);
+}
+
+/* A backup file of a removed version, left for the reaper */
+struct bkpfs_reap {
+	struct list_head list;
+	struct path dir;
+	const struct cred *cred;
+	int isdir;		/* an emptied store directory to rmdir */
+	char name[];
+};
+
+/*
+ * Unlink the backup files on the batch list, which all live in the
+ * same lower directory, under a single lock of that directory.
+ */
+static void __bkpfs_reap_batch(struct list_head *batch)
+{
+	struct bkpfs_reap *r, *next;
+	struct dentry *dir, *dentry;
+	const struct cred *old_cred;
+	int err;
+
+	r = list_first_entry(batch, struct bkpfs_reap, list);
+	dir = r->dir.dentry;
+	inode_lock_nested(d_inode(dir), I_MUTEX_PARENT);
+	list_for_each_entry_safe(r, next, batch, list) {
+		/* as the user that removed the version */
+		old_cred = override_creds(r->cred);
+		dentry = lookup_one_len(r->name, dir, strlen(r->name));
+		err = PTR_ERR_OR_ZERO(dentry);
+		if (!err) {
+			if (d_really_is_positive(dentry) && r->isdir)
+				err = vfs_rmdir(d_inode(dir), dentry);
+			else if (d_really_is_positive(dentry))
+				err = vfs_unlink(d_inode(dir), dentry, NULL);
+			dput(dentry);
+		}
+		revert_creds(old_cred);
+		if (err)
+			pr_err("bkpfs: cannot remove backup %s: %d\n",
+			       r->name, err);
+
+		list_del(&r->list);
+		path_put(&r->dir);
+		put_cred(r->cred);
+		kfree(r);
+	}
+	inode_unlock(d_inode(dir));
+}
+
+/*
+ * Unlink up to budget queued backup files, batching the ones that
+ * share a directory. A directory is only removed once it comes up
+ * first, after the files that were queued in it before.
+ */
+static void __bkpfs_reap(struct bkpfs_sb_info *sbi, unsigned long budget)
+{
+	struct bkpfs_reap *r, *next, *first;
+	LIST_HEAD(batch);
+
+	while (budget) {
+		spin_lock(&sbi->reap_lock);
+		first = list_first_entry_or_null(&sbi->reap_list,
+						 struct bkpfs_reap, list);
+		if (!first) {
+			spin_unlock(&sbi->reap_lock);
+			break;
+		}
+		list_for_each_entry_safe(r, next, &sbi->reap_list, list) {
+			if (!budget)
+				break;
+			if (r->dir.dentry != first->dir.dentry ||
+			    (r != first && r->isdir))
+				continue;
+			list_move_tail(&r->list, &batch);
+			budget--;
+		}
+		spin_unlock(&sbi->reap_lock);
+		__bkpfs_reap_batch(&batch);
+	}
+}
+
+/*
+ * The reaper unlinks at most -o reap backup files a second, spread
+ * over BKP_REAP_TICKS runs, so that mass deletions do not compete
+ * with the foreground for the lower directory locks.
+ */
+static void bkpfs_reap_worker(struct work_struct *work)
+{
+	struct bkpfs_sb_info *sbi = container_of(to_delayed_work(work),
+						 struct bkpfs_sb_info,
+						 reap_dwork);
+	int empty;
+
+	__bkpfs_reap(sbi, max_t(long, DIV_ROUND_UP(sbi->opts.reap,
+						    BKP_REAP_TICKS), 1));
+	spin_lock(&sbi->reap_lock);
+	empty = list_empty(&sbi->reap_list);
+	spin_unlock(&sbi->reap_lock);
+	if (!empty)
+		queue_delayed_work(sbi->bkp_wq, &sbi->reap_dwork,
+				   HZ / BKP_REAP_TICKS);
+}
+
+/*
+ * Leave the unlink of the backup file name in dir to the reaper, or
+ * its rmdir if isdir is set. Returns an error if it could not be
+ * queued, in which case the caller has to remove it itself.
+ */
+int bkpfs_reap_later(struct super_block *sb, struct path *dir,
+		     const char *name, int isdir)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_reap *r;
+
+	r = kmalloc(sizeof(*r) + strlen(name) + 1, GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+	strcpy(r->name, name);
+	r->isdir = isdir;
+	r->dir = *dir;
+	path_get(&r->dir);
+	r->cred = get_current_cred();
+
+	spin_lock(&sbi->reap_lock);
+	list_add_tail(&r->list, &sbi->reap_list);
+	spin_unlock(&sbi->reap_lock);
+	queue_delayed_work(sbi->bkp_wq, &sbi->reap_dwork,
+			   HZ / BKP_REAP_TICKS);
+	return 0;
+}
+
+/* unlink everything the reaper still holds, without a rate limit */
+static void __bkpfs_flush_reaper(struct bkpfs_sb_info *sbi)
+{
+	cancel_delayed_work_sync(&sbi->reap_dwork);
+	__bkpfs_reap(sbi, ULONG_MAX);
+}
+
+/* wait for all queued backups of this superblock to complete */
+void bkpfs_drain_backups(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_inode_info *info;
+
+	if (!sbi || !sbi->bkp_wq)
+		return;
+
+	/* don't wait out the debounce window of pending backups */
+	spin_lock(&sbi->bkp_list_lock);
+	list_for_each_entry(info, &sbi->bkp_debounced, bkp_list)
+		mod_delayed_work(sbi->bkp_wq, &info->bkp_dwork, 0);
+	spin_unlock(&sbi->bkp_list_lock);
+
+	flush_workqueue(sbi->bkp_wq);
+	__bkpfs_flush_reaper(sbi);
+}
+
+/* set up the per-inode deferred backup state, called from ->alloc_inode */
+void bkpfs_init_inode_work(struct bkpfs_inode_info *info)
+{
+	spin_lock_init(&info->bkp_lock);
+	INIT_DELAYED_WORK(&info->bkp_dwork, bkpfs_backup_worker);
+	INIT_LIST_HEAD(&info->bkp_list);
+}
+
+int bkpfs_init_sb_work(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	sbi->bkp_wq = alloc_workqueue("bkpfs_bkp", WQ_UNBOUND, 0);
+	if (!sbi->bkp_wq)
+		return -ENOMEM;
+	atomic_set(&sbi->bkp_pending, 0);
+	init_waitqueue_head(&sbi->bkp_wait);
+	spin_lock_init(&sbi->bkp_list_lock);
+	INIT_LIST_HEAD(&sbi->bkp_debounced);
+	atomic64_set(&sbi->bkp_coalesced, 0);
+	spin_lock_init(&sbi->reap_lock);
+	INIT_LIST_HEAD(&sbi->reap_list);
+	INIT_DELAYED_WORK(&sbi->reap_dwork, bkpfs_reap_worker);
+	return 0;
+}
+
+void bkpfs_destroy_sb_work(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (!sbi->bkp_wq)
+		return;
+	/* the reaper holds references on lower directories */
+	__bkpfs_flush_reaper(sbi);
+	/* destroy_workqueue drains anything still queued */
+	destroy_workqueue(sbi->bkp_wq);
+	sbi->bkp_wq = NULL;
+}